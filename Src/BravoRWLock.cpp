@@ -0,0 +1,118 @@
+/**
+ *      File: BravoRWLock.cpp
+ *    Author: CS Lim
+ *   Purpose: Visible readers table of TBravoRWLock
+ *
+ *   Notes:
+ *      - One table for all locks. Slot is hashed from (lock, thread), so
+ *        readers of one lock spread over the table and readers of different
+ *        locks rarely collide.
+ *      - Each thread remembers the locks it holds on the fast path, so
+ *        LeaveRead() knows which path to undo even when another thread
+ *        published the same lock in the same slot.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+
+//===========================================================================
+// Private variables
+//===========================================================================
+// Fast-path reads a thread can hold at the same time. More go slow path.
+const unsigned BRAVO_MAX_HELD = 8;
+
+static std::atomic<const void *> s_visibleReaders[BRAVO_TABLE_SIZE];
+
+static thread_local const void * t_bravoHeld[BRAVO_MAX_HELD];
+static thread_local unsigned     t_bravoHeldCount;
+
+
+//===========================================================================
+// Private functions
+//===========================================================================
+static unsigned BravoSlot(const void * lock) {
+    // Address of a thread local identifies the thread
+    uint64_t key = (uint64_t)(uintptr_t)lock ^ ((uint64_t)(uintptr_t)&t_bravoHeldCount << 7);
+    key ^= key >> 29;
+    key *= 0xBF58476D1CE4E5B9ull;
+    key ^= key >> 32;
+    return (unsigned)(key % BRAVO_TABLE_SIZE);
+}
+
+
+//===========================================================================
+// Visible readers table
+//===========================================================================
+bool BravoPublish(const void * lock) {
+    if (t_bravoHeldCount == BRAVO_MAX_HELD)
+        return false;
+
+    std::atomic<const void *> & slot = s_visibleReaders[BravoSlot(lock)];
+    const void * expected = NULL;
+    if (slot.load(std::memory_order_relaxed) != NULL
+        || !slot.compare_exchange_strong(expected, lock, std::memory_order_seq_cst))
+        return false;
+
+    t_bravoHeld[t_bravoHeldCount++] = lock;
+    return true;
+}
+
+bool BravoWithdraw(const void * lock) {
+    // Most recent first
+    for (unsigned i = t_bravoHeldCount; i-- > 0; ) {
+        if (t_bravoHeld[i] != lock)
+            continue;
+
+        t_bravoHeld[i] = t_bravoHeld[--t_bravoHeldCount];
+        s_visibleReaders[BravoSlot(lock)].store(NULL, std::memory_order_release);
+        return true;
+    }
+    return false;
+}
+
+void BravoRevoke(const void * lock) {
+    // Caller just turned bias off. Store then load of another location
+    // may be reordered even when both are seq_cst on their own, so fence:
+    // either we see a reader's slot or it sees bias off (BravoPublish()).
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    for (unsigned i = 0; i < BRAVO_TABLE_SIZE; i++) {
+        for (unsigned spins = 0; s_visibleReaders[i].load(std::memory_order_acquire) == lock; spins++) {
+            if (spins < 64)
+                YieldProcessor();
+            else
+                SwitchToThread();
+        }
+    }
+}
+
+const void * BravoThreadId() {
+    // Address of a thread local identifies the thread
+    return &t_bravoHeldCount;
+}
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,380 @@
+/**
+ *      File: CohortRWLock.cpp
+ *    Author: CS Lim
+ *   Purpose: NUMA-aware cohort reader writer lock
+ *
+ *   Notes:
+ *      - Readers only touch their node's counter cache line. Writer sets
+ *        m_writerActive, then waits for every node's counter to drain.
+ *      - Writers queue on their node's local lock. The global lock goes
+ *        with the cohort: a leaving writer with local writers waiting
+ *        releases only the local lock, so the global lock and the
+ *        protected data stay in that node's caches.
+ *      - m_writerActive stays set across local handoffs (writer preference
+ *        within a cohort burst, bounded by COHORT_MAX_LOCAL_HANDOFFS).
+ *      - Reader remembers its node per lock in a small per-thread list
+ *        until LeaveRead(), since the thread may move to another node
+ *        meanwhile. A thread can hold up to MAX_HELD_READ_LOCKS read locks
+ *        (of different CCohortRWLock objects) at once. R -> R on the same
+ *        lock blocks behind a waiting writer and is "NOT" supported.
+ *      - Set RWLOCK_FAKE_NUMA_NODES=<n> to test with a fake topology.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+
+//===========================================================================
+// Private variables
+//===========================================================================
+static thread_local unsigned t_fakeNodeThread;
+static std::atomic<unsigned> s_fakeNodeThreads;
+
+// Node of each CCohortRWLock read lock the thread holds. LeaveRead()
+// must decrement the counter EnterRead() incremented, wherever the
+// thread runs by then.
+const unsigned MAX_HELD_READ_LOCKS = 16;
+
+struct HeldReadLock {
+    const CCohortRWLock *   lock;
+    unsigned                node;
+};
+
+static thread_local HeldReadLock    t_heldReads[MAX_HELD_READ_LOCKS];
+static thread_local unsigned        t_heldReadCount;
+
+// Per-node state, each on its own cache line(s)
+struct CCohortRWLock::NodeState {
+    std::atomic<uint32_t>   readers;
+    std::atomic<uint32_t>   localWaiters;
+
+    // Owned by the local lock holder
+    bool                    globalOwned;
+    unsigned                handoffs;
+    CCritSect               localLock;
+
+    uint8_t                 pad[
+        CACHELINE_SIZE - (
+            sizeof(std::atomic<uint32_t>) * 2 + sizeof(bool) + sizeof(unsigned) + sizeof(CCritSect)
+        ) % CACHELINE_SIZE
+    ];
+};
+
+
+//===========================================================================
+// Private functions
+//===========================================================================
+static void PushHeldRead(const CCohortRWLock * lock, unsigned node) {
+    unsigned count = t_heldReadCount;
+    if (count == MAX_HELD_READ_LOCKS) {
+        fprintf(stderr, "CCohortRWLock: more than %u read locks held\n", MAX_HELD_READ_LOCKS);
+        abort();
+    }
+    t_heldReads[count].lock = lock;
+    t_heldReads[count].node = node;
+    t_heldReadCount = count + 1;
+}
+
+static unsigned PopHeldRead(const CCohortRWLock * lock) {
+    // Usually the newest one
+    unsigned i = t_heldReadCount;
+    do {
+        _ASSERT(i != 0);
+        i--;
+    } while (t_heldReads[i].lock != lock);
+
+    unsigned node = t_heldReads[i].node;
+    t_heldReads[i] = t_heldReads[--t_heldReadCount];
+    return node;
+}
+
+
+//===========================================================================
+// CNumaTopology
+//===========================================================================
+CNumaTopology::CNumaTopology(unsigned fakeNodes) {
+    m_nodeCount = 1;
+    m_cpuCount = 0;
+    m_cpuNode = NULL;
+    m_fake = fakeNodes != 0;
+
+    if (m_fake)
+        m_nodeCount = fakeNodes < MAX_NUMA_NODES ? fakeNodes : MAX_NUMA_NODES;
+    else
+        Detect();
+}
+
+CNumaTopology::~CNumaTopology() {
+    delete [] m_cpuNode;
+}
+
+#if defined(_WIN32)
+
+void CNumaTopology::Detect() {
+    ULONG highest;
+    if (!GetNumaHighestNodeNumber(&highest) || highest == 0)
+        return;
+
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    m_cpuCount = info.dwNumberOfProcessors;
+    m_cpuNode = new uint8_t[m_cpuCount];
+
+    unsigned nodes = 0;
+    for (unsigned cpu = 0; cpu < m_cpuCount; cpu++) {
+        UCHAR node = 0;
+        GetNumaProcessorNode((UCHAR)cpu, &node);
+        if (node == 0xff || node >= MAX_NUMA_NODES)
+            node = 0;
+        m_cpuNode[cpu] = node;
+        if ((unsigned)node + 1 > nodes)
+            nodes = node + 1;
+    }
+    m_nodeCount = nodes ? nodes : 1;
+}
+
+#else
+
+// Parse a sysfs cpu list ("0-3,8-11") into cpuNode[]
+static void ParseCpuList(const char * list, uint8_t node, uint8_t * cpuNode, unsigned cpuCount) {
+    const char * p = list;
+    while (*p >= '0' && *p <= '9') {
+        char * end;
+        unsigned first = (unsigned)strtoul(p, &end, 10);
+        unsigned last = first;
+        if (*end == '-')
+            last = (unsigned)strtoul(end + 1, &end, 10);
+        for (unsigned cpu = first; cpu <= last && cpu < cpuCount; cpu++)
+            cpuNode[cpu] = node;
+        p = (*end == ',') ? end + 1 : end;
+    }
+}
+
+void CNumaTopology::Detect() {
+    m_cpuCount = (unsigned)sysconf(_SC_NPROCESSORS_CONF);
+    m_cpuNode = new uint8_t[m_cpuCount];
+    memset(m_cpuNode, 0, m_cpuCount);
+
+    // Node ids may have holes. Number the nodes found densely.
+    unsigned nodes = 0;
+    for (unsigned id = 0; id < 1024 && nodes < MAX_NUMA_NODES; id++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+        FILE * file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+
+        char list[4096];
+        if (fgets(list, sizeof(list), file) != NULL)
+            ParseCpuList(list, (uint8_t)nodes, m_cpuNode, m_cpuCount);
+        fclose(file);
+        nodes++;
+    }
+    m_nodeCount = nodes ? nodes : 1;
+}
+
+#endif
+
+const CNumaTopology & CNumaTopology::System() {
+    // Function-local static: safe to use from other static constructors
+    static CNumaTopology * s_system = NULL;
+    static CCritSect s_lock;
+
+    s_lock.Enter();
+    if (s_system == NULL) {
+        const char * fake = getenv("RWLOCK_FAKE_NUMA_NODES");
+        s_system = new CNumaTopology(fake ? (unsigned)atoi(fake) : 0);
+    }
+    s_lock.Leave();
+    return *s_system;
+}
+
+unsigned CNumaTopology::GetNodeCount() const {
+    return m_nodeCount;
+}
+
+bool CNumaTopology::IsFake() const {
+    return m_fake;
+}
+
+unsigned CNumaTopology::GetCurrentNode() const {
+    if (m_nodeCount == 1)
+        return 0;
+
+    if (m_fake) {
+        // Round robin by thread, assigned on first use
+        if (t_fakeNodeThread == 0)
+            t_fakeNodeThread = ++s_fakeNodeThreads;
+        return t_fakeNodeThread % m_nodeCount;
+    }
+
+    unsigned cpu = GetCurrentProcessorNumber();
+    return cpu < m_cpuCount ? m_cpuNode[cpu] : 0;
+}
+
+
+//===========================================================================
+// CCohortRWLock implementation
+//===========================================================================
+CCohortRWLock::CCohortRWLock(const CNumaTopology & topology)
+    : m_topology(topology)
+{
+    unsigned count = m_topology.GetNodeCount();
+    m_nodes = (NodeState *)AlignedAlloc(sizeof(NodeState) * count);
+    for (unsigned i = 0; i < count; i++) {
+        NodeState * node = new (&m_nodes[i]) NodeState;
+        node->readers = 0;
+        node->localWaiters = 0;
+        node->globalOwned = false;
+        node->handoffs = 0;
+    }
+
+    m_globalLock = 0;
+    m_writerActive = 0;
+    m_readersWaiting = 0;
+    m_writerNode = 0;
+    m_localHandoffs = 0;
+    m_globalHandoffs = 0;
+}
+
+CCohortRWLock::~CCohortRWLock() {
+    for (unsigned i = 0; i < m_topology.GetNodeCount(); i++)
+        m_nodes[i].~NodeState();
+    AlignedFree(m_nodes);
+}
+
+void CCohortRWLock::AcquireGlobal() {
+    uint32_t state = 0;
+    if (m_globalLock.compare_exchange_strong(state, 1, std::memory_order_acquire))
+        return;
+
+    // Mark contended and sleep until free
+    while (m_globalLock.exchange(2, std::memory_order_acquire) != 0)
+        FutexWait(&m_globalLock, 2);
+}
+
+void CCohortRWLock::ReleaseGlobal() {
+    if (m_globalLock.exchange(0, std::memory_order_release) == 2)
+        FutexWakeAll(&m_globalLock);
+}
+
+void CCohortRWLock::EnterRead() {
+    unsigned node = m_topology.GetCurrentNode();
+    std::atomic<uint32_t> & readers = m_nodes[node].readers;
+
+    for (;;) {
+        // seq_cst pairs with EnterWrite(): either the writer sees our count
+        // or we see m_writerActive
+        readers.fetch_add(1, std::memory_order_seq_cst);
+        if (!m_writerActive.load(std::memory_order_seq_cst))
+            break;
+
+        // Writer preference: back off, waking the writer if we were last
+        if (readers.fetch_sub(1, std::memory_order_seq_cst) == 1)
+            FutexWakeAll(&readers);
+
+        m_readersWaiting.fetch_add(1, std::memory_order_seq_cst);
+        if (m_writerActive.load(std::memory_order_seq_cst))
+            FutexWait(&m_writerActive, 1);
+        m_readersWaiting.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    PushHeldRead(this, node);
+}
+
+void CCohortRWLock::LeaveRead() {
+    std::atomic<uint32_t> & readers = m_nodes[PopHeldRead(this)].readers;
+    if (readers.fetch_sub(1, std::memory_order_seq_cst) == 1
+        && m_writerActive.load(std::memory_order_seq_cst))
+        FutexWakeAll(&readers);
+}
+
+void CCohortRWLock::EnterWrite() {
+    unsigned node = m_topology.GetCurrentNode();
+    NodeState & state = m_nodes[node];
+
+    state.localWaiters.fetch_add(1, std::memory_order_relaxed);
+    state.localLock.Enter();
+    state.localWaiters.fetch_sub(1, std::memory_order_relaxed);
+
+    if (state.globalOwned) {
+        // Handed over by previous writer of this node. m_writerActive is
+        // still set and readers are still drained.
+        m_writerNode = node;
+        return;
+    }
+
+    AcquireGlobal();
+    state.globalOwned = true;
+    state.handoffs = 0;
+    m_writerNode = node;
+    m_globalHandoffs.fetch_add(1, std::memory_order_relaxed);
+
+    m_writerActive.store(1, std::memory_order_seq_cst);
+
+    // Wait for readers of every node to drain
+    for (unsigned i = 0; i < m_topology.GetNodeCount(); i++) {
+        std::atomic<uint32_t> & readers = m_nodes[i].readers;
+        unsigned spins = 0;
+        uint32_t count;
+        while ((count = readers.load(std::memory_order_acquire)) != 0) {
+            if (spins++ < 256)
+                YieldProcessor();
+            else
+                FutexWait(&readers, count);
+        }
+    }
+}
+
+void CCohortRWLock::LeaveWrite() {
+    NodeState & state = m_nodes[m_writerNode];
+
+    // Pass the lock within the cohort
+    if (state.localWaiters.load(std::memory_order_relaxed) != 0
+        && ++state.handoffs < COHORT_MAX_LOCAL_HANDOFFS) {
+        m_localHandoffs.fetch_add(1, std::memory_order_relaxed);
+        state.localLock.Leave();
+        return;
+    }
+
+    state.globalOwned = false;
+    m_writerActive.store(0, std::memory_order_seq_cst);
+    if (m_readersWaiting.load(std::memory_order_seq_cst))
+        FutexWakeAll(&m_writerActive);
+
+    ReleaseGlobal();
+    state.localLock.Leave();
+}
+
+uint64_t CCohortRWLock::GetLocalHandoffs() const {
+    return m_localHandoffs.load(std::memory_order_relaxed);
+}
+
+uint64_t CCohortRWLock::GetGlobalHandoffs() const {
+    return m_globalHandoffs.load(std::memory_order_relaxed);
+}
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,130 @@
+/**
+ *      File: Common.cpp
+ *    Author: CS Lim
+ *   Purpose: Platform support code shared by the reader writer locks
+ *
+ *   Notes:
+ *      - On Linux FlushProcessWriteBuffers() is emulated with
+ *        membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED) (Linux 4.14 and later).
+ *        It issues an IPI to every CPU currently running a thread of this
+ *        process, same as the Windows API.
+ *      - Older kernels fall back to changing the protection of a locked page,
+ *        which makes the kernel do a TLB shootdown IPI to the same CPUs.
+ *        A failing membarrier() call switches to it as well.
+ *      - Without a working barrier readers and writers no longer exclude
+ *        each other, so if the fallback fails too the process aborts.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+#if !defined(_WIN32)
+
+//===========================================================================
+// Private variables
+//===========================================================================
+
+static pthread_mutex_t      s_dummyPageLock = PTHREAD_MUTEX_INITIALIZER;
+static long volatile *      s_dummyPage;
+static std::atomic<bool>    s_membarrierFailed;
+
+
+//===========================================================================
+// Private functions
+//===========================================================================
+static long Membarrier (int cmd, unsigned flags) {
+    return syscall(__NR_membarrier, cmd, flags);
+}
+
+static void BarrierFailed (const char * call) {
+    fprintf(stderr, "FlushProcessWriteBuffers: %s failed (%d)\n", call, errno);
+    abort();
+}
+
+static bool InitMembarrier () {
+    long cmds = Membarrier(MEMBARRIER_CMD_QUERY, 0);
+    if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+        return false;
+
+    // Process must register its intent before using the private expedited
+    // command, otherwise membarrier() fails with EPERM
+    return Membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) == 0;
+}
+
+static void InitDummyPage () {
+    void * page = mmap(
+        NULL,
+        sysconf(_SC_PAGESIZE),
+        PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (page == MAP_FAILED)
+        BarrierFailed("mmap");
+
+    // Page must stay resident or mprotect() has nothing to shoot down
+    if (mlock(page, sysconf(_SC_PAGESIZE)) != 0)
+        BarrierFailed("mlock");
+    s_dummyPage = (long volatile *)page;
+}
+
+static void FlushByTlbShootdown () {
+    pthread_mutex_lock(&s_dummyPageLock);
+    if (s_dummyPage == NULL)
+        InitDummyPage();
+
+    // Make the page writable and dirty it so that every CPU running one of
+    // our threads may cache the mapping, then revoke write access. The kernel
+    // has to flush those TLB entries by IPI, which serializes the CPUs.
+    if (mprotect((void *)s_dummyPage, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE) != 0)
+        BarrierFailed("mprotect");
+    AtomicIncrement(s_dummyPage);
+    if (mprotect((void *)s_dummyPage, sysconf(_SC_PAGESIZE), PROT_READ) != 0)
+        BarrierFailed("mprotect");
+    pthread_mutex_unlock(&s_dummyPageLock);
+}
+
+
+//===========================================================================
+// Exported functions
+//===========================================================================
+void FlushProcessWriteBuffers () {
+    static const bool s_hasMembarrier = InitMembarrier();
+
+    // Registered and queried at startup, so a failure here is unexpected
+    // (e.g. seccomp). Don't retry it on every call.
+    if (s_hasMembarrier && !s_membarrierFailed.load(std::memory_order_relaxed)) {
+        if (Membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0) == 0)
+            return;
+        s_membarrierFailed.store(true, std::memory_order_relaxed);
+    }
+    FlushByTlbShootdown();
+}
+
+#endif // !defined(_WIN32)
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
@@ -0,0 +1,260 @@
+/**
+ *      File: HybridRWLock.cpp
+ *    Author: CS Lim
+ *   Purpose: Reader writer lock switching between asymmetric (CRWLock)
+ *            and symmetric (shared reader counter) mode by write rate
+ *
+ *   Notes:
+ *      - Asymmetric mode: readers use CRWLock, every writer pays the
+ *        FlushProcessWriteBuffers() IPI. Best for rare writes.
+ *      - Symmetric mode: readers share a CFutexRWLock counter, writers
+ *        pay no IPI. Best once writes are frequent.
+ *      - Writers always take m_symLock and, in asymmetric mode, m_asymLock
+ *        after it. Mode is changed only while both are held for write.
+ *      - Readers pick a lock by mode and check mode again once inside. If
+ *        it changed meanwhile they back off and retry with the other lock.
+ *        In asymmetric mode the recheck is ordered by CRWLock's own
+ *        handshake: either the switching writer waited for us, or we see
+ *        its m_writerPending release and the new mode with it.
+ *      - Mode follows cost, not write rate alone: writers time the barrier
+ *        and reader drain of m_asymLock and compare it with what the reads
+ *        of the same window would pay for the shared counter. Readers
+ *        count reads per thread and add them to m_windowReads in batches,
+ *        so the asymmetric read path stays free of shared writes.
+ *        Readers bring the lock back to asymmetric mode when writes stop
+ *        altogether.
+ *      - Not reentrant.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+
+//===========================================================================
+// Private variables
+//===========================================================================
+// A symmetric mode read is two atomic adds on a counter shared by all
+// readers, around 100 ns once readers on several cores bounce its cache
+// line. Leave asymmetric mode when barriers cost twice what reads would
+// for 3 windows, go back once they cost less than half for 10 windows. A
+// single slow drain (reader preempted) doesn't make a hot streak.
+//                                             window  read   sym  asym  hot  calm
+const HybridRWLockPolicy HYBRID_RWLOCK_DEFAULT = {  10,   100,  200,   50,   3,   10 };
+
+// Reads a thread counts before adding them to m_windowReads
+const unsigned HYBRID_READ_BATCH = 64;
+
+// Symmetric mode reads between checks for writes having stopped
+const unsigned HYBRID_IDLE_CHECK_READS = 1024;
+
+static thread_local unsigned t_hybridReads;
+
+
+//===========================================================================
+// CHybridRWLock implementation
+//===========================================================================
+CHybridRWLock::CHybridRWLock(const HybridRWLockPolicy & policy) {
+    m_mode = MODE_ASYMMETRIC;
+    m_toSymmetric = 0;
+    m_toAsymmetric = 0;
+    m_policy = policy;
+    m_windowReads = 0;
+    m_windowStart = LockClock::now();
+    m_windowWrites = 0;
+    m_windowBarrierNs = 0;
+    m_barrierNs = 0;
+    m_hotWindows = 0;
+    m_calmWindows = 0;
+    m_lastWrite = m_windowStart.time_since_epoch().count();
+}
+
+void CHybridRWLock::EnterRead() {
+    for (;;) {
+        if (m_mode.load(std::memory_order_acquire) == MODE_ASYMMETRIC) {
+            m_asymLock.EnterRead();
+            if (m_mode.load(std::memory_order_acquire) == MODE_ASYMMETRIC)
+                return;
+            m_asymLock.LeaveRead();
+        }
+        else {
+            m_symLock.EnterRead();
+            if (m_mode.load(std::memory_order_acquire) == MODE_SYMMETRIC)
+                return;
+            m_symLock.LeaveRead();
+        }
+    }
+}
+
+void CHybridRWLock::CountRead() {
+    // Per thread, not per lock: a thread using several locks adds its
+    // batch to whichever one completes it
+    if (++t_hybridReads % HYBRID_READ_BATCH == 0)
+        m_windowReads.fetch_add(HYBRID_READ_BATCH, std::memory_order_relaxed);
+}
+
+void CHybridRWLock::LeaveRead() {
+    // Can't change while we hold the lock
+    if (m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC) {
+        m_asymLock.LeaveRead();
+        CountRead();
+        return;
+    }
+
+    m_symLock.LeaveRead();
+    CountRead();
+
+    // No writer left to sample the write rate?
+    if (t_hybridReads % HYBRID_IDLE_CHECK_READS == 0) {
+        LockClock::duration idle = LockClock::now().time_since_epoch()
+            - LockClock::duration(m_lastWrite.load(std::memory_order_relaxed));
+        if (idle >= std::chrono::milliseconds(m_policy.windowMs * m_policy.calmWindows))
+            TrySwitchToAsymmetric();
+    }
+}
+
+void CHybridRWLock::EnterWrite() {
+    m_symLock.EnterWrite();
+    if (m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC) {
+        // m_symLock keeps other writers out, so this is the barrier and
+        // the reader drain
+        LockClock::time_point start = LockClock::now();
+        m_asymLock.EnterWrite();
+        m_windowBarrierNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            LockClock::now() - start
+        ).count();
+    }
+}
+
+void CHybridRWLock::LeaveWrite() {
+    // Switching back to asymmetric mode takes m_asymLock, switching to
+    // symmetric mode keeps it. Release it in both cases.
+    bool asymmetric = m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC;
+    SampleWriteRate();
+
+    if (asymmetric || m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC)
+        m_asymLock.LeaveWrite();
+    m_symLock.LeaveWrite();
+}
+
+void CHybridRWLock::SampleWriteRate() {
+    LockClock::time_point now = LockClock::now();
+    m_lastWrite.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+    m_windowWrites++;
+
+    LockClock::duration window = std::chrono::milliseconds(m_policy.windowMs);
+    LockClock::duration elapsed = now - m_windowStart;
+    if (elapsed < window)
+        return;
+
+    // Normalize to one window. Sparse writes span several windows.
+    unsigned windows = (unsigned)(elapsed / window);
+    uint64_t reads = m_windowReads.exchange(0, std::memory_order_relaxed) / windows;
+    uint64_t barrierNs;
+    if (m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC) {
+        barrierNs = m_windowBarrierNs / windows;
+        if (windows == 1) {
+            // Smoothed, one slow drain shouldn't keep symmetric mode on
+            uint64_t perWrite = m_windowBarrierNs / m_windowWrites;
+            m_barrierNs = m_barrierNs ? (m_barrierNs * 3 + perWrite) / 4 : perWrite;
+        }
+    }
+    else {
+        // No barriers in symmetric mode, estimate from the last measured
+        barrierNs = (uint64_t)m_windowWrites * m_barrierNs / windows;
+    }
+    m_windowStart = now;
+    m_windowWrites = 0;
+    m_windowBarrierNs = 0;
+
+    // Barrier time in percent of the reads' symmetric cost, compared
+    // without dividing so reads == 0 works
+    uint64_t barrierPercent = barrierNs * 100;
+    uint64_t readCostNs = reads * m_policy.readCostNs;
+    if (m_mode.load(std::memory_order_relaxed) == MODE_ASYMMETRIC) {
+        // Writes spread over several windows are rare either way. Their
+        // reads were counted over idle time too, or not at all yet.
+        if (windows > 1 || barrierPercent < readCostNs * m_policy.symmetricPercent)
+            m_hotWindows = 0;
+        else if (++m_hotWindows >= m_policy.hotWindows)
+            SwitchToSymmetric();
+    }
+    else if (barrierPercent > readCostNs * m_policy.asymmetricPercent) {
+        m_calmWindows = 0;
+    }
+    else if ((m_calmWindows += windows) >= m_policy.calmWindows) {
+        m_asymLock.EnterWrite();
+        SwitchToAsymmetric();
+    }
+}
+
+void CHybridRWLock::SwitchToSymmetric() {
+    // Holding both locks for write. Readers blocked on m_asymLock retry
+    // on m_symLock once we leave.
+    m_mode.store(MODE_SYMMETRIC, std::memory_order_release);
+    m_calmWindows = 0;
+    m_toSymmetric.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CHybridRWLock::SwitchToAsymmetric() {
+    // Holding both locks for write. LeaveWrite() releases m_asymLock too.
+    m_mode.store(MODE_ASYMMETRIC, std::memory_order_release);
+    m_hotWindows = 0;
+    m_calmWindows = 0;
+    m_toAsymmetric.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CHybridRWLock::TrySwitchToAsymmetric() {
+    // Some reader almost always holds the lock, so a plain try would
+    // rarely succeed. Wait a little: new readers queue up behind us.
+    LockClock::time_point deadline = LockClock::now() + std::chrono::milliseconds(1);
+    if (!m_symLock.EnterWriteUntil(deadline))
+        return;
+
+    if (m_mode.load(std::memory_order_relaxed) == MODE_SYMMETRIC) {
+        m_asymLock.EnterWrite();
+        SwitchToAsymmetric();
+        m_windowStart = LockClock::now();
+        m_windowWrites = 0;
+        m_windowBarrierNs = 0;
+        m_windowReads.store(0, std::memory_order_relaxed);
+        m_asymLock.LeaveWrite();
+    }
+    m_symLock.LeaveWrite();
+}
+
+bool CHybridRWLock::IsSymmetric() const {
+    return m_mode.load(std::memory_order_relaxed) == MODE_SYMMETRIC;
+}
+
+uint64_t CHybridRWLock::GetSymmetricSwitches() const {
+    return m_toSymmetric.load(std::memory_order_relaxed);
+}
+
+uint64_t CHybridRWLock::GetAsymmetricSwitches() const {
+    return m_toAsymmetric.load(std::memory_order_relaxed);
+}
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,156 @@
+/**
+ *      File: LeftRight.cpp
+ *    Author: CS Lim
+ *   Purpose: Left-Right concurrency control for small read-mostly objects
+ *
+ *   Notes:
+ *      - Writer after changing the free instance:
+ *          1. m_leftRight = free instance, then FlushProcessWriteBuffers().
+ *             Any reader not visible in an indicator from now on loads the
+ *             new m_leftRight.
+ *          2. Wait for the indicator new readers don't use (stragglers of
+ *             the previous write), switch m_versionIndex to it, then wait
+ *             for the other one. Readers keep arriving on the indicator we
+ *             don't wait for, so the writer can't be starved.
+ *          3. Nobody reads the old instance anymore, change it too.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+
+//===========================================================================
+// Private constants
+//===========================================================================
+
+// Pause instructions per busy reader before the writer starts yielding
+const unsigned LEFTRIGHT_SPIN_LIMIT = 1000;
+
+
+//===========================================================================
+// CReaderIndicator implementation
+//===========================================================================
+CReaderIndicator::CReaderIndicator() {
+    for (unsigned i = 0; i < RWLOCK_INLINE_READER_COUNT; i++)
+        m_readers[i].store(0, std::memory_order_relaxed);
+    m_overflowReaders.store(NULL, std::memory_order_relaxed);
+}
+
+CReaderIndicator::~CReaderIndicator() {
+    delete [] m_overflowReaders.load(std::memory_order_relaxed);
+}
+
+std::atomic<uint8_t> & CReaderIndicator::OverflowReaderFlag(unsigned index) {
+    std::atomic<uint8_t> * readers = m_overflowReaders.load(std::memory_order_acquire);
+    if (readers == NULL) {
+        const unsigned count = MAX_RWLOCK_READER_COUNT - RWLOCK_INLINE_READER_COUNT;
+        std::atomic<uint8_t> * alloc = new std::atomic<uint8_t>[count];
+        for (unsigned i = 0; i < count; i++)
+            alloc[i].store(0, std::memory_order_relaxed);
+
+        // Another thread may have beaten us
+        if (m_overflowReaders.compare_exchange_strong(readers, alloc, std::memory_order_acq_rel))
+            readers = alloc;
+        else
+            delete [] alloc;
+    }
+    return readers[index - RWLOCK_INLINE_READER_COUNT];
+}
+
+void CReaderIndicator::WaitForReaders(const std::atomic<uint8_t> * flags, unsigned count) const {
+    unsigned index = FindBusyRWLockReader(flags, count);
+    while (index < count) {
+        unsigned spins = 0;
+        while (flags[index].load(std::memory_order_acquire) != 0) {
+            if (spins < LEFTRIGHT_SPIN_LIMIT) {
+                spins++;
+                YieldProcessor();
+            }
+            else {
+                SwitchToThread();
+            }
+        }
+
+        // Readers already checked may have come back. They arrived after
+        // the barrier, so they don't matter.
+        index++;
+        index += FindBusyRWLockReader(flags + index, count - index);
+    }
+
+    // Pairs with the release store in Depart()
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void CReaderIndicator::WaitEmpty() const {
+    unsigned highWater = GetRWLockThreadHighWater();
+    if (highWater <= RWLOCK_INLINE_READER_COUNT) {
+        WaitForReaders(m_readers, highWater);
+        return;
+    }
+
+    WaitForReaders(m_readers, RWLOCK_INLINE_READER_COUNT);
+    const std::atomic<uint8_t> * overflow = m_overflowReaders.load(std::memory_order_acquire);
+    if (overflow != NULL)
+        WaitForReaders(overflow, highWater - RWLOCK_INLINE_READER_COUNT);
+}
+
+
+//===========================================================================
+// CLeftRight implementation
+//===========================================================================
+CLeftRight::CLeftRight() {
+    m_leftRight = 0;
+    m_versionIndex = 0;
+}
+
+unsigned CLeftRight::BeginWrite() {
+    m_writeLock.Enter();
+    return m_leftRight.load(std::memory_order_relaxed) ^ 1;
+}
+
+unsigned CLeftRight::Publish() {
+    unsigned written = m_leftRight.load(std::memory_order_relaxed) ^ 1;
+    m_leftRight.store(written, std::memory_order_release);
+
+    // Here we are sure that:
+    //       (1) we will see the reader in an indicator
+    //    or (2) reader will see the new m_leftRight
+    FlushProcessWriteBuffers();
+
+    unsigned prev = m_versionIndex.load(std::memory_order_relaxed);
+    unsigned next = prev ^ 1;
+    m_indicators[next].WaitEmpty();
+    m_versionIndex.store(next, std::memory_order_relaxed);
+    m_indicators[prev].WaitEmpty();
+
+    return written ^ 1;
+}
+
+void CLeftRight::EndWrite() {
+    m_writeLock.Leave();
+}
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
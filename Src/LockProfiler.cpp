@@ -0,0 +1,402 @@
+/**
+ *      File: LockProfiler.cpp
+ *    Author: CS Lim
+ *   Purpose: Sampling hold time profiler of CRWLock (RWLOCK_PROFILE)
+ *
+ *   Notes:
+ *      - A thread has at most one sample open. Re-entries of the sampled
+ *        lock in the same mode are counted so the outermost release closes
+ *        it. A sample still open after MAX_FOREIGN_EVENTS other lock events
+ *        (release never seen by this thread) is dropped.
+ *      - Sampling intervals are random around the rate so periodic lock
+ *        patterns can't hide from the sampler.
+ *      - Table slots are claimed with one compare-and-swap of the stack
+ *        hash and never freed. The claiming thread fills in the frames and
+ *        then sets ready. Counts are atomic adds, so no lock anywhere.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+#if defined(RWLOCK_PROFILE)
+
+//===========================================================================
+// Private definitions
+//===========================================================================
+
+// Countdown while sampling is off. Bounds the delay to notice a new rate.
+const int DISABLED_INTERVAL = 64 * 1024;
+
+// Lock events of other locks a sample may see before it is dropped
+const unsigned MAX_FOREIGN_EVENTS = 1024;
+
+// Slots probed before a sample is dropped
+const unsigned MAX_PROBES = 64;
+
+// Frames of the profiler and the lock below the caller
+const unsigned MAX_SKIPPED_FRAMES = 8;
+
+// Open sample of a thread
+struct ProfileThread {
+    const void *    lock;           // NULL if no sample is open
+    bool            write;
+    unsigned        nested;         // Re-entries of lock in the same mode
+    unsigned        foreign;        // Events of other locks since sampled
+    unsigned        depth;
+    void *          frames[LOCK_PROFILE_DEPTH];
+    uint64_t        start;
+    uint32_t        random;
+};
+
+struct ProfileSlot {
+    std::atomic<uint64_t>   key;        // Stack hash, 0 if free
+    std::atomic<uint32_t>   ready;      // Frames written
+    bool                    write;
+    unsigned                depth;
+    void *                  frames[LOCK_PROFILE_DEPTH];
+    std::atomic<uint64_t>   count;
+    std::atomic<uint64_t>   totalNs;
+    std::atomic<uint64_t>   maxNs;
+};
+
+
+//===========================================================================
+// Private variables
+//===========================================================================
+static std::atomic<unsigned>    s_rate;
+static std::atomic<uint64_t>    s_dropped;
+static ProfileSlot              s_slots[LOCK_PROFILE_SITES];
+
+static thread_local ProfileThread t_profile;
+
+
+//===========================================================================
+// Private functions
+//===========================================================================
+static uint64_t ProfileNow() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        LockClock::now().time_since_epoch()
+    ).count();
+}
+
+// Lock events until the next sample, uniform in [1, 4 * rate - 1]. A
+// sample takes two events (enter and leave), so that is one acquisition
+// in rate on average.
+static int NextInterval(ProfileThread & thread, unsigned rate) {
+    if (rate == 0)
+        return DISABLED_INTERVAL;
+
+    // xorshift32, seeded from the thread's own address
+    uint32_t x = thread.random;
+    if (x == 0)
+        x = (uint32_t)(uintptr_t)&thread | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    thread.random = x;
+
+    uint64_t span = (uint64_t)rate * 4 - 1;
+    if (span > INT_MAX - 1)
+        span = INT_MAX - 1;
+    return 1 + (int)(x % span);
+}
+
+static unsigned CaptureStack(void * caller, void ** frames) {
+    unsigned count = 0;
+    void * raw[LOCK_PROFILE_DEPTH + MAX_SKIPPED_FRAMES];
+#if defined(_WIN32)
+    count = RtlCaptureStackBackTrace(0, COUNT_OF(raw), raw, NULL);
+#elif defined(__GLIBC__)
+    count = (unsigned)backtrace(raw, COUNT_OF(raw));
+#endif
+
+    // Drop the frames below the caller. Just the caller if it isn't in
+    // the stack (no unwinder, or the lock function was inlined).
+    for (unsigned i = 0; i < count && i < MAX_SKIPPED_FRAMES; i++) {
+        if (raw[i] != caller)
+            continue;
+
+        unsigned depth = count - i;
+        if (depth > LOCK_PROFILE_DEPTH)
+            depth = LOCK_PROFILE_DEPTH;
+        memcpy(frames, raw + i, depth * sizeof(void *));
+        return depth;
+    }
+
+    frames[0] = caller;
+    return 1;
+}
+
+static uint64_t HashStack(bool write, void * const * frames, unsigned depth) {
+    // FNV-1a over the frames, then a final mix for the slot index
+    uint64_t hash = write ? 0xCBF29CE484222325ull : 0x84222325CBF29CE4ull;
+    for (unsigned i = 0; i < depth; i++) {
+        hash ^= (uint64_t)(uintptr_t)frames[i];
+        hash *= 0x100000001B3ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+
+    // Zero marks a free slot
+    return hash != 0 ? hash : 1;
+}
+
+static void AddSample(ProfileSlot & slot, uint64_t holdNs) {
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    slot.totalNs.fetch_add(holdNs, std::memory_order_relaxed);
+
+    uint64_t max = slot.maxNs.load(std::memory_order_relaxed);
+    while (holdNs > max && !slot.maxNs.compare_exchange_weak(max, holdNs, std::memory_order_relaxed))
+        ;
+}
+
+static void RecordSample(const ProfileThread & thread, uint64_t holdNs) {
+    uint64_t key = HashStack(thread.write, thread.frames, thread.depth);
+    for (unsigned probe = 0; probe < MAX_PROBES; probe++) {
+        ProfileSlot & slot = s_slots[(key + probe) & (LOCK_PROFILE_SITES - 1)];
+
+        uint64_t current = slot.key.load(std::memory_order_acquire);
+        if (current == 0 && slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+            // Claimed, publish the stack
+            slot.write = thread.write;
+            slot.depth = thread.depth;
+            memcpy(slot.frames, thread.frames, thread.depth * sizeof(void *));
+            slot.ready.store(1, std::memory_order_release);
+            current = key;
+        }
+
+        if (current == key) {
+            AddSample(slot, holdNs);
+            return;
+        }
+    }
+
+    s_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+static int CompareSites(const void * a, const void * b) {
+    uint64_t totalA = ((const LockProfileSite *)a)->totalNs;
+    uint64_t totalB = ((const LockProfileSite *)b)->totalNs;
+    return totalA < totalB ? 1 : totalA > totalB ? -1 : 0;
+}
+
+static const char * BaseName(const char * path) {
+    const char * name = path;
+    for (const char * p = path; *p; p++) {
+        if (*p == '/' || *p == '\\')
+            name = p + 1;
+    }
+    return name;
+}
+
+
+//===========================================================================
+// Profiler
+//===========================================================================
+void SetLockProfileRate(unsigned everyN) {
+    s_rate.store(everyN, std::memory_order_relaxed);
+}
+
+unsigned GetLockProfileRate() {
+    return s_rate.load(std::memory_order_relaxed);
+}
+
+void LockProfileSample(const void * lock, LockProfileEvent event, void * caller) {
+    ProfileThread & thread = t_profile;
+    bool write = event == LOCK_PROFILE_ENTER_WRITE || event == LOCK_PROFILE_LEAVE_WRITE;
+    bool enter = event == LOCK_PROFILE_ENTER_READ || event == LOCK_PROFILE_ENTER_WRITE;
+
+    if (thread.lock == NULL) {
+        unsigned rate = s_rate.load(std::memory_order_relaxed);
+        if (rate == 0) {
+            t_lockProfileCountdown = DISABLED_INTERVAL;
+            return;
+        }
+
+        // Ran out on a release: sample the next acquisition instead
+        if (enter) {
+            thread.lock = lock;
+            thread.write = write;
+            thread.nested = 0;
+            thread.foreign = 0;
+            thread.depth = CaptureStack(caller, thread.frames);
+
+            // Last, so the stack walk doesn't count as hold time
+            thread.start = ProfileNow();
+        }
+        t_lockProfileCountdown = 1;
+        return;
+    }
+
+    if (lock == thread.lock && write == thread.write) {
+        if (enter) {
+            thread.nested++;
+        }
+        else if (thread.nested > 0) {
+            thread.nested--;
+        }
+        else {
+            RecordSample(thread, ProfileNow() - thread.start);
+            thread.lock = NULL;
+            t_lockProfileCountdown = NextInterval(thread, s_rate.load(std::memory_order_relaxed));
+            return;
+        }
+    }
+    else if (++thread.foreign > MAX_FOREIGN_EVENTS) {
+        s_dropped.fetch_add(1, std::memory_order_relaxed);
+        thread.lock = NULL;
+        t_lockProfileCountdown = NextInterval(thread, s_rate.load(std::memory_order_relaxed));
+        return;
+    }
+
+    // Sample still open, keep watching
+    t_lockProfileCountdown = 1;
+}
+
+unsigned GetLockProfileSites(LockProfileSite * sites, unsigned maxCount) {
+    if (maxCount == 0)
+        return 0;
+
+    LockProfileSite * all = new LockProfileSite[LOCK_PROFILE_SITES];
+    unsigned count = 0;
+    for (unsigned i = 0; i < LOCK_PROFILE_SITES; i++) {
+        const ProfileSlot & slot = s_slots[i];
+        if (!slot.ready.load(std::memory_order_acquire))
+            continue;
+
+        LockProfileSite & site = all[count++];
+        site.write = slot.write;
+        site.depth = slot.depth;
+        memcpy(site.frames, slot.frames, sizeof(site.frames));
+        site.count = slot.count.load(std::memory_order_relaxed);
+        site.totalNs = slot.totalNs.load(std::memory_order_relaxed);
+        site.maxNs = slot.maxNs.load(std::memory_order_relaxed);
+    }
+
+    qsort(all, count, sizeof(all[0]), CompareSites);
+    if (count > maxCount)
+        count = maxCount;
+    memcpy(sites, all, count * sizeof(all[0]));
+    delete [] all;
+    return count;
+}
+
+uint64_t GetLockProfileDropped() {
+    return s_dropped.load(std::memory_order_relaxed);
+}
+
+void FormatLockProfileFrame(void * address, char * buffer, size_t size) {
+#if defined(_WIN32)
+    HMODULE module;
+    char path[MAX_PATH];
+    if (GetModuleHandleExA(
+            GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+            (LPCSTR)address, &module
+        ) && GetModuleFileNameA(module, path, sizeof(path))) {
+        snprintf(buffer, size, "%s+0x%llx", BaseName(path),
+            (unsigned long long)((char *)address - (char *)module));
+        return;
+    }
+#else
+    Dl_info info;
+    if (dladdr(address, &info)) {
+        if (info.dli_sname) {
+            int status;
+            char * name = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+            snprintf(buffer, size, "%s", status == 0 ? name : info.dli_sname);
+            free(name);
+            return;
+        }
+        if (info.dli_fname) {
+            snprintf(buffer, size, "%s+0x%llx", BaseName(info.dli_fname),
+                (unsigned long long)((char *)address - (char *)info.dli_fbase));
+            return;
+        }
+    }
+#endif
+    snprintf(buffer, size, "0x%llx", (unsigned long long)(uintptr_t)address);
+}
+
+bool WriteLockProfileCollapsed(const char * path) {
+    FILE * file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    LockProfileSite * sites = new LockProfileSite[LOCK_PROFILE_SITES];
+    unsigned count = GetLockProfileSites(sites, LOCK_PROFILE_SITES);
+    for (unsigned i = 0; i < count; i++) {
+        const LockProfileSite & site = sites[i];
+
+        // Kind as the root, then the stack from the outermost frame
+        fprintf(file, "%s", site.write ? "write" : "read");
+        for (unsigned frame = site.depth; frame-- > 0; ) {
+            char name[512];
+            FormatLockProfileFrame(site.frames[frame], name, sizeof(name));
+
+            // ';' separates frames in this format
+            for (char * p = name; *p; p++) {
+                if (*p == ';')
+                    *p = ',';
+            }
+            fprintf(file, ";%s", name);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)site.totalNs);
+    }
+    delete [] sites;
+
+    bool ok = ferror(file) == 0;
+    return fclose(file) == 0 && ok;
+}
+
+void PrintLockProfileTop(FILE * file, unsigned count) {
+    LockProfileSite * sites = new LockProfileSite[count ? count : 1];
+    count = GetLockProfileSites(sites, count);
+
+    fprintf(file, "Longest lock holds (1 in %u sampled)\n", GetLockProfileRate());
+    fprintf(file, "  Samples  Total(ms)    Avg(us)    Max(us)  Kind   Caller\n");
+    for (unsigned i = 0; i < count; i++) {
+        const LockProfileSite & site = sites[i];
+        char name[512];
+        FormatLockProfileFrame(site.frames[0], name, sizeof(name));
+        fprintf(file, "%9llu %10.3f %10.3f %10.3f  %-5s  %s\n",
+            (unsigned long long)site.count,
+            site.totalNs / 1e6,
+            site.count ? site.totalNs / 1e3 / site.count : 0.0,
+            site.maxNs / 1e3,
+            site.write ? "write" : "read",
+            name
+        );
+    }
+
+    uint64_t dropped = GetLockProfileDropped();
+    if (dropped)
+        fprintf(file, "  %llu samples dropped\n", (unsigned long long)dropped);
+    delete [] sites;
+}
+
+#endif /* RWLOCK_PROFILE */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,283 @@
+/**
+ *      File: LockStats.cpp
+ *    Author: CS Lim
+ *   Purpose: Compile-time lock contention statistics (RWLOCK_STATS)
+ *
+ *   Notes:
+ *      - Rows of a thread index are reused by the next thread that gets
+ *        the index. Counts are never reset, so sums stay correct.
+ *      - The registry lock is only taken to create, destroy, rename and
+ *        export stats, never to count.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+#if defined(RWLOCK_STATS)
+
+//===========================================================================
+// Private variables
+//===========================================================================
+
+// Registry of all CLockStats. Function local so that stats of global
+// locks can register during static initialization.
+struct LockStatsRegistry {
+    CCritSect       lock;
+    CLockStats *    head;
+};
+
+static LockStatsRegistry & GetRegistry() {
+    static LockStatsRegistry s_registry = { };
+    return s_registry;
+}
+
+struct LockStatInfo {
+    const char *    name;
+    const char *    help;
+    bool            time;
+};
+
+static const LockStatInfo s_statInfo[LOCK_STAT_COUNT] = {
+    { "read_fast_total",        "Read acquisitions with no writer pending",     false },
+    { "read_slow_total",        "Read acquisitions that waited for a writer",   false },
+    { "write_total",            "Write acquisitions",                           false },
+    { "write_shards_total",     "Exclusive shard acquisitions of writers",      false },
+    { "drain_spins_total",      "Writer pause instructions waiting for readers", false },
+    { "drain_yields_total",     "Writer yields waiting for readers",            false },
+    { "drain_parks_total",      "Reader drains that slept on a futex",          false },
+    { "drain_seconds_total",    "Writer time waiting for readers to leave",     true  },
+    { "barriers_total",         "Process wide memory barriers (IPIs) issued",   false },
+    { "barrier_seconds_total",  "Time spent in process wide memory barriers",   true  },
+    { "write_hold_seconds_total", "Time the write lock was held",               true  },
+};
+
+
+//===========================================================================
+// Counters
+//===========================================================================
+const char * GetLockStatName(LockStat stat) {
+    return s_statInfo[stat].name;
+}
+
+const char * GetLockStatHelp(LockStat stat) {
+    return s_statInfo[stat].help;
+}
+
+bool IsLockStatTime(LockStat stat) {
+    return s_statInfo[stat].time;
+}
+
+
+//===========================================================================
+// CLockStats implementation
+//===========================================================================
+CLockStats::CLockStats(const char * name) {
+    for (unsigned i = 0; i < COUNT_OF(m_chunks); i++)
+        m_chunks[i].store(NULL, std::memory_order_relaxed);
+    m_name = name;
+
+    LockStatsRegistry & registry = GetRegistry();
+    registry.lock.Enter();
+    m_prev = NULL;
+    m_next = registry.head;
+    if (m_next != NULL)
+        m_next->m_prev = this;
+    registry.head = this;
+    registry.lock.Leave();
+}
+
+CLockStats::~CLockStats() {
+    LockStatsRegistry & registry = GetRegistry();
+    registry.lock.Enter();
+    if (m_prev != NULL)
+        m_prev->m_next = m_next;
+    else
+        registry.head = m_next;
+    if (m_next != NULL)
+        m_next->m_prev = m_prev;
+    registry.lock.Leave();
+
+    for (unsigned i = 0; i < COUNT_OF(m_chunks); i++)
+        AlignedFree(m_chunks[i].load(std::memory_order_relaxed));
+}
+
+const char * CLockStats::GetName() const {
+    return m_name;
+}
+
+void CLockStats::SetName(const char * name) {
+    // Exporter reads the name under the registry lock
+    LockStatsRegistry & registry = GetRegistry();
+    registry.lock.Enter();
+    m_name = name;
+    registry.lock.Leave();
+}
+
+CLockStats::Row & CLockStats::AllocRow(unsigned index) {
+    _ASSERT(index < MAX_RWLOCK_READER_COUNT);
+
+    Chunk * alloc = (Chunk *)AlignedAlloc(sizeof(Chunk));
+    for (unsigned i = 0; i < ROWS_PER_CHUNK; i++) {
+        Row * row = new (&alloc->rows[i]) Row;
+        for (unsigned j = 0; j < LOCK_STAT_COUNT; j++)
+            row->value[j].store(0, std::memory_order_relaxed);
+    }
+
+    // Another thread of the same chunk may have beaten us
+    std::atomic<Chunk *> & slot = m_chunks[index / ROWS_PER_CHUNK];
+    Chunk * chunk = NULL;
+    if (slot.compare_exchange_strong(chunk, alloc, std::memory_order_acq_rel)) {
+        chunk = alloc;
+    }
+    else {
+        AlignedFree(alloc);
+    }
+    return chunk->rows[index % ROWS_PER_CHUNK];
+}
+
+void CLockStats::Snapshot(LockStatsSnapshot * snapshot) const {
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (unsigned i = 0; i < COUNT_OF(m_chunks); i++) {
+        const Chunk * chunk = m_chunks[i].load(std::memory_order_acquire);
+        if (chunk == NULL)
+            continue;
+        for (unsigned r = 0; r < ROWS_PER_CHUNK; r++) {
+            for (unsigned s = 0; s < LOCK_STAT_COUNT; s++)
+                snapshot->value[s] += chunk->rows[r].value[s].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool CLockStats::Snapshot(const char * name, LockStatsSnapshot * snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    bool found = false;
+
+    LockStatsRegistry & registry = GetRegistry();
+    registry.lock.Enter();
+    for (CLockStats * stats = registry.head; stats != NULL; stats = stats->m_next) {
+        if (stats->m_name == NULL || strcmp(stats->m_name, name) != 0)
+            continue;
+
+        LockStatsSnapshot one;
+        stats->Snapshot(&one);
+        for (unsigned s = 0; s < LOCK_STAT_COUNT; s++)
+            snapshot->value[s] += one.value[s];
+        found = true;
+    }
+    registry.lock.Leave();
+    return found;
+}
+
+
+//===========================================================================
+// Prometheus exporter
+//===========================================================================
+static bool MoveOverFile(const char * from, const char * to) {
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != FALSE;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+bool WriteLockStatsPrometheus(const char * path) {
+    // Distinct names (first CLockStats of each) and their sums
+    LockStatsRegistry & registry = GetRegistry();
+    registry.lock.Enter();
+
+    unsigned count = 0;
+    for (CLockStats * stats = registry.head; stats != NULL; stats = stats->m_next)
+        count++;
+
+    const char ** names = new const char *[count + 1];
+    LockStatsSnapshot * sums = new LockStatsSnapshot[count + 1];
+    unsigned groups = 0;
+    for (CLockStats * stats = registry.head; stats != NULL; stats = stats->m_next) {
+        if (stats->GetName() == NULL)
+            continue;
+
+        unsigned g = 0;
+        while (g < groups && strcmp(names[g], stats->GetName()) != 0)
+            g++;
+        if (g == groups) {
+            names[groups] = stats->GetName();
+            memset(&sums[groups], 0, sizeof(sums[groups]));
+            groups++;
+        }
+
+        LockStatsSnapshot one;
+        stats->Snapshot(&one);
+        for (unsigned s = 0; s < LOCK_STAT_COUNT; s++)
+            sums[g].value[s] += one.value[s];
+    }
+
+    // Write a temporary file so a scraper never sees half of it
+    size_t length = strlen(path);
+    char * tempPath = new char[length + 5];
+    memcpy(tempPath, path, length);
+    memcpy(tempPath + length, ".tmp", 5);
+
+    bool ok = false;
+    FILE * file = fopen(tempPath, "w");
+    if (file != NULL) {
+        for (unsigned s = 0; s < LOCK_STAT_COUNT; s++) {
+            LockStat stat = (LockStat)s;
+            fprintf(file, "# HELP rwlock_%s %s\n", GetLockStatName(stat), GetLockStatHelp(stat));
+            fprintf(file, "# TYPE rwlock_%s counter\n", GetLockStatName(stat));
+            for (unsigned g = 0; g < groups; g++) {
+                // Label values escape backslash, quote and newline
+                fprintf(file, "rwlock_%s{lock=\"", GetLockStatName(stat));
+                for (const char * c = names[g]; *c; c++) {
+                    if (*c == '\\' || *c == '"')
+                        fprintf(file, "\\%c", *c);
+                    else if (*c == '\n')
+                        fprintf(file, "\\n");
+                    else
+                        fputc(*c, file);
+                }
+
+                if (IsLockStatTime(stat))
+                    fprintf(file, "\"} %.9f\n", (double)sums[g].value[s] / 1e9);
+                else
+                    fprintf(file, "\"} %llu\n", (unsigned long long)sums[g].value[s]);
+            }
+        }
+        ok = ferror(file) == 0;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && MoveOverFile(tempPath, path);
+        if (!ok)
+            remove(tempPath);
+    }
+    registry.lock.Leave();
+
+    delete [] tempPath;
+    delete [] sums;
+    delete [] names;
+    return ok;
+}
+
+#endif /* RWLOCK_STATS */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,293 @@
+/**
+ *      File: RCU.cpp
+ *    Author: CS Lim
+ *   Purpose: User-space RCU domain on top of the asymmetric barrier
+ *
+ *   Notes:
+ *      - Same trick as CRWLock: a reader only stores the current grace
+ *        period into its own slot and reads on, no #StoreLoad fence.
+ *        Synchronize() bumps the grace period and calls
+ *        FlushProcessWriteBuffers(), so afterwards every reader either
+ *        has its slot visible to us or sees all stores made before
+ *        Synchronize() (the unlink of the retired object included).
+ *      - Grace period is a 64 bit counter and never wraps. A slot holding
+ *        an older period than ours is a reader we must wait for, a newer
+ *        one started after the barrier. Readers load it with acquire so
+ *        that is also true on weakly ordered CPUs (AArch64).
+ *      - Reader slots are indexed by the thread index CRWLock assigns, so
+ *        Synchronize() scans up to GetRWLockThreadHighWater() only.
+ *      - Reclaimer thread takes all retired batches every
+ *        RCU_RECLAIM_INTERVAL_MS (sooner when a batch fills up), waits for
+ *        one grace period and frees them, so one Synchronize() covers up
+ *        to thousands of objects.
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+
+//===========================================================================
+// Private constants
+//===========================================================================
+
+// Pause instructions per reader before Synchronize() starts yielding
+const unsigned RCU_SPIN_LIMIT = 1000;
+
+
+//===========================================================================
+// Private types
+//===========================================================================
+
+// Written by the owning thread only, each on its own cache line
+struct CRCUDomain::ReaderSlot {
+    std::atomic<uint64_t>   period;
+    unsigned                nesting;
+
+    uint8_t                 pad[
+        CACHELINE_SIZE - (
+            sizeof(std::atomic<uint64_t>) + sizeof(unsigned)
+        ) % CACHELINE_SIZE
+    ];
+};
+
+struct CRCUDomain::RetireBatch {
+    struct Item {
+        void *      ptr;
+        void     (* deleter)(void *);
+    };
+
+    RetireBatch *   next;
+    unsigned        count;
+    Item            items[RCU_RETIRE_BATCH];
+};
+
+
+//===========================================================================
+// CRCUDomain implementation
+//===========================================================================
+CRCUDomain::CRCUDomain() {
+    m_readers = (ReaderSlot *)AlignedAlloc(sizeof(ReaderSlot) * MAX_RWLOCK_READER_COUNT);
+    for (unsigned i = 0; i < MAX_RWLOCK_READER_COUNT; i++) {
+        ReaderSlot * slot = new (&m_readers[i]) ReaderSlot;
+        slot->period = 0;
+        slot->nesting = 0;
+    }
+
+    m_period = 1;
+    m_retireHead = NULL;
+    m_pendingBatches = 0;
+    m_retiredCount = 0;
+    m_stop = false;
+    m_reclaimWake = 0;
+    m_reclaimDone = 0;
+    m_reclaimedCount = 0;
+    m_gracePeriods = 0;
+
+    m_reclaimer = std::thread(&CRCUDomain::ReclaimProc, this);
+}
+
+CRCUDomain::~CRCUDomain() {
+    m_stop.store(true, std::memory_order_release);
+    m_reclaimWake.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(&m_reclaimWake);
+    m_reclaimer.join();
+
+    // Objects retired after the reclaimer's last round
+    RetireBatch * batch = TakeRetired();
+    if (batch != NULL)
+        Reclaim(batch);
+
+    AlignedFree(m_readers);
+}
+
+void CRCUDomain::ReadLock() {
+    ReaderSlot & slot = m_readers[GetRWLockThreadIndex()];
+    if (slot.nesting++ != 0)
+        return;
+
+    // No explicit #StoreLoad, FlushProcessWriteBuffers() in Synchronize()
+    // does it. Only the compiler must keep the caller's loads below.
+    // Acquire pairs with the fetch_add in Synchronize(): a reader seeing
+    // the new period (and so skipped by WaitForReaders()) also sees the
+    // unlink before it, instead of loading the old pointer early.
+    slot.period.store(m_period.load(std::memory_order_acquire), std::memory_order_relaxed);
+    _ReadWriteBarrier();
+}
+
+void CRCUDomain::ReadUnlock() {
+    ReaderSlot & slot = m_readers[GetRWLockThreadIndex()];
+    _ASSERT(slot.nesting != 0);
+    if (--slot.nesting == 0)
+        slot.period.store(0, std::memory_order_release);
+}
+
+bool CRCUDomain::InReadSection() const {
+    return m_readers[GetRWLockThreadIndex()].nesting != 0;
+}
+
+void CRCUDomain::WaitForReaders(uint64_t period) {
+    unsigned highWater = GetRWLockThreadHighWater();
+    for (unsigned i = 1; i < highWater; i++) {
+        const std::atomic<uint64_t> & started = m_readers[i].period;
+        unsigned spins = 0;
+        for (;;) {
+            uint64_t readerPeriod = started.load(std::memory_order_acquire);
+            if (readerPeriod == 0 || readerPeriod >= period)
+                break;
+
+            if (spins < RCU_SPIN_LIMIT) {
+                spins++;
+                YieldProcessor();
+            }
+            else {
+                SwitchToThread();
+            }
+        }
+    }
+}
+
+void CRCUDomain::Synchronize() {
+    _ASSERT(!InReadSection());
+
+    // Readers entering from now on record the new period (or a slot store
+    // that the barrier below makes visible)
+    uint64_t period = m_period.fetch_add(1, std::memory_order_seq_cst) + 1;
+    FlushProcessWriteBuffers();
+    WaitForReaders(period);
+
+    m_gracePeriods.fetch_add(1, std::memory_order_relaxed);
+}
+
+void CRCUDomain::Retire(void * ptr, void (* deleter)(void *)) {
+    unsigned pendingBatches = 0;
+
+    m_retireLock.Enter();
+    RetireBatch * batch = m_retireHead;
+    if (batch == NULL || batch->count == RCU_RETIRE_BATCH) {
+        RetireBatch * fresh = new RetireBatch;
+        fresh->next = batch;
+        fresh->count = 0;
+        m_retireHead = fresh;
+        if (batch != NULL)
+            pendingBatches = ++m_pendingBatches;
+        batch = fresh;
+    }
+    batch->items[batch->count].ptr = ptr;
+    batch->items[batch->count].deleter = deleter;
+    batch->count++;
+    m_retiredCount++;
+    m_retireLock.Leave();
+
+    if (pendingBatches == 0)
+        return;
+
+    // A batch filled up, don't wait for the timer
+    m_reclaimWake.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(&m_reclaimWake);
+
+    // Reclaimer falls behind. Throttle retiring threads that may wait.
+    if (pendingBatches >= RCU_MAX_PENDING_BATCHES && !InReadSection())
+        Barrier();
+}
+
+CRCUDomain::RetireBatch * CRCUDomain::TakeRetired() {
+    m_retireLock.Enter();
+    RetireBatch * batch = m_retireHead;
+    m_retireHead = NULL;
+    m_pendingBatches = 0;
+    m_retireLock.Leave();
+    return batch;
+}
+
+void CRCUDomain::Reclaim(RetireBatch * batch) {
+    // One grace period for the whole list
+    Synchronize();
+
+    uint64_t count = 0;
+    while (batch != NULL) {
+        for (unsigned i = 0; i < batch->count; i++)
+            batch->items[i].deleter(batch->items[i].ptr);
+        count += batch->count;
+
+        RetireBatch * next = batch->next;
+        delete batch;
+        batch = next;
+    }
+
+    m_reclaimedCount.fetch_add(count, std::memory_order_release);
+    m_reclaimDone.fetch_add(1, std::memory_order_release);
+    FutexWakeAll(&m_reclaimDone);
+}
+
+void CRCUDomain::ReclaimProc() {
+    while (!m_stop.load(std::memory_order_acquire)) {
+        // Read the wake word first so a wake during Reclaim() isn't lost
+        uint32_t wake = m_reclaimWake.load(std::memory_order_acquire);
+
+        RetireBatch * batch = TakeRetired();
+        if (batch != NULL)
+            Reclaim(batch);
+
+        FutexWaitUntil(
+            &m_reclaimWake,
+            wake,
+            LockClock::now() + std::chrono::milliseconds(RCU_RECLAIM_INTERVAL_MS)
+        );
+    }
+}
+
+void CRCUDomain::Barrier() {
+    _ASSERT(!InReadSection());
+    _ASSERT(std::this_thread::get_id() != m_reclaimer.get_id());
+
+    m_retireLock.Enter();
+    uint64_t target = m_retiredCount;
+    m_retireLock.Leave();
+
+    while (m_reclaimedCount.load(std::memory_order_acquire) < target) {
+        uint32_t done = m_reclaimDone.load(std::memory_order_acquire);
+        if (m_reclaimedCount.load(std::memory_order_acquire) >= target)
+            break;
+
+        m_reclaimWake.fetch_add(1, std::memory_order_release);
+        FutexWakeAll(&m_reclaimWake);
+        FutexWaitUntil(
+            &m_reclaimDone,
+            done,
+            LockClock::now() + std::chrono::milliseconds(RCU_RECLAIM_INTERVAL_MS)
+        );
+    }
+}
+
+uint64_t CRCUDomain::GetGracePeriods() const {
+    return m_gracePeriods.load(std::memory_order_relaxed);
+}
+
+uint64_t CRCUDomain::GetReclaimedCount() const {
+    return m_reclaimedCount.load(std::memory_order_relaxed);
+}
+
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
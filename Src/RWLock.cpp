@@ -6,10 +6,43 @@
  *
  *   Notes:
  *      - Linearly scales up to number of readers same as number of cores
- *      - Only Vista or Windows Server 2008 and later are supported
- *        due to using FlushProcessWriteBuffers() API and thread local storage
- *        (in case of implemented inside a dll)
- *      - MAX_RWLOCK_READER_COUNT limits total number of threads
+ *      - Only Windows 8 or Windows Server 2012 and later are supported
+ *        due to using WaitOnAddress() (FlushProcessWriteBuffers() itself
+ *        needs Vista) and thread local storage (in case of implemented
+ *        inside a dll)
+ *      - On Linux FlushProcessWriteBuffers() is emulated with membarrier()
+ *        (see Common.cpp). Reader fast path is still a plain store and load,
+ *        no atomic read-modify-write nor mfence.
+ *      - MAX_RWLOCK_READER_COUNT limits number of threads alive at the same
+ *        time. Reader slot (thread index) is assigned on first use and
+ *        recycled when the thread exits. Lowest free slot is always reused
+ *        first so writers only scan up to the highest slot in use.
+ *      - Writer checks reader flags 16 (SSE2) or 32 (AVX2) at a time.
+ *      - Writer waits for readers per RWLockWaitPolicy: pause with
+ *        exponential backoff, then yield, then sleep on a futex. LeaveRead()
+ *        stays a plain store and load unless a writer is actually asleep.
+ *      - Readers blocked by a writer sleep on a generation word. LeaveWrite()
+ *        releases all of them with one broadcast wake.
+ *      - ExecuteWrite() queues the write and one combiner runs all queued
+ *        writes under a single EnterWrite(), so the barrier and the reader
+ *        drain are paid once per batch (flat combining). The combiner does
+ *        one pass and passes combining on to the oldest waiting request,
+ *        so its own ExecuteWrite() returns no matter how many keep coming.
+ *      - ReadBegin()/ReadValidate() read optimistically (seqlock). Writers
+ *        make m_sequence odd once readers are drained and even again in
+ *        the outermost LeaveWrite(), so optimistic readers never write
+ *        shared memory.
+ *      - TryEnterXXX() and EnterXXXUntil() give up at the deadline. A writer
+ *        that gives up retracts m_writerPending and releases the readers it
+ *        stalled, same as LeaveWrite().
+ *      - With RWLOCK_STATS the reader fast path adds one increment of the
+ *        thread's own counter row. Writers count barriers, drain and hold
+ *        time (see LockStats.h).
+ *      - With RWLOCK_PROFILE every EnterXXX()/LeaveXXX() decrements a
+ *        thread local countdown and samples hold times when it runs out
+ *        (see LockProfiler.h). Upgradable reads aren't sampled.
+ *      - USDT probes (see LockProbes.h) mark read/write acquire, contention
+ *        start, barriers, drain completion and release.
  *      - Reentrance support:
  *          R -> R (Re-entrance of Reader lock)
  *              Case #1 If no writer pending then reacquire reader lock.
@@ -19,11 +52,21 @@
  *          W -> R : Writer entering Reader lock allowed and keep maintain
  *                     writer status.
  *
- *          W -> W : Re-entrance of Writer lock allowed.
+ *          W -> W : Re-entrance of Writer lock allowed. Readers are
+ *                   drained already, the nested EnterWrite() only counts
+ *                   itself in m_writeRecursion.
+ *
+ *          U -> W : Upgradable read (EnterUpgradable) becomes the writer
+ *                   with UpgradeToWrite(). Only one upgrader at a time, it
+ *                   holds m_critSect so no writer can get in between.
+ *
+ *          W -> R : DowngradeWrite() turns write lock into read lock.
+ *                   Reader flag is set before m_writerPending is cleared,
+ *                   so next writer waits for us.
  *
  *  !!! IMPORTANT !!!
- *          R -> W : Upgrading read lock to write lock is "NOT"
- *                   supported and can cause deadlock.
+ *          R -> W : Upgrading plain read lock to write lock is "NOT"
+ *                   supported and can cause deadlock. Use EnterUpgradable().
  */
 
 #include "stdafx.h"
@@ -35,66 +78,577 @@
 //===========================================================================
 
 // Unique thread index [1 .. (MAX_RWLOCK_READER_COUNT - 1)]
-static __declspec(thread) unsigned t_curThreadIndex;
-static long s_threadIndex = 0;
+// Index 0 means the thread has no reader slot yet
+thread_local unsigned t_rwlockThreadIndex;
+
+#if defined(RWLOCK_PROFILE)
+// Lock events until the thread's next profiler sample (see LockProfiler.h)
+thread_local int t_lockProfileCountdown;
+#endif
+
+// Reader slot registry
+static CCritSect                s_slotLock;
+static uint64_t                 s_slotUsed[MAX_RWLOCK_READER_COUNT / 64] = { 1 };
+
+// One past the highest slot in use. Writers scan readers below it only.
+static std::atomic<unsigned>    s_slotHighWater(1);
+
+// TLS destructor to give the slot back on thread exit
+#if defined(_WIN32)
+static DWORD                    s_slotFlsIndex = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t            s_slotKey;
+static bool                     s_slotKeyCreated = false;
+#endif
+
+
+//===========================================================================
+// Reader slot registry
+//===========================================================================
+static bool IsSlotUsed(unsigned index) {
+    return (s_slotUsed[index / 64] & ((uint64_t)1 << (index % 64))) != 0;
+}
+
+static void FreeThreadIndex(unsigned index) {
+    s_slotLock.Enter();
+    s_slotUsed[index / 64] &= ~((uint64_t)1 << (index % 64));
+
+    // Drop trailing free slots so writers don't scan them
+    unsigned highWater = s_slotHighWater.load(std::memory_order_relaxed);
+    while (highWater > 1 && !IsSlotUsed(highWater - 1))
+        highWater--;
+    s_slotHighWater.store(highWater, std::memory_order_release);
+    s_slotLock.Leave();
+}
+
+#if defined(_WIN32)
+static void WINAPI OnThreadExit(PVOID value) {
+#else
+static void OnThreadExit(void * value) {
+#endif
+    // Exiting thread holds no read lock, so its flag is clear in every
+    // CRWLock and the slot can be handed over to another thread.
+    // Later TLS destructors using a CRWLock get a new slot.
+    t_rwlockThreadIndex = 0;
+    FreeThreadIndex((unsigned)(uintptr_t)value);
+}
+
+unsigned AllocRWLockThreadIndex() {
+    s_slotLock.Enter();
+
+#if defined(_WIN32)
+    if (s_slotFlsIndex == FLS_OUT_OF_INDEXES)
+        s_slotFlsIndex = FlsAlloc(OnThreadExit);
+#else
+    if (!s_slotKeyCreated)
+        s_slotKeyCreated = pthread_key_create(&s_slotKey, OnThreadExit) == 0;
+#endif
+
+    // Lowest free slot
+    unsigned index = 0;
+    for (unsigned i = 0; i < COUNT_OF(s_slotUsed); i++) {
+        if (s_slotUsed[i] != ~(uint64_t)0) {
+            index = i * 64;
+            while (IsSlotUsed(index))
+                index++;
+            break;
+        }
+    }
+
+    if (index == 0) {
+        s_slotLock.Leave();
+        fprintf(stderr, "CRWLock: more than %u threads\n", MAX_RWLOCK_READER_COUNT - 1);
+        abort();
+    }
+
+    s_slotUsed[index / 64] |= (uint64_t)1 << (index % 64);
+    if (index >= s_slotHighWater.load(std::memory_order_relaxed))
+        s_slotHighWater.store(index + 1, std::memory_order_release);
+
+#if defined(_WIN32)
+    FlsSetValue(s_slotFlsIndex, (PVOID)(uintptr_t)index);
+#else
+    pthread_setspecific(s_slotKey, (void *)(uintptr_t)index);
+#endif
+    s_slotLock.Leave();
+
+    t_rwlockThreadIndex = index;
+    return index;
+}
+
+
+//===========================================================================
+// Reader flag scan
+//  Returns index of the first non-zero flag in [0, count), or count if all
+//  flags are clear. Flags are plain bytes (sizeof(std::atomic<uint8_t>) is 1)
+//  and every byte of a vector load is read atomically.
+//===========================================================================
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RWLOCK_SCAN_SSE2
+#endif
+
+#if defined(RWLOCK_SCAN_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+#define RWLOCK_SCAN_AVX2
+#if defined(_MSC_VER)
+#define RWLOCK_TARGET_AVX2
+#else
+#define RWLOCK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+static unsigned FindBusyReaderScalar(const std::atomic<uint8_t> * flags, unsigned count) {
+    unsigned i = 0;
+
+    // 8 flags at a time
+    for (; i + 8 <= count; i += 8) {
+        uint64_t word;
+        memcpy(&word, (const void *)(flags + i), sizeof(word));
+        if (word == 0)
+            continue;
+        for (unsigned j = i; j < i + 8; j++) {
+            if (flags[j].load(std::memory_order_relaxed))
+                return j;
+        }
+    }
+
+    for (; i < count; i++) {
+        if (flags[i].load(std::memory_order_relaxed))
+            return i;
+    }
+    return count;
+}
+
+#if defined(RWLOCK_SCAN_SSE2)
+static unsigned FindBusyReaderSse2(const std::atomic<uint8_t> * flags, unsigned count) {
+    const __m128i zero = _mm_setzero_si128();
+    unsigned i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(flags + i));
+        uint32_t busy = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) ^ 0xffff;
+        if (busy)
+            return i + CountTrailingZeros(busy);
+    }
+    return i + FindBusyReaderScalar(flags + i, count - i);
+}
+#endif
+
+#if defined(RWLOCK_SCAN_AVX2)
+RWLOCK_TARGET_AVX2
+static unsigned FindBusyReaderAvx2(const std::atomic<uint8_t> * flags, unsigned count) {
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned i = 0;
+
+    for (; i + 32 <= count; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(flags + i));
+        uint32_t busy = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero));
+        if (busy)
+            return i + CountTrailingZeros(busy);
+    }
+
+    // Tail is non-VEX SSE2 code. Running it with dirty upper YMM halves
+    // costs a state transition (~150 ns per scan, see RWLockTest drain).
+    _mm256_zeroupper();
+    return i + FindBusyReaderSse2(flags + i, count - i);
+}
+
+static bool HasAvx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // OS must save YMM registers (OSXSAVE + AVX, XCR0 bits 1 and 2)
+    __cpuid(info, 1);
+    if ((info[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
+
+static FindBusyRWLockReaderFn SelectFindBusyReader() {
+#if defined(RWLOCK_SCAN_AVX2)
+    if (HasAvx2())
+        return FindBusyReaderAvx2;
+#endif
+#if defined(RWLOCK_SCAN_SSE2)
+    return FindBusyReaderSse2;
+#else
+    return FindBusyReaderScalar;
+#endif
+}
+
+static unsigned FindBusyReader(const std::atomic<uint8_t> * flags, unsigned count) {
+    static_assert(sizeof(std::atomic<uint8_t>) == 1, "reader flags must be bytes");
+    static const FindBusyRWLockReaderFn s_findBusyReader = SelectFindBusyReader();
+
+    return s_findBusyReader(flags, count);
+}
+
+
+//===========================================================================
+// Writer wait policy
+//===========================================================================
+//                                             spin  yield  adaptive  park
+const RWLockWaitPolicy RWLOCK_WAIT_ADAPTIVE = { 256,    16,  true,    true  };
+const RWLockWaitPolicy RWLOCK_WAIT_YIELD    = {   0,     0,  false,   false };
+
+// Bounds of the self-tuned spin limit (pause instructions)
+const unsigned MIN_SPIN_LIMIT   = 16;
+const unsigned MAX_SPIN_LIMIT   = 8192;
+
+// Longest pause burst of the exponential backoff
+const unsigned MAX_SPIN_BACKOFF = 64;
 
+// Progress of a writer through the wait policy during one EnterWrite()
+struct CRWLock::DrainState {
+    unsigned    spins;
+    unsigned    backoff;
+    unsigned    yields;
+    bool        parked;
+    bool        contended;      // Waited for a reader (probe fired)
+
+    // NULL to wait forever
+    const LockClock::time_point * deadline;
+
+    bool Expired() const {
+        return deadline != NULL && LockClock::now() >= *deadline;
+    }
+};
+
+//===========================================================================
+// Flat combining (ExecuteWrite)
+//===========================================================================
+// Polls of CombineRequest::state before a waiting writer yields, and
+// yields before it goes to sleep
+const unsigned COMBINE_SPIN_LIMIT = 256;
+const unsigned COMBINE_YIELD_LIMIT = 4;
+
+// Batches run by one combiner under a single EnterWrite() (one pass).
+// Bounds how long readers are kept out while writers keep coming.
+const unsigned MAX_COMBINE_BATCHES = 8;
+
+// Write request published by ExecuteWrite(). Lives on the caller's stack
+// until state becomes COMBINE_DONE.
+struct CRWLock::CombineRequest {
+    enum : uint32_t {
+        COMBINE_PENDING,
+        COMBINE_SLEEPING,   // Caller sleeps on state, combiner must wake it
+        COMBINE_DONE,
+        COMBINE_HANDOFF,    // Caller is the combiner now, request not run yet
+    };
+
+    void                    (* fn)(void *);
+    void *                  context;
+    CombineRequest *        next;
+    std::atomic<uint32_t>   state;
+};
 
 //===========================================================================
 // CRWLock implementation
 //===========================================================================
-CRWLock::CRWLock() {
+CRWLock::CRWLock(const RWLockWaitPolicy & waitPolicy) {
+    m_ownerThreadId = 0;
+    m_writeRecursion = 0;
     m_writerPending = false;
+    m_writeGeneration = 0;
+    m_readersParked = 0;
+    m_writerParked = false;
+    m_writerWake = 0;
+    m_overflowReaders = NULL;
+    m_combineHead = NULL;
+    m_combining = false;
+    m_sequence = 0;
+    m_waitPolicy = waitPolicy;
+    m_spinLimit = waitPolicy.spinLimit;
 
     for (unsigned i = 0; i < COUNT_OF(m_readers); i++)
-        m_readers[i] = false;
+        m_readers[i].store(false, std::memory_order_relaxed);
+
+#if defined(RWLOCK_STATS)
+    m_ownStats = new CLockStats;
+    m_stats = m_ownStats;
+    m_writeStart = 0;
+#endif
 }
 
-void CRWLock::EnterRead() {
-    // Initialize per-thread index if this is first call from current thread
-    if (t_curThreadIndex == 0) {
-        t_curThreadIndex = AtomicIncrement(&s_threadIndex);
-        _ASSERT(t_curThreadIndex < MAX_RWLOCK_READER_COUNT);
+CRWLock::~CRWLock() {
+    delete [] m_overflowReaders.load(std::memory_order_relaxed);
+#if defined(RWLOCK_STATS)
+    delete m_ownStats;
+#endif
+}
+
+inline void CRWLock::FlushBarrier() {
+    RWLOCK_PROBE1(barrier, this);
+#if defined(RWLOCK_STATS)
+    uint64_t start = LockStatNow();
+    FlushProcessWriteBuffers();
+    CLockStats::Row & row = m_stats->Local(t_rwlockThreadIndex);
+    row.Add(LOCK_STAT_BARRIERS, 1);
+    row.Add(LOCK_STAT_BARRIER_NS, LockStatNow() - start);
+#else
+    FlushProcessWriteBuffers();
+#endif
+}
+
+inline std::atomic<uint8_t> & CRWLock::ReaderFlag(unsigned index) {
+    if (index < RWLOCK_INLINE_READER_COUNT)
+        return m_readers[index];
+    return OverflowReaderFlag(index);
+}
+
+std::atomic<uint8_t> & CRWLock::OverflowReaderFlag(unsigned index) {
+    std::atomic<uint8_t> * readers = m_overflowReaders.load(std::memory_order_acquire);
+    if (readers == NULL) {
+        const unsigned count = MAX_RWLOCK_READER_COUNT - RWLOCK_INLINE_READER_COUNT;
+        std::atomic<uint8_t> * alloc = new std::atomic<uint8_t>[count];
+        for (unsigned i = 0; i < count; i++)
+            alloc[i].store(false, std::memory_order_relaxed);
+
+        // Another thread may have beaten us
+        if (m_overflowReaders.compare_exchange_strong(readers, alloc, std::memory_order_acq_rel))
+            readers = alloc;
+        else
+            delete [] alloc;
     }
+    return readers[index - RWLOCK_INLINE_READER_COUNT];
+}
 
-    m_readers[t_curThreadIndex] = true;
+void CRWLock::WakeWriter() {
+    m_writerWake.fetch_add(1, std::memory_order_relaxed);
+    FutexWakeAll(&m_writerWake);
+}
 
-    // Pending write lock exists?
-    //    No explicit #StoreLoad but it will be implicitly executed
-    //    by FlushProcessWriteBuffers() in EnterWrite()
-    if (m_writerPending) {
+void CRWLock::ParkWriter(const std::atomic<uint8_t> & flag, const DrainState & state) {
+    uint32_t wake = m_writerWake.load(std::memory_order_relaxed);
+    m_writerParked.store(true, std::memory_order_relaxed);
+
+    // Same asymmetric handshake as m_writerPending:
+    //       (1) writer will see the reader's flag cleared
+    //    or (2) leaving reader will see (m_writerParked == true)
+    //           and wake us up
+    FlushBarrier();
+    if (flag.load(std::memory_order_acquire)) {
+        if (state.deadline)
+            FutexWaitUntil(&m_writerWake, wake, *state.deadline);
+        else
+            FutexWait(&m_writerWake, wake);
+    }
+
+    m_writerParked.store(false, std::memory_order_relaxed);
+}
+
+bool CRWLock::WaitForReader(const std::atomic<uint8_t> & flag, DrainState & state) {
+    while (flag.load(std::memory_order_acquire)) {
+        if (!state.contended) {
+            RWLOCK_PROBE2(write_contend, this, RWLOCK_CONTEND_READERS);
+            state.contended = true;
+        }
+        if (state.Expired())
+            return false;
+
+        if (state.spins < m_spinLimit) {
+            // Exponential backoff
+            for (unsigned i = 0; i < state.backoff; i++)
+                YieldProcessor();
+            state.spins += state.backoff;
+            if (state.backoff < MAX_SPIN_BACKOFF)
+                state.backoff *= 2;
+        }
+        else if (state.yields < m_waitPolicy.yieldLimit || !m_waitPolicy.park) {
+            // Yield CPU to another thread
+            SwitchToThread();
+            state.yields++;
+        }
+        else {
+            ParkWriter(flag, state);
+            state.parked = true;
+        }
+    }
+    return true;
+}
+
+bool CRWLock::WaitForReaders(const std::atomic<uint8_t> * flags, unsigned count, DrainState & state) {
+    // Wait for each busy reader to complete and continue from there
+    unsigned i = 0;
+    while ((i += FindBusyReader(flags + i, count - i)) < count) {
+        if (!WaitForReader(flags[i], state))
+            return false;
+    }
+
+    // Keep caller's critical section after the (non-atomic) scan
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return true;
+}
+
+bool CRWLock::WaitForWriter(std::atomic<uint8_t> & flag, const LockClock::time_point * deadline) {
+    // W -> R: writer keeps its writer status
+    if (m_ownerThreadId.load(std::memory_order_relaxed) == t_rwlockThreadIndex)
+        return true;
+
+    RWLOCK_PROBE1(read_contend, this);
+    do {
         // If writer is pending then signal that we see it
         // and wait for writer to complete
-        m_readers[t_curThreadIndex] = false;
+        flag.store(false, std::memory_order_release);
+        _ReadWriteBarrier();
+        if (m_writerParked.load(std::memory_order_relaxed))
+            WakeWriter();
 
-        m_critSect.Enter();
-        m_readers[t_curThreadIndex] = true;
-        m_critSect.Leave();
+        if (deadline && LockClock::now() >= *deadline)
+            return false;
+
+        // Sleep until LeaveWrite() moves to next generation. All blocked
+        // readers resume together on its single broadcast wake instead of
+        // going through m_critSect one by one.
+        // seq_cst pairs with LeaveWrite() so that either it sees us parked
+        // or we see the new generation.
+        uint32_t generation = m_writeGeneration.load(std::memory_order_acquire);
+        m_readersParked.fetch_add(1, std::memory_order_seq_cst);
+        bool counted = m_writeGeneration.load(std::memory_order_seq_cst) == generation;
+        if (counted && m_writerPending.load(std::memory_order_seq_cst)) {
+            if (deadline)
+                FutexWaitUntil(&m_writeGeneration, generation, *deadline);
+            else
+                FutexWait(&m_writeGeneration, generation);
+        }
+
+        // Take the flag back before leaving m_readersParked. If we were
+        // counted before the writer we waited for left, the next writer
+        // waits in DrainReaders() until we leave it, so it sees our flag
+        // and we go in even if it is pending already. Otherwise
+        // back-to-back writers could keep us out for good.
+        flag.store(true, std::memory_order_relaxed);
+        bool released = counted
+            && m_writeGeneration.load(std::memory_order_acquire) != generation;
+        m_readersParked.fetch_sub(1, std::memory_order_seq_cst);
+        if (released)
+            break;
+
+        // Try again. Next writer may already be pending.
+        _ReadWriteBarrier();
+    } while (m_writerPending.load(std::memory_order_acquire));
+
+    return true;
+}
+
+bool CRWLock::EnterReadInternal(const LockClock::time_point * deadline) {
+    // Initialize per-thread index if this is first call from current thread
+    unsigned index = t_rwlockThreadIndex;
+    if (index == 0)
+        index = AllocRWLockThreadIndex();
+
+    std::atomic<uint8_t> & flag = ReaderFlag(index);
+    flag.store(true, std::memory_order_relaxed);
+
+    // Pending write lock exists?
+    //    No explicit #StoreLoad but it will be implicitly executed
+    //    by FlushProcessWriteBuffers() in EnterWrite()
+    //    Only the compiler must be kept from hoisting the load above the store
+    _ReadWriteBarrier();
+    if (m_writerPending.load(std::memory_order_acquire)) {
+        RWLOCK_STAT(m_stats, index, LOCK_STAT_READ_SLOW, 1);
+        if (!WaitForWriter(flag, deadline))
+            return false;
+        RWLOCK_PROBE2(read_acquire, this, 1);
+    }
+    else {
+        RWLOCK_STAT(m_stats, index, LOCK_STAT_READ_FAST, 1);
+        RWLOCK_PROBE2(read_acquire, this, 0);
     }
 
     // Prevent compiler re-ordering
     // Need to order caller code inside critical section
     _ReadWriteBarrier();
+    return true;
+}
+
+void CRWLock::EnterRead() {
+    EnterReadInternal(NULL);
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_READ);
+}
+
+bool CRWLock::TryEnterRead() {
+    // Deadline in the past: give up as soon as a writer is pending
+    LockClock::time_point now = LockClock::time_point::min();
+    if (!EnterReadInternal(&now))
+        return false;
+
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_READ);
+    return true;
+}
+
+bool CRWLock::EnterReadUntil(const LockClock::time_point & deadline) {
+    if (!EnterReadInternal(&deadline))
+        return false;
+
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_READ);
+    return true;
 }
 
 void CRWLock::LeaveRead() {
-    _ASSERT(t_curThreadIndex != 0);
+    _ASSERT(t_rwlockThreadIndex != 0);
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_LEAVE_READ);
+    RWLOCK_PROBE1(read_release, this);
 
     // Prevent compiler re-ordering
     // Need to order caller code inside critical section
     _ReadWriteBarrier();
-    m_readers[t_curThreadIndex] = false;
+    ReaderFlag(t_rwlockThreadIndex).store(false, std::memory_order_release);
+
+    // Writer sleeping for readers to drain? See ParkWriter()
+    _ReadWriteBarrier();
+    if (m_writerParked.load(std::memory_order_relaxed))
+        WakeWriter();
 }
 
-void CRWLock::EnterWrite() {
-    if (t_curThreadIndex == 0) {
-        t_curThreadIndex = AtomicIncrement(&s_threadIndex);
-        _ASSERT(t_curThreadIndex < MAX_RWLOCK_READER_COUNT);
+bool CRWLock::EnterWriteInternal(const LockClock::time_point * deadline) {
+    if (t_rwlockThreadIndex == 0)
+        AllocRWLockThreadIndex();
+
+    // W -> W: we drained the readers already. Readers we blocked stay
+    // parked (and counted in m_readersParked) until the outer write ends,
+    // so waiting for them here would never end.
+    if (m_ownerThreadId.load(std::memory_order_relaxed) == t_rwlockThreadIndex) {
+        m_critSect.Enter();
+        m_writeRecursion++;
+        return true;
     }
 
     // Writer enters critical section
-    m_critSect.Enter();
+    if (!m_critSect.TryEnter()) {
+        RWLOCK_PROBE2(write_contend, this, RWLOCK_CONTEND_WRITER);
+        if (deadline == NULL)
+            m_critSect.Enter();
+        else if (!m_critSect.EnterUntil(*deadline))
+            return false;
+    }
+
+    return DrainReaders(deadline);
+}
+
+bool CRWLock::DrainReaders(const LockClock::time_point * deadline) {
+    // Readers released by the previous writer go first, once each (see
+    // WaitForWriter()). Nobody parks while m_writerPending is false, so
+    // m_readersParked only goes down here.
+    for (unsigned i = 0; m_readersParked.load(std::memory_order_seq_cst) != 0; i++) {
+        if (deadline && LockClock::now() >= *deadline) {
+            ReleaseWrite();
+            return false;
+        }
+        RWLockSpinWait::Wait(i);
+    }
 
     // Signal we (writer) are waiting for reader(s) to complete
+    m_ownerThreadId.store(t_rwlockThreadIndex, std::memory_order_relaxed);
     m_writerPending = true;
 
     // FlushProcessWriteBuffers() API (From MSDN):
@@ -104,32 +658,337 @@ void CRWLock::EnterWrite() {
     //  - Uses IPI to "synchronously" signal all processors.
     //  - It guarantees the visibility of write operations performed on one
     //    processor to the other processors.
-    //  - Supported since Windows Vista and Windows Server 2008.
-    FlushProcessWriteBuffers();
+    //  - Supported since Windows Vista and Windows Server 2008 (this
+    //    library needs Windows 8 for WaitOnAddress() anyway).
+    FlushBarrier();
+#if defined(RWLOCK_STATS)
+    uint64_t drainStart = LockStatNow();
+#endif
 
     // Here we are sure that:
     //       (1) writer will see (m_readers[i]    == true)
     //    or (2) reader will see (m_writerPending == true)
     // so no race conditions
-    for (unsigned i = 0; i < COUNT_OF(m_readers); i++) {
+    // A reader that just got its slot or overflow array published both
+    // before setting its flag, so they are visible here in case (1) too.
+    DrainState state = { 0, 1, 0, false, false, deadline };
+    bool drained;
+    unsigned highWater = s_slotHighWater.load(std::memory_order_acquire);
+    if (highWater <= RWLOCK_INLINE_READER_COUNT) {
+        drained = WaitForReaders(m_readers, highWater, state);
+    }
+    else {
         // Wait for all readers to complete
-        while (m_readers[i]) {
-            // Yield CPU to another thread
-            // @@@ TODO: Backoff
+        drained = WaitForReaders(m_readers, RWLOCK_INLINE_READER_COUNT, state);
+
+        std::atomic<uint8_t> * overflow = m_overflowReaders.load(std::memory_order_acquire);
+        if (drained && overflow != NULL)
+            drained = WaitForReaders(overflow, highWater - RWLOCK_INLINE_READER_COUNT, state);
+    }
+
+#if defined(RWLOCK_STATS)
+    uint64_t drainEnd = LockStatNow();
+    CLockStats::Row & row = m_stats->Local(t_rwlockThreadIndex);
+    row.Add(LOCK_STAT_DRAIN_SPINS, state.spins);
+    row.Add(LOCK_STAT_DRAIN_YIELDS, state.yields);
+    row.Add(LOCK_STAT_DRAIN_PARKS, state.parked ? 1 : 0);
+    row.Add(LOCK_STAT_DRAIN_NS, drainEnd - drainStart);
+    if (drained) {
+        row.Add(LOCK_STAT_WRITE, 1);
+        m_writeStart = drainEnd;
+    }
+#endif
+
+    // Timed out. Retract m_writerPending and let stalled readers go.
+    if (!drained) {
+        ReleaseWrite();
+        return false;
+    }
+    RWLOCK_PROBE4(drain_done, this, state.spins, state.yields, state.parked);
+
+    // Tell optimistic readers a write is in progress (odd sequence). Data
+    // stores of the caller must not become visible before this.
+    uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+    if (!(sequence & 1)) {
+        m_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // Self-tune spin limit from observed drain time. Aim at twice the
+    // spinning it took, and spin less when spinning didn't help.
+    if (m_waitPolicy.adaptive && (state.spins || state.yields)) {
+        unsigned target = state.yields ? MIN_SPIN_LIMIT : state.spins * 2;
+        int limit = (int)m_spinLimit + ((int)target - (int)m_spinLimit) / 8;
+        if (limit < (int)MIN_SPIN_LIMIT)
+            limit = MIN_SPIN_LIMIT;
+        else if (limit > (int)MAX_SPIN_LIMIT)
+            limit = MAX_SPIN_LIMIT;
+        m_spinLimit = (unsigned)limit;
+    }
+
+    RWLOCK_PROBE1(write_acquire, this);
+    return true;
+}
+
+void CRWLock::EnterWrite() {
+    EnterWriteInternal(NULL);
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_WRITE);
+}
+
+bool CRWLock::TryEnterWrite() {
+    // Deadline in the past: one try of m_critSect and one scan of readers
+    LockClock::time_point now = LockClock::time_point::min();
+    if (!EnterWriteInternal(&now))
+        return false;
+
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_WRITE);
+    return true;
+}
+
+bool CRWLock::EnterWriteUntil(const LockClock::time_point & deadline) {
+    if (!EnterWriteInternal(&deadline))
+        return false;
+
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_ENTER_WRITE);
+    return true;
+}
+
+void CRWLock::ReleaseWrite() {
+    // Write complete, optimistic readers may validate again. Not odd if
+    // the writer gave up before draining readers.
+    uint32_t sequence = m_sequence.load(std::memory_order_relaxed);
+    if (sequence & 1)
+        m_sequence.store(sequence + 1, std::memory_order_release);
+
+#if defined(RWLOCK_STATS)
+    // Zero if the writer gave up before owning the lock
+    if (m_writeStart != 0) {
+        m_stats->Local(t_rwlockThreadIndex).Add(LOCK_STAT_WRITE_HOLD_NS, LockStatNow() - m_writeStart);
+        m_writeStart = 0;
+    }
+#endif
+
+    m_ownerThreadId.store(0, std::memory_order_relaxed);
+    m_writerPending = false;
+
+    // Release all blocked readers with a single broadcast
+    m_writeGeneration.fetch_add(1, std::memory_order_seq_cst);
+    if (m_readersParked.load(std::memory_order_seq_cst))
+        FutexWakeAll(&m_writeGeneration);
+
+    m_critSect.Leave();
+}
+
+void CRWLock::LeaveWrite() {
+    _ASSERT(t_rwlockThreadIndex != 0);
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_LEAVE_WRITE);
+    RWLOCK_PROBE1(write_release, this);
+
+    // W -> W: outer write still runs. Sequence stays odd and readers stay
+    // blocked until it leaves, or optimistic readers validate torn data.
+    if (m_writeRecursion != 0) {
+        m_writeRecursion--;
+        m_critSect.Leave();
+        return;
+    }
+    ReleaseWrite();
+}
+
+void CRWLock::ExecuteWrite(void (* fn)(void *), void * context) {
+    CombineRequest request;
+    request.fn = fn;
+    request.context = context;
+    request.state.store(CombineRequest::COMBINE_PENDING, std::memory_order_relaxed);
+
+    // Publish request (Treiber stack)
+    CombineRequest * head = m_combineHead.load(std::memory_order_relaxed);
+    do {
+        request.next = head;
+    } while (!m_combineHead.compare_exchange_weak(head, &request, std::memory_order_seq_cst));
+
+    // Whoever wins m_combining runs everyone's requests, ours included
+    if (!m_combining.exchange(true, std::memory_order_seq_cst)) {
+        Combine();
+        return;
+    }
+
+    // Wait for a combiner to run our request or to pass combining on to us
+    uint32_t state = CombineRequest::COMBINE_PENDING;
+    for (unsigned spins = 0; spins < COMBINE_SPIN_LIMIT + COMBINE_YIELD_LIMIT; spins++) {
+        state = request.state.load(std::memory_order_acquire);
+        if (state != CombineRequest::COMBINE_PENDING)
+            break;
+        if (spins < COMBINE_SPIN_LIMIT)
+            YieldProcessor();
+        else
             SwitchToThread();
+    }
+
+    if (state == CombineRequest::COMBINE_PENDING
+        && request.state.compare_exchange_strong(state, CombineRequest::COMBINE_SLEEPING, std::memory_order_acquire)) {
+        do {
+            FutexWait(&request.state, CombineRequest::COMBINE_SLEEPING);
+        } while ((state = request.state.load(std::memory_order_acquire)) == CombineRequest::COMBINE_SLEEPING);
+    }
+
+    // Still queued, so our request runs in the first batch
+    if (state == CombineRequest::COMBINE_HANDOFF)
+        Combine();
+}
+
+void CRWLock::Combine() {
+    // One barrier and one reader drain for everything queued meanwhile
+    EnterWrite();
+    for (unsigned batch = 0; batch < MAX_COMBINE_BATCHES; batch++) {
+        CombineRequest * stack = m_combineHead.exchange(NULL, std::memory_order_acquire);
+        if (stack == NULL)
+            break;
+
+        // Run in arrival order
+        CombineRequest * queue = NULL;
+        while (stack != NULL) {
+            CombineRequest * next = stack->next;
+            stack->next = queue;
+            queue = stack;
+            stack = next;
+        }
+
+        while (queue != NULL) {
+            // Request is gone once marked done
+            CombineRequest * next = queue->next;
+            queue->fn(queue->context);
+            if (queue->state.exchange(CombineRequest::COMBINE_DONE, std::memory_order_release) == CombineRequest::COMBINE_SLEEPING)
+                FutexWakeAll(&queue->state);
+            queue = next;
         }
     }
+    LeaveWrite();
+
+    for (;;) {
+        // Requests left: the oldest one becomes combiner. Only the combiner
+        // takes requests off the stack, so they stay there until it runs.
+        CombineRequest * oldest = m_combineHead.load(std::memory_order_seq_cst);
+        if (oldest != NULL) {
+            while (oldest->next != NULL)
+                oldest = oldest->next;
+            if (oldest->state.exchange(CombineRequest::COMBINE_HANDOFF, std::memory_order_release) == CombineRequest::COMBINE_SLEEPING)
+                FutexWakeAll(&oldest->state);
+            return;
+        }
+
+        // seq_cst pairs with ExecuteWrite() so that either a late request
+        // becomes combiner itself or we see it here
+        m_combining.store(false, std::memory_order_seq_cst);
+        if (m_combineHead.load(std::memory_order_seq_cst) == NULL)
+            return;
+        if (m_combining.exchange(true, std::memory_order_seq_cst))
+            return;
+    }
 }
 
-void CRWLock::LeaveWrite() {
-    _ASSERT(t_curThreadIndex != 0);
+unsigned CRWLock::ReadBegin() {
+    // Wait out a write in progress. Writers only make the sequence odd
+    // after draining readers, so this is short.
+    uint32_t sequence;
+    for (unsigned spins = 0; (sequence = m_sequence.load(std::memory_order_acquire)) & 1; spins++) {
+        if (spins < MAX_SPIN_LIMIT)
+            YieldProcessor();
+        else
+            SwitchToThread();
+    }
+    return sequence;
+}
 
-    m_writerPending = false;
+bool CRWLock::ReadValidate(unsigned version) {
+    // Keep the caller's data loads above the sequence load
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return m_sequence.load(std::memory_order_relaxed) == version;
+}
+
+void CRWLock::EnterUpgradable() {
+    unsigned index = t_rwlockThreadIndex;
+    if (index == 0)
+        index = AllocRWLockThreadIndex();
+
+    // Keeps writers and other upgraders out. No writer is pending while
+    // we hold it, so no need to check m_writerPending.
+    m_critSect.Enter();
+    ReaderFlag(index).store(true, std::memory_order_relaxed);
+
+    // Need to order caller code inside critical section
+    std::atomic_thread_fence(std::memory_order_acquire);
+    RWLOCK_PROBE2(read_acquire, this, 0);
+}
+
+void CRWLock::LeaveUpgradable() {
+    _ASSERT(t_rwlockThreadIndex != 0);
+
+    // No writer can be draining readers, so no need to wake one
+    RWLOCK_PROBE1(read_release, this);
+    ReaderFlag(t_rwlockThreadIndex).store(false, std::memory_order_release);
     m_critSect.Leave();
 }
 
+void CRWLock::UpgradeToWrite() {
+    _ASSERT(t_rwlockThreadIndex != 0);
+
+    // Still holding m_critSect. Stop counting ourselves as a reader and
+    // wait for plain readers like EnterWrite() does.
+    RWLOCK_PROBE1(read_release, this);
+    ReaderFlag(t_rwlockThreadIndex).store(false, std::memory_order_relaxed);
+    DrainReaders(NULL);
+}
+
+void CRWLock::DowngradeWrite() {
+    _ASSERT(t_rwlockThreadIndex != 0);
+    _ASSERT(m_ownerThreadId.load(std::memory_order_relaxed) == t_rwlockThreadIndex);
+    _ASSERT(m_writeRecursion == 0);
+
+    // Write hold ends here, the read hold that follows isn't sampled
+    RWLOCK_PROFILE_EVENT(this, LOCK_PROFILE_LEAVE_WRITE);
+    RWLOCK_PROBE1(write_release, this);
+
+    // Become a reader before m_writerPending goes away. Next writer
+    // enters m_critSect after us and its flush makes the flag visible.
+    ReaderFlag(t_rwlockThreadIndex).store(true, std::memory_order_relaxed);
+    ReleaseWrite();
+    RWLOCK_PROBE2(read_acquire, this, 0);
+}
+
+#if defined(RWLOCK_STATS)
+CLockStats & CRWLock::GetStats() {
+    return *m_stats;
+}
+
+void CRWLock::SetStats(CLockStats & stats) {
+    m_stats = &stats;
+}
+#endif
+
 void InitRWLock() {
-    s_threadIndex = 0;
+    // Nothing to reset anymore. Reader slots are recycled on thread exit.
+}
+
+unsigned GetRWLockThreadHighWater() {
+    return s_slotHighWater.load(std::memory_order_acquire);
+}
+
+unsigned FindBusyRWLockReader(const std::atomic<uint8_t> * flags, unsigned count) {
+    return FindBusyReader(flags, count);
+}
+
+FindBusyRWLockReaderFn GetFindBusyRWLockReader(const char * name) {
+    if (strcmp(name, "Scalar") == 0)
+        return FindBusyReaderScalar;
+#if defined(RWLOCK_SCAN_SSE2)
+    if (strcmp(name, "SSE2") == 0)
+        return FindBusyReaderSse2;
+#endif
+#if defined(RWLOCK_SCAN_AVX2)
+    if (strcmp(name, "AVX2") == 0 && HasAvx2())
+        return FindBusyReaderAvx2;
+#endif
+    return NULL;
 }
 
 
@@ -2,7 +2,23 @@
  *      File: RWLock2.cpp
  *    Author: CS Lim
  *   Purpose: Reader writer lock using Per-Processor data
- * 
+ *
+ *   Notes:
+ *      - Windows: one SRWLOCK per processor
+ *      - Linux: one futex lock word (CFutexRWLock) per processor, each on
+ *        its own cache line. Current processor comes from the rseq area
+ *        registered by glibc, or sched_getcpu() when rseq is not available.
+ *      - TryEnterWrite()/EnterWriteUntil() take shards in order and release
+ *        the ones already taken, in reverse order, when they give up.
+ *      - With RWLOCK_STATS EnterRead() tries the shard first to tell fast
+ *        from slow reads. A write counts one exclusive acquisition per
+ *        shard, and the time to get them all as drain time.
+ *      - Linux: EnterXXX() always tries the shard first, for the USDT
+ *        probes (see LockProbes.h) to tell fast from contended. The try is
+ *        the same single CAS the blocking call starts with.
+ *      - Reader remembers its shard per lock in a small per-thread list,
+ *        so a thread can hold up to MAX_HELD_READ_LOCKS read locks (of
+ *        different CRWLock2 objects, or the same one) at once.
  */
 
 #include "stdafx.h"
@@ -14,49 +30,354 @@
 //===========================================================================
 
 static int s_numProcs = 0;
-static __declspec(thread) unsigned t_procId;    
+
+// Shard (processor) of each CRWLock2 read lock the thread holds. A thread
+// may hold several locks at once, e.g. stripes of a TRWLockTable, and
+// must leave each on the shard it entered.
+const unsigned MAX_HELD_READ_LOCKS = 16;
+
+struct HeldReadLock {
+    const CRWLock2 *    lock;
+    unsigned            procId;
+};
+
+static thread_local HeldReadLock    t_heldReads[MAX_HELD_READ_LOCKS];
+static thread_local unsigned        t_heldReadCount;
 
 static int GetNumberOfProcessors() {
     if (s_numProcs == 0) {
+#if defined(_WIN32)
         SYSTEM_INFO sysinfo;
         GetSystemInfo( &sysinfo );
         s_numProcs = sysinfo.dwNumberOfProcessors;
+#else
+        // Configured (not only online) processors so that any cpu number
+        // returned by GetCurrentProcessorNumber() is in range
+        s_numProcs = (int)sysconf(_SC_NPROCESSORS_CONF);
+#endif
     }
     return s_numProcs;
 }
 
+static void PushHeldRead(const CRWLock2 * lock, unsigned procId) {
+    unsigned count = t_heldReadCount;
+    if (count == MAX_HELD_READ_LOCKS) {
+        fprintf(stderr, "CRWLock2: more than %u read locks held\n", MAX_HELD_READ_LOCKS);
+        abort();
+    }
+    t_heldReads[count].lock = lock;
+    t_heldReads[count].procId = procId;
+    t_heldReadCount = count + 1;
+}
+
+static unsigned PopHeldRead(const CRWLock2 * lock) {
+    // Usually the newest one
+    unsigned i = t_heldReadCount;
+    do {
+        _ASSERT(i != 0);
+        i--;
+    } while (t_heldReads[i].lock != lock);
+
+    unsigned procId = t_heldReads[i].procId;
+    t_heldReads[i] = t_heldReads[--t_heldReadCount];
+    return procId;
+}
+
+//===========================================================================
+// CRWLock2 statistics
+//===========================================================================
+inline uint64_t CRWLock2::WriteStatStart() {
+#if defined(RWLOCK_STATS)
+    return LockStatNow();
+#else
+    return 0;
+#endif
+}
+
+inline void CRWLock2::WriteStatAcquired(uint64_t start) {
+#if defined(RWLOCK_STATS)
+    m_writeStart = LockStatNow();
+    CLockStats::Row & row = m_stats->Local(GetRWLockThreadIndex());
+    row.Add(LOCK_STAT_WRITE, 1);
+    row.Add(LOCK_STAT_WRITE_SHARDS, GetNumberOfProcessors());
+    row.Add(LOCK_STAT_DRAIN_NS, m_writeStart - start);
+#else
+    (void)start;
+#endif
+}
+
+inline void CRWLock2::WriteStatRelease() {
+#if defined(RWLOCK_STATS)
+    m_stats->Local(GetRWLockThreadIndex()).Add(LOCK_STAT_WRITE_HOLD_NS, LockStatNow() - m_writeStart);
+#endif
+}
+
+#if defined(RWLOCK_STATS)
+CLockStats & CRWLock2::GetStats() {
+    return *m_stats;
+}
+
+void CRWLock2::SetStats(CLockStats & stats) {
+    m_stats = &stats;
+}
+#endif
+
 //===========================================================================
 // CRWLock2 implementation
 //===========================================================================
+#if defined(_WIN32)
+
 CRWLock2::CRWLock2() {
     m_lock = new SRWLOCK[GetNumberOfProcessors()];
     for (int i = 0; i < GetNumberOfProcessors(); i++)
         InitializeSRWLock(&m_lock[i]);
+
+#if defined(RWLOCK_STATS)
+    m_ownStats = new CLockStats;
+    m_stats = m_ownStats;
+    m_writeStart = 0;
+#endif
 }
 
 CRWLock2::~CRWLock2() {
     delete [] m_lock;
+#if defined(RWLOCK_STATS)
+    delete m_ownStats;
+#endif
 }
 
 void CRWLock2::EnterRead() {
-    t_procId = GetCurrentProcessorNumber();
-    AcquireSRWLockShared(&m_lock[t_procId]);
+    unsigned procId = GetCurrentProcessorNumber();
+    PushHeldRead(this, procId);
+#if defined(RWLOCK_STATS)
+    if (TryAcquireSRWLockShared(&m_lock[procId])) {
+        RWLOCK_STAT(m_stats, GetRWLockThreadIndex(), LOCK_STAT_READ_FAST, 1);
+        return;
+    }
+    RWLOCK_STAT(m_stats, GetRWLockThreadIndex(), LOCK_STAT_READ_SLOW, 1);
+#endif
+    AcquireSRWLockShared(&m_lock[procId]);
 }
 
 void CRWLock2::LeaveRead() {
-    ReleaseSRWLockShared(&m_lock[t_procId]);
+    ReleaseSRWLockShared(&m_lock[PopHeldRead(this)]);
 }
 
 void CRWLock2::EnterWrite() {
+    uint64_t start = WriteStatStart();
     for (int i = 0; i < GetNumberOfProcessors(); i++)
         AcquireSRWLockExclusive(&m_lock[i]);
+    WriteStatAcquired(start);
 }
 
 void CRWLock2::LeaveWrite() {
+    WriteStatRelease();
     for (int i = 0; i < GetNumberOfProcessors(); i++)
         ReleaseSRWLockExclusive(&m_lock[i]);
 }
 
+// SRWLOCK has no timed acquire. Poll the try variant until the deadline.
+template <class TryAcquire>
+static bool AcquireSRWLockUntil(
+    SRWLOCK *                       lock,
+    TryAcquire                      tryAcquire,
+    const LockClock::time_point &   deadline
+) {
+    for (unsigned tries = 0; !tryAcquire(lock); tries++) {
+        if (LockClock::now() >= deadline)
+            return false;
+        if (tries < 16)
+            SwitchToThread();
+        else
+            Sleep(1);
+    }
+    return true;
+}
+
+bool CRWLock2::TryEnterRead() {
+    unsigned procId = GetCurrentProcessorNumber();
+    if (!TryAcquireSRWLockShared(&m_lock[procId]))
+        return false;
+
+    PushHeldRead(this, procId);
+    return true;
+}
+
+bool CRWLock2::EnterReadUntil(const LockClock::time_point & deadline) {
+    unsigned procId = GetCurrentProcessorNumber();
+    if (!AcquireSRWLockUntil(&m_lock[procId], TryAcquireSRWLockShared, deadline))
+        return false;
+
+    PushHeldRead(this, procId);
+    return true;
+}
+
+bool CRWLock2::TryEnterWrite() {
+    uint64_t start = WriteStatStart();
+    for (int i = 0; i < GetNumberOfProcessors(); i++) {
+        if (!TryAcquireSRWLockExclusive(&m_lock[i])) {
+            while (i-- > 0)
+                ReleaseSRWLockExclusive(&m_lock[i]);
+            return false;
+        }
+    }
+    WriteStatAcquired(start);
+    return true;
+}
+
+bool CRWLock2::EnterWriteUntil(const LockClock::time_point & deadline) {
+    uint64_t start = WriteStatStart();
+    for (int i = 0; i < GetNumberOfProcessors(); i++) {
+        if (!AcquireSRWLockUntil(&m_lock[i], TryAcquireSRWLockExclusive, deadline)) {
+            while (i-- > 0)
+                ReleaseSRWLockExclusive(&m_lock[i]);
+            return false;
+        }
+    }
+    WriteStatAcquired(start);
+    return true;
+}
+
+#else
+
+CRWLock2::CRWLock2() {
+    m_lock = (ProcLock *)AlignedAlloc(sizeof(ProcLock) * GetNumberOfProcessors());
+    for (int i = 0; i < GetNumberOfProcessors(); i++)
+        new (&m_lock[i].lock) CFutexRWLock;
+
+#if defined(RWLOCK_STATS)
+    m_ownStats = new CLockStats;
+    m_stats = m_ownStats;
+    m_writeStart = 0;
+#endif
+}
+
+CRWLock2::~CRWLock2() {
+    AlignedFree(m_lock);
+#if defined(RWLOCK_STATS)
+    delete m_ownStats;
+#endif
+}
+
+// Exclusive acquisition of one shard. Fires write_contend on the first
+// shard a writer has to wait for.
+static bool EnterShardWrite(
+    CFutexRWLock &                  shard,
+    const CRWLock2 *                lock,
+    bool &                          contended,
+    const LockClock::time_point *   deadline
+) {
+    (void)lock;     // Probe argument only
+    if (shard.TryEnterWrite())
+        return true;
+
+    if (!contended) {
+        RWLOCK_PROBE2(write_contend, lock, RWLOCK_CONTEND_SHARD);
+        contended = true;
+    }
+    if (deadline != NULL)
+        return shard.EnterWriteUntil(*deadline);
+
+    shard.EnterWrite();
+    return true;
+}
+
+void CRWLock2::EnterRead() {
+    unsigned procId = GetCurrentProcessorNumber();
+    _ASSERT(procId < (unsigned)GetNumberOfProcessors());
+    PushHeldRead(this, procId);
+    if (m_lock[procId].lock.TryEnterRead()) {
+        RWLOCK_STAT(m_stats, GetRWLockThreadIndex(), LOCK_STAT_READ_FAST, 1);
+        RWLOCK_PROBE2(read_acquire, this, 0);
+        return;
+    }
+
+    RWLOCK_STAT(m_stats, GetRWLockThreadIndex(), LOCK_STAT_READ_SLOW, 1);
+    RWLOCK_PROBE1(read_contend, this);
+    m_lock[procId].lock.EnterRead();
+    RWLOCK_PROBE2(read_acquire, this, 1);
+}
+
+void CRWLock2::LeaveRead() {
+    RWLOCK_PROBE1(read_release, this);
+    m_lock[PopHeldRead(this)].lock.LeaveRead();
+}
+
+void CRWLock2::EnterWrite() {
+    uint64_t start = WriteStatStart();
+    bool contended = false;
+    for (int i = 0; i < GetNumberOfProcessors(); i++)
+        EnterShardWrite(m_lock[i].lock, this, contended, NULL);
+    WriteStatAcquired(start);
+    RWLOCK_PROBE1(write_acquire, this);
+}
+
+void CRWLock2::LeaveWrite() {
+    RWLOCK_PROBE1(write_release, this);
+    WriteStatRelease();
+    for (int i = 0; i < GetNumberOfProcessors(); i++)
+        m_lock[i].lock.LeaveWrite();
+}
+
+bool CRWLock2::TryEnterRead() {
+    unsigned procId = GetCurrentProcessorNumber();
+    _ASSERT(procId < (unsigned)GetNumberOfProcessors());
+    if (!m_lock[procId].lock.TryEnterRead())
+        return false;
+
+    PushHeldRead(this, procId);
+    RWLOCK_PROBE2(read_acquire, this, 0);
+    return true;
+}
+
+bool CRWLock2::EnterReadUntil(const LockClock::time_point & deadline) {
+    unsigned procId = GetCurrentProcessorNumber();
+    _ASSERT(procId < (unsigned)GetNumberOfProcessors());
+    if (m_lock[procId].lock.TryEnterRead()) {
+        PushHeldRead(this, procId);
+        RWLOCK_PROBE2(read_acquire, this, 0);
+        return true;
+    }
+
+    RWLOCK_PROBE1(read_contend, this);
+    if (!m_lock[procId].lock.EnterReadUntil(deadline))
+        return false;
+
+    PushHeldRead(this, procId);
+    RWLOCK_PROBE2(read_acquire, this, 1);
+    return true;
+}
+
+bool CRWLock2::TryEnterWrite() {
+    uint64_t start = WriteStatStart();
+    for (int i = 0; i < GetNumberOfProcessors(); i++) {
+        if (!m_lock[i].lock.TryEnterWrite()) {
+            while (i-- > 0)
+                m_lock[i].lock.LeaveWrite();
+            return false;
+        }
+    }
+    WriteStatAcquired(start);
+    RWLOCK_PROBE1(write_acquire, this);
+    return true;
+}
+
+bool CRWLock2::EnterWriteUntil(const LockClock::time_point & deadline) {
+    uint64_t start = WriteStatStart();
+    bool contended = false;
+    for (int i = 0; i < GetNumberOfProcessors(); i++) {
+        if (!EnterShardWrite(m_lock[i].lock, this, contended, &deadline)) {
+            while (i-- > 0)
+                m_lock[i].lock.LeaveWrite();
+            return false;
+        }
+    }
+    WriteStatAcquired(start);
+    RWLOCK_PROBE1(write_acquire, this);
+    return true;
+}
+
+#endif
 
 //===========================================================================
 // MIT License
@@ -0,0 +1,548 @@
+/**
+ *      File: SharedRWLock.cpp
+ *    Author: CS Lim
+ *   Purpose: Asymmetric reader writer lock shared by processes mapping the
+ *            same memory (Linux)
+ *
+ *   Notes:
+ *      - Reader fast path is the same as CRWLock's: store own flag, load
+ *        m_writerPending, no atomic read-modify-write nor mfence.
+ *      - FlushProcessWriteBuffers() only reaches the threads of the calling
+ *        process. Writers use membarrier(MEMBARRIER_CMD_GLOBAL_EXPEDITED)
+ *        (Linux 4.16 and later) instead, which reaches every process that
+ *        registered with MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED. Each
+ *        process registers on first use of any CSharedRWLock, and again in
+ *        the child after fork(). Older kernels fall back to the slow
+ *        MEMBARRIER_CMD_GLOBAL, or to a fence on both sides without it.
+ *      - Reader slots are claimed in the lock itself, by (pid << 32 | tid).
+ *        A thread caches the slot of the last lock it used. High water of
+ *        claimed slots never goes down, the lowest free slot is reused.
+ *      - Writers exclude each other with a PTHREAD_PROCESS_SHARED robust
+ *        mutex. Waiting readers and writers sleep on process-shared futexes
+ *        (not FUTEX_PRIVATE_FLAG) for at most SHARED_OWNER_CHECK_MS, then
+ *        check whether the thread they wait for is alive:
+ *          - Dead writer: a waiting reader takes over the mutex (the kernel
+ *            hands it on with EOWNERDEAD) and releases the write lock.
+ *            A writer entering gets EOWNERDEAD too and simply goes on.
+ *            Any other mutex error aborts, the lock can't be used safely.
+ *          - Dead reader: the writer clears its flag and frees its slot.
+ *      - A thread is dead when tgkill(pid, tid, 0) fails, or when it is the
+ *        leader of a process that has exited and not been reaped yet
+ *        (zombie, state in /proc/pid/stat).
+ */
+
+#include "stdafx.h"
+#pragma  hdrstop
+
+#if !defined(_WIN32)
+
+//===========================================================================
+// Private constants
+//===========================================================================
+
+// Pause instructions a writer spins on a busy reader before yielding, and
+// yields before sleeping
+const unsigned SHARED_SPIN_LIMIT    = 256;
+const unsigned SHARED_YIELD_LIMIT   = 16;
+
+// Longest pause burst of the exponential backoff
+const unsigned SHARED_SPIN_BACKOFF  = 64;
+
+// Longest sleep of a waiting reader or writer before it checks whether the
+// thread it waits for is still alive
+const unsigned SHARED_OWNER_CHECK_MS = 20;
+
+// Slot owner while a dead owner's slot is being cleared
+const uint64_t SLOT_RECLAIMING = ~(uint64_t)0;
+
+// Heavy barrier of the writers
+enum SharedBarrierMode {
+    SHARED_BARRIER_GLOBAL_EXPEDITED,
+    SHARED_BARRIER_GLOBAL,
+    SHARED_BARRIER_FENCE,           // No membarrier(), fence on both sides
+};
+
+
+//===========================================================================
+// Private variables
+//===========================================================================
+static pthread_mutex_t      s_initLock = PTHREAD_MUTEX_INITIALIZER;
+static bool                 s_initialized = false;
+static bool                 s_registered = false;   // Cleared in fork child
+static SharedBarrierMode    s_barrierMode = SHARED_BARRIER_FENCE;
+
+// (pid << 32 | tid) of the calling thread, 0 until first use
+static thread_local uint64_t                t_sharedOwner;
+
+// Last lock the thread used and its slot there
+static thread_local const CSharedRWLock *   t_sharedLock;
+static thread_local unsigned                t_sharedSlot;
+
+
+//===========================================================================
+// Private functions
+//===========================================================================
+static long Membarrier (int cmd) {
+    return syscall(__NR_membarrier, cmd, 0);
+}
+
+static SharedBarrierMode QueryBarrierMode () {
+    long cmds = Membarrier(MEMBARRIER_CMD_QUERY);
+    if (cmds < 0)
+        return SHARED_BARRIER_FENCE;
+    if (cmds & MEMBARRIER_CMD_GLOBAL_EXPEDITED)
+        return SHARED_BARRIER_GLOBAL_EXPEDITED;
+    if (cmds & MEMBARRIER_CMD_GLOBAL)
+        return SHARED_BARRIER_GLOBAL;
+    return SHARED_BARRIER_FENCE;
+}
+
+static void SharedBarrier () {
+    switch (s_barrierMode) {
+    case SHARED_BARRIER_GLOBAL_EXPEDITED:
+        Membarrier(MEMBARRIER_CMD_GLOBAL_EXPEDITED);
+        break;
+    case SHARED_BARRIER_GLOBAL:
+        Membarrier(MEMBARRIER_CMD_GLOBAL);
+        break;
+    default:
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        break;
+    }
+}
+
+// Reader side of the barrier: compiler barrier only, unless there is no
+// membarrier() to pair with
+static inline void ReaderFence () {
+    if (s_barrierMode == SHARED_BARRIER_FENCE)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    else
+        _ReadWriteBarrier();
+}
+
+static void SharedFutexWait (std::atomic<uint32_t> * addr, uint32_t expected, unsigned ms) {
+    // Relative timeout. Returns immediately if *addr != expected.
+    struct timespec ts;
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, &ts, NULL, 0);
+}
+
+static void SharedFutexWakeAll (std::atomic<uint32_t> * addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void MutexFailed (const char * call, int result) {
+    fprintf(stderr, "CSharedRWLock: %s failed (%d)\n", call, result);
+    abort();
+}
+
+static void OnForkChild () {
+    // Child is a new process: new pid, not registered for membarrier, and
+    // owns none of the parent's slots
+    s_registered = false;
+    t_sharedOwner = 0;
+    t_sharedLock = NULL;
+}
+
+static RWLOCK_NOINLINE uint64_t InitSharedThread () {
+    pthread_mutex_lock(&s_initLock);
+    if (!s_initialized) {
+        s_barrierMode = QueryBarrierMode();
+        pthread_atfork(NULL, NULL, OnForkChild);
+        s_initialized = true;
+    }
+
+    // Writers of other processes can only reach our readers once we are
+    // registered, so the process must register before its first read
+    if (!s_registered) {
+        if (s_barrierMode == SHARED_BARRIER_GLOBAL_EXPEDITED
+            && Membarrier(MEMBARRIER_CMD_REGISTER_GLOBAL_EXPEDITED) != 0) {
+            pthread_mutex_unlock(&s_initLock);
+            fprintf(stderr, "CSharedRWLock: membarrier registration failed (%d)\n", errno);
+            abort();
+        }
+        s_registered = true;
+    }
+    pthread_mutex_unlock(&s_initLock);
+
+    t_sharedOwner = ((uint64_t)getpid() << 32) | (uint32_t)syscall(SYS_gettid);
+    return t_sharedOwner;
+}
+
+static inline uint64_t LocalOwner () {
+    uint64_t owner = t_sharedOwner;
+    if (owner == 0)
+        owner = InitSharedThread();
+    return owner;
+}
+
+static bool IsOwnerAlive (uint64_t owner) {
+    pid_t pid = (pid_t)(owner >> 32);
+    pid_t tid = (pid_t)(uint32_t)owner;
+
+    // EPERM: alive, owned by another user
+    if (syscall(SYS_tgkill, pid, tid, 0) != 0 && errno == ESRCH)
+        return false;
+
+    // Exited process leader stays a zombie until its parent reaps it, and
+    // tgkill() still finds it
+    if (tid != pid)
+        return true;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE * file = fopen(path, "r");
+    if (file == NULL)
+        return true;
+
+    // "pid (comm) state ...", comm may contain ')'
+    char line[512];
+    size_t length = fread(line, 1, sizeof(line) - 1, file);
+    fclose(file);
+    line[length] = 0;
+
+    const char * state = strrchr(line, ')');
+    if (state == NULL || state[1] == 0)
+        return true;
+    return state[2] != 'Z' && state[2] != 'X';
+}
+
+
+//===========================================================================
+// CSharedRWLock implementation
+//===========================================================================
+CSharedRWLock::CSharedRWLock() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m_writerMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    m_writerOwner = 0;
+    m_writerPending = 0;
+    m_writeGeneration = 0;
+    m_readersParked = 0;
+    m_writerParked = 0;
+    m_writerWake = 0;
+    m_deadReaders = 0;
+    m_deadWriters = 0;
+    m_slotHighWater = 0;
+
+    for (unsigned i = 0; i < MAX_SHARED_READER_COUNT; i++) {
+        m_slotOwners[i].store(0, std::memory_order_relaxed);
+        m_readers[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+CSharedRWLock::~CSharedRWLock() {
+    pthread_mutex_destroy(&m_writerMutex);
+}
+
+inline unsigned CSharedRWLock::LocalSlot() {
+    if (t_sharedLock == this)
+        return t_sharedSlot;
+    return ClaimSlot();
+}
+
+unsigned CSharedRWLock::ClaimSlot() {
+    uint64_t self = LocalOwner();
+
+    // Already have one (thread switching between locks)
+    unsigned index = MAX_SHARED_READER_COUNT;
+    unsigned highWater = m_slotHighWater.load(std::memory_order_acquire);
+    for (unsigned i = 0; i < highWater; i++) {
+        if (m_slotOwners[i].load(std::memory_order_relaxed) == self) {
+            index = i;
+            break;
+        }
+    }
+
+    // Lowest free slot, reclaiming slots of dead threads when all are taken
+    while (index == MAX_SHARED_READER_COUNT) {
+        for (unsigned i = 0; i < MAX_SHARED_READER_COUNT; i++) {
+            uint64_t expected = 0;
+            if (m_slotOwners[i].load(std::memory_order_relaxed) == 0
+                && m_slotOwners[i].compare_exchange_strong(expected, self, std::memory_order_acq_rel)) {
+                index = i;
+                break;
+            }
+        }
+
+        if (index == MAX_SHARED_READER_COUNT && ReclaimDeadSlots() == 0) {
+            fprintf(stderr, "CSharedRWLock: more than %u reader threads\n", MAX_SHARED_READER_COUNT);
+            abort();
+        }
+    }
+
+    // Published before our first flag store, so a writer that misses the
+    // flag can't miss the slot either (see EnterWrite())
+    highWater = m_slotHighWater.load(std::memory_order_relaxed);
+    while (highWater <= index
+        && !m_slotHighWater.compare_exchange_weak(highWater, index + 1, std::memory_order_release))
+        ;
+
+    t_sharedLock = this;
+    t_sharedSlot = index;
+    return index;
+}
+
+bool CSharedRWLock::ReclaimSlot(unsigned index, uint64_t owner) {
+    if (owner == 0 || owner == SLOT_RECLAIMING || IsOwnerAlive(owner))
+        return false;
+
+    // Lock the slot first, so that no one claims it while the flag is
+    // still set and no other reclaimer clears the flag of a new owner
+    if (!m_slotOwners[index].compare_exchange_strong(owner, SLOT_RECLAIMING, std::memory_order_acquire))
+        return false;
+
+    if (m_readers[index].load(std::memory_order_relaxed)) {
+        m_readers[index].store(0, std::memory_order_release);
+        m_deadReaders.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_slotOwners[index].store(0, std::memory_order_release);
+    return true;
+}
+
+unsigned CSharedRWLock::ReclaimDeadSlots() {
+    unsigned count = 0;
+    unsigned highWater = m_slotHighWater.load(std::memory_order_acquire);
+    for (unsigned i = 0; i < highWater; i++) {
+        if (ReclaimSlot(i, m_slotOwners[i].load(std::memory_order_relaxed)))
+            count++;
+    }
+    return count;
+}
+
+void CSharedRWLock::ReleaseSlot() {
+    uint64_t self = t_sharedOwner;
+    if (self == 0)
+        return;
+
+    unsigned highWater = m_slotHighWater.load(std::memory_order_acquire);
+    for (unsigned i = 0; i < highWater; i++) {
+        if (m_slotOwners[i].load(std::memory_order_relaxed) == self) {
+            _ASSERT(m_readers[i].load(std::memory_order_relaxed) == 0);
+            m_slotOwners[i].store(0, std::memory_order_release);
+            break;
+        }
+    }
+
+    if (t_sharedLock == this)
+        t_sharedLock = NULL;
+}
+
+void CSharedRWLock::WakeWriter() {
+    m_writerWake.fetch_add(1, std::memory_order_relaxed);
+    SharedFutexWakeAll(&m_writerWake);
+}
+
+void CSharedRWLock::WaitForWriter(std::atomic<uint8_t> & flag) {
+    do {
+        // Signal that we see the writer and wait for it to complete
+        flag.store(0, std::memory_order_release);
+        ReaderFence();
+        if (m_writerParked.load(std::memory_order_relaxed))
+            WakeWriter();
+
+        uint32_t generation = m_writeGeneration.load(std::memory_order_acquire);
+        m_readersParked.fetch_add(1, std::memory_order_seq_cst);
+        if (m_writerPending.load(std::memory_order_seq_cst)
+            && m_writeGeneration.load(std::memory_order_seq_cst) == generation) {
+            SharedFutexWait(&m_writeGeneration, generation, SHARED_OWNER_CHECK_MS);
+
+            // Same write still going on. Is its writer still there?
+            uint64_t owner = m_writerOwner.load(std::memory_order_relaxed);
+            if (owner != 0
+                && m_writeGeneration.load(std::memory_order_acquire) == generation
+                && !IsOwnerAlive(owner))
+                RecoverWriter();
+        }
+        m_readersParked.fetch_sub(1, std::memory_order_relaxed);
+
+        // Try again. Next writer may already be pending.
+        flag.store(1, std::memory_order_relaxed);
+        ReaderFence();
+    } while (m_writerPending.load(std::memory_order_acquire));
+}
+
+void CSharedRWLock::RecoverWriter() {
+    // Kernel passes the dead writer's mutex on to the next locker with
+    // EOWNERDEAD. Busy: a new writer has taken over (or recovered) already.
+    // Free: it was recovered and released in the meantime.
+    int result = pthread_mutex_trylock(&m_writerMutex);
+    if (result == EBUSY)
+        return;
+    if (result == 0) {
+        pthread_mutex_unlock(&m_writerMutex);
+        return;
+    }
+    if (result != EOWNERDEAD)
+        MutexFailed("pthread_mutex_trylock", result);
+
+    pthread_mutex_consistent(&m_writerMutex);
+    m_deadWriters.fetch_add(1, std::memory_order_relaxed);
+    m_writerParked.store(0, std::memory_order_relaxed);
+
+    // Owner is read under the mutex, so no new writer can have stored its
+    // own meanwhile. The dead holder may have died before publishing its
+    // write (the one we saw was released since), then there is none to
+    // take over.
+    if (m_writerOwner.load(std::memory_order_relaxed) == 0) {
+        pthread_mutex_unlock(&m_writerMutex);
+        return;
+    }
+
+    // Take the write over from the dead writer and release it
+    m_writerOwner.store(LocalOwner(), std::memory_order_relaxed);
+    ReleaseWrite();
+}
+
+void CSharedRWLock::EnterRead() {
+    std::atomic<uint8_t> & flag = m_readers[LocalSlot()];
+    flag.store(1, std::memory_order_relaxed);
+
+    // Pending write lock exists? Writer's SharedBarrier() orders our store
+    // before the load.
+    ReaderFence();
+    if (m_writerPending.load(std::memory_order_acquire))
+        WaitForWriter(flag);
+
+    // Need to order caller code inside critical section
+    _ReadWriteBarrier();
+}
+
+void CSharedRWLock::LeaveRead() {
+    std::atomic<uint8_t> & flag = m_readers[LocalSlot()];
+
+    // Need to order caller code inside critical section
+    _ReadWriteBarrier();
+    flag.store(0, std::memory_order_release);
+
+    // Writer sleeping for readers to drain?
+    ReaderFence();
+    if (m_writerParked.load(std::memory_order_relaxed))
+        WakeWriter();
+}
+
+void CSharedRWLock::WaitForReader(unsigned index) {
+    const std::atomic<uint8_t> & flag = m_readers[index];
+    unsigned spins = 0;
+    unsigned backoff = 1;
+    unsigned yields = 0;
+
+    while (flag.load(std::memory_order_acquire)) {
+        if (spins < SHARED_SPIN_LIMIT) {
+            // Exponential backoff
+            for (unsigned i = 0; i < backoff; i++)
+                YieldProcessor();
+            spins += backoff;
+            if (backoff < SHARED_SPIN_BACKOFF)
+                backoff *= 2;
+        }
+        else if (yields < SHARED_YIELD_LIMIT) {
+            SwitchToThread();
+            yields++;
+        }
+        else {
+            // Same handshake as CRWLock::ParkWriter()
+            uint32_t wake = m_writerWake.load(std::memory_order_relaxed);
+            m_writerParked.store(1, std::memory_order_relaxed);
+            SharedBarrier();
+            if (flag.load(std::memory_order_acquire))
+                SharedFutexWait(&m_writerWake, wake, SHARED_OWNER_CHECK_MS);
+            m_writerParked.store(0, std::memory_order_relaxed);
+
+            // Reader still inside after a long sleep: died holding it?
+            if (flag.load(std::memory_order_acquire))
+                ReclaimSlot(index, m_slotOwners[index].load(std::memory_order_acquire));
+        }
+    }
+}
+
+void CSharedRWLock::EnterWrite() {
+    uint64_t self = LocalOwner();
+
+    // Previous writer died holding the mutex. Its m_writerPending is still
+    // set, so readers are kept out as if it were ours already. Any other
+    // error (ENOTRECOVERABLE) leaves writers without exclusion.
+    int result = pthread_mutex_lock(&m_writerMutex);
+    if (result == EOWNERDEAD) {
+        pthread_mutex_consistent(&m_writerMutex);
+        m_deadWriters.fetch_add(1, std::memory_order_relaxed);
+        m_writerParked.store(0, std::memory_order_relaxed);
+    }
+    else if (result != 0) {
+        MutexFailed("pthread_mutex_lock", result);
+    }
+
+    // Owner first, readers that see m_writerPending check it
+    m_writerOwner.store(self, std::memory_order_relaxed);
+    m_writerPending.store(1, std::memory_order_seq_cst);
+
+    // Here we are sure that:
+    //       (1) writer will see (m_readers[i]    == 1)
+    //    or (2) reader will see (m_writerPending == 1)
+    // in every process registered for the global barrier
+    SharedBarrier();
+
+    // Wait for each busy reader to complete and continue from there
+    unsigned highWater = m_slotHighWater.load(std::memory_order_acquire);
+    unsigned i = 0;
+    while ((i += FindBusyRWLockReader(m_readers + i, highWater - i)) < highWater)
+        WaitForReader(i);
+
+    // Keep caller's critical section after the (non-atomic) scan
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+void CSharedRWLock::ReleaseWrite() {
+    m_writerOwner.store(0, std::memory_order_relaxed);
+    m_writerPending.store(0, std::memory_order_seq_cst);
+
+    // Release all blocked readers with a single broadcast
+    m_writeGeneration.fetch_add(1, std::memory_order_seq_cst);
+    if (m_readersParked.load(std::memory_order_seq_cst))
+        SharedFutexWakeAll(&m_writeGeneration);
+
+    pthread_mutex_unlock(&m_writerMutex);
+}
+
+void CSharedRWLock::LeaveWrite() {
+    ReleaseWrite();
+}
+
+unsigned CSharedRWLock::GetDeadReaders() const {
+    return m_deadReaders.load(std::memory_order_relaxed);
+}
+
+unsigned CSharedRWLock::GetDeadWriters() const {
+    return m_deadWriters.load(std::memory_order_relaxed);
+}
+
+#endif // !defined(_WIN32)
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2012 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
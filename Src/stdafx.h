@@ -7,8 +7,12 @@
 
 // System includes
 
+#if defined(_WIN32)
+
 // FlushProcessWriteBuffers API supported since Vista
-#define NTDDI_VERSION _WIN32_WINNT_VISTA
+// WaitOnAddress API supported since Windows 8
+#define NTDDI_VERSION   NTDDI_WIN8
+#define _WIN32_WINNT    _WIN32_WINNT_WIN8
 #include <SDKDDKVer.h>
 
 #define STRICT
@@ -16,11 +20,75 @@
 #include <windows.h>
 #include <winbase.h>
 #include <intrin.h>
+#include <immintrin.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <crtdbg.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+#else
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <cxxabi.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <thread>
+
+// backtrace() of the lock profiler
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// rseq area registered by glibc 2.35 and later. Nested, an undefined
+// function-like macro is a syntax error even after a false &&.
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 35)
+#include <sys/rseq.h>
+#define RWLOCK_HAVE_RSEQ
+#endif
+#endif
+
+#endif
 
 // Project includes
 #include "Common.h"
 #include "RWLock.h"
-#include "RWLock2.h"
\ No newline at end of file
+#include "LockStats.h"
+#include "LockProfiler.h"
+#include "LockProbes.h"
+#include "RWLock2.h"
+#include "HybridRWLock.h"
+#include "RWLockTable.h"
+#include "BravoRWLock.h"
+#include "CohortRWLock.h"
+#include "RCU.h"
+#include "LeftRight.h"
+#include "AsymRWLock.h"
+#include "PhaseFairRWLock.h"
+#include "SharedRWLock.h"
\ No newline at end of file
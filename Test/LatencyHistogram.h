@@ -0,0 +1,142 @@
+/**
+ *      File: LatencyHistogram.h
+ *    Author: CS Lim
+ *   Purpose: Log-linear (HDR style) latency histogram of the test program
+ *
+ *   Notes:
+ *      - Values below 2^SUB_BITS get a bucket each. Above that every power
+ *        of 2 is split in 2^(SUB_BITS-1) buckets, so a percentile is within
+ *        ~6% of the real value over the whole 64-bit range.
+ *      - Not thread safe. Each test thread records into its own histogram
+ *        (no atomics on the measured path) and the results are merged with
+ *        Add() after the threads exit.
+ */
+
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+//===========================================================================
+// CLatencyHistogram Declaration
+//===========================================================================
+class CLatencyHistogram {
+public:
+    enum : unsigned {
+        SUB_BITS    = 5,
+        HALF_COUNT  = 1u << (SUB_BITS - 1),
+        BUCKETS     = (66 - SUB_BITS) * HALF_COUNT,
+    };
+
+private:
+    uint64_t    m_counts[BUCKETS];
+    uint64_t    m_max;
+
+    static unsigned HighestBit(uint64_t value);
+    static unsigned BucketOf(uint64_t value);
+    static uint64_t BucketHigh(unsigned bucket);
+
+public:
+    CLatencyHistogram() { Clear(); }
+
+    void Clear();
+    void Record(uint64_t value);
+    void Add(const CLatencyHistogram & other);
+
+    uint64_t GetCount() const;
+    uint64_t GetMax() const { return m_max; }
+
+    // Smallest value at or above the given percent (0..100) of records,
+    // rounded up to the bucket end but never above the recorded max
+    uint64_t GetPercentile(double percent) const;
+};
+
+//===========================================================================
+// CLatencyHistogram inline implementation
+//===========================================================================
+inline unsigned CLatencyHistogram::HighestBit(uint64_t value) {
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return index;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+        return index + 32;
+    _BitScanReverse(&index, (unsigned long)value);
+    return index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+inline unsigned CLatencyHistogram::BucketOf(uint64_t value) {
+    if (value < (1u << SUB_BITS))
+        return (unsigned)value;
+
+    // Top SUB_BITS bits of value, top one always set
+    unsigned shift = HighestBit(value) - SUB_BITS + 1;
+    return shift * HALF_COUNT + (unsigned)(value >> shift);
+}
+
+inline uint64_t CLatencyHistogram::BucketHigh(unsigned bucket) {
+    if (bucket < (1u << SUB_BITS))
+        return bucket;
+
+    unsigned shift = bucket / HALF_COUNT - 1;
+    uint64_t low = (uint64_t)(bucket % HALF_COUNT + HALF_COUNT) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+inline void CLatencyHistogram::Clear() {
+    memset(m_counts, 0, sizeof(m_counts));
+    m_max = 0;
+}
+
+inline void CLatencyHistogram::Record(uint64_t value) {
+    m_counts[BucketOf(value)]++;
+    if (value > m_max)
+        m_max = value;
+}
+
+inline void CLatencyHistogram::Add(const CLatencyHistogram & other) {
+    for (unsigned i = 0; i < BUCKETS; i++)
+        m_counts[i] += other.m_counts[i];
+    if (other.m_max > m_max)
+        m_max = other.m_max;
+}
+
+inline uint64_t CLatencyHistogram::GetCount() const {
+    uint64_t count = 0;
+    for (unsigned i = 0; i < BUCKETS; i++)
+        count += m_counts[i];
+    return count;
+}
+
+inline uint64_t CLatencyHistogram::GetPercentile(double percent) const {
+    uint64_t count = GetCount();
+    if (count == 0)
+        return 0;
+
+    // Rank of the record, 1 based
+    uint64_t rank = (uint64_t)ceil(percent / 100.0 * count);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < BUCKETS; i++)
+    {
+        seen += m_counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = BucketHigh(i);
+            return value < m_max ? value : m_max;
+        }
+    }
+    return m_max;
+}
+
+
+#endif /* LATENCYHISTOGRAM_H */
@@ -0,0 +1,382 @@
+/**
+ *      File: ProbeTracer.h
+ *    Author: CS Lim
+ *   Purpose: In-process stand-in of perf/bpftrace for the USDT probes of
+ *            the test program (x86-64 Linux)
+ *
+ *   Notes:
+ *      - Reads the .note.stapsdt notes of /proc/self/exe the way perf and
+ *        bpftrace do, and attaches like a uprobe: the nop of each probe
+ *        site becomes an int3. The SIGTRAP handler evaluates the argument
+ *        specs ("8@%rdi", "8@$1", "8@-16(%rbp)") on the trapped registers
+ *        and appends an event. int3 replaces a one byte nop, so execution
+ *        simply continues after it.
+ *      - Events of all threads go to one array in hit order.
+ *      - Only for the probes self-test. Attach() patches the text of the
+ *        running program and changes the SIGTRAP handler.
+ */
+
+#ifndef PROBETRACER_H
+#define PROBETRACER_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#if defined(RWLOCK_HAVE_PROBES) && defined(__x86_64__)
+
+#define RWLOCK_HAVE_PROBE_TRACER
+
+//===========================================================================
+// CProbeTracer Declaration
+//===========================================================================
+class CProbeTracer {
+public:
+    enum : unsigned {
+        MAX_PROBES  = 256,
+        MAX_ARGS    = 4,
+        MAX_EVENTS  = 64 * 1024,
+    };
+
+    struct Event {
+        std::atomic<uint32_t>   ready;
+        unsigned                probe;
+        uint64_t                args[MAX_ARGS];
+    };
+
+private:
+    enum ArgKind {
+        ARG_REGISTER,       // %reg
+        ARG_IMMEDIATE,      // $value
+        ARG_MEMORY,         // offset(%reg)
+    };
+
+    struct Arg {
+        ArgKind     kind;
+        int         reg;        // REG_XXX of ucontext
+        int64_t     value;      // Immediate or offset
+    };
+
+    struct Probe {
+        std::string name;
+        uint8_t *   site;
+        unsigned    argCount;
+        Arg         args[MAX_ARGS];
+    };
+
+    std::vector<Probe>      m_probes;
+    Event *                 m_events;
+    std::atomic<unsigned>   m_eventCount;
+    struct sigaction        m_oldAction;
+    bool                    m_attached;
+
+    // Tracer the SIGTRAP handler records into
+    static CProbeTracer *& Active();
+
+    static bool ParseRegister(const char * name, size_t length, int * reg);
+    static bool ParseArg(const char * spec, Arg * arg);
+    static void OnTrap(int signal, siginfo_t * info, void * context);
+    static bool SetSite(uint8_t * site, uint8_t opcode);
+
+    // Non-copyable
+    CProbeTracer(const CProbeTracer &);
+    CProbeTracer & operator=(const CProbeTracer &);
+
+public:
+    CProbeTracer();
+    ~CProbeTracer();
+
+    // Probe sites of provider in the program. False if there are none,
+    // or one isn't a nop (already traced?) or has an argument we can't
+    // evaluate.
+    bool Load(const char * provider);
+    unsigned GetProbeCount() const { return (unsigned)m_probes.size(); }
+
+    bool Attach();
+    void Detach();
+
+    void ClearEvents();
+    unsigned GetEventCount() const;
+    const Event & GetEvent(unsigned index) const { return m_events[index]; }
+    const char * GetEventName(const Event & event) const;
+    unsigned GetEventArgCount(const Event & event) const;
+
+    // Wait until a probe with the given name fired with arg0 == lock
+    bool WaitForEvent(const char * name, const void * lock, unsigned timeoutMs) const;
+};
+
+//===========================================================================
+// CProbeTracer inline implementation
+//===========================================================================
+inline CProbeTracer::CProbeTracer() {
+    m_events = new Event[MAX_EVENTS];
+    m_eventCount = 0;
+    m_attached = false;
+}
+
+inline CProbeTracer::~CProbeTracer() {
+    Detach();
+    delete [] m_events;
+}
+
+inline CProbeTracer *& CProbeTracer::Active() {
+    static CProbeTracer * s_active;
+    return s_active;
+}
+
+inline bool CProbeTracer::ParseRegister(const char * name, size_t length, int * reg) {
+    static const struct {
+        const char *    name;
+        int             reg;
+    } s_registers[] = {
+        { "rax", REG_RAX }, { "rbx", REG_RBX }, { "rcx", REG_RCX }, { "rdx", REG_RDX },
+        { "rsi", REG_RSI }, { "rdi", REG_RDI }, { "rbp", REG_RBP }, { "rsp", REG_RSP },
+        { "r8",  REG_R8  }, { "r9",  REG_R9  }, { "r10", REG_R10 }, { "r11", REG_R11 },
+        { "r12", REG_R12 }, { "r13", REG_R13 }, { "r14", REG_R14 }, { "r15", REG_R15 },
+    };
+
+    for (unsigned i = 0; i < sizeof(s_registers) / sizeof(s_registers[0]); i++) {
+        if (strlen(s_registers[i].name) == length && strncmp(s_registers[i].name, name, length) == 0) {
+            *reg = s_registers[i].reg;
+            return true;
+        }
+    }
+    return false;
+}
+
+inline bool CProbeTracer::ParseArg(const char * spec, Arg * arg) {
+    // Size (negative if signed) is always 8 for our probes
+    const char * at = strchr(spec, '@');
+    if (at == NULL)
+        return false;
+    const char * operand = at + 1;
+
+    if (operand[0] == '$') {
+        arg->kind = ARG_IMMEDIATE;
+        arg->value = strtoll(operand + 1, NULL, 0);
+        return true;
+    }
+    if (operand[0] == '%') {
+        arg->kind = ARG_REGISTER;
+        arg->value = 0;
+        return ParseRegister(operand + 1, strlen(operand + 1), &arg->reg);
+    }
+
+    // offset(%reg)
+    char * paren;
+    arg->kind = ARG_MEMORY;
+    arg->value = strtoll(operand, &paren, 0);
+    if (paren[0] != '(' || paren[1] != '%')
+        return false;
+    const char * close = strchr(paren, ')');
+    return close != NULL && ParseRegister(paren + 2, close - (paren + 2), &arg->reg);
+}
+
+inline bool CProbeTracer::Load(const char * provider) {
+    m_probes.clear();
+
+    // Whole executable, sections aren't necessarily mapped
+    FILE * file = fopen("/proc/self/exe", "rb");
+    if (file == NULL)
+        return false;
+    std::vector<char> image;
+    char buffer[64 * 1024];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        image.insert(image.end(), buffer, buffer + read);
+    fclose(file);
+
+    const Elf64_Ehdr * header = (const Elf64_Ehdr *)image.data();
+    if (image.size() < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0
+        || header->e_ident[EI_CLASS] != ELFCLASS64)
+        return false;
+
+    const Elf64_Shdr * sections = (const Elf64_Shdr *)(image.data() + header->e_shoff);
+    const char * names = image.data() + sections[header->e_shstrndx].sh_offset;
+    const Elf64_Shdr * notes = NULL;
+    const Elf64_Shdr * base = NULL;
+    for (unsigned i = 0; i < header->e_shnum; i++) {
+        if (strcmp(names + sections[i].sh_name, ".note.stapsdt") == 0)
+            notes = &sections[i];
+        else if (strcmp(names + sections[i].sh_name, ".stapsdt.base") == 0)
+            base = &sections[i];
+    }
+    if (notes == NULL || base == NULL)
+        return false;
+
+    // Load address of the executable (PIE)
+    uintptr_t loadBias = 0;
+    dl_iterate_phdr([](struct dl_phdr_info * info, size_t, void * data) -> int {
+        *(uintptr_t *)data = info->dlpi_addr;
+        return 1;
+    }, &loadBias);
+
+    const char * p = image.data() + notes->sh_offset;
+    const char * end = p + notes->sh_size;
+    while (p + sizeof(Elf64_Nhdr) <= end) {
+        const Elf64_Nhdr * note = (const Elf64_Nhdr *)p;
+        const char * name = p + sizeof(Elf64_Nhdr);
+        const char * desc = name + ((note->n_namesz + 3) & ~3u);
+        p = desc + ((note->n_descsz + 3) & ~3u);
+        if (note->n_type != 3 || strcmp(name, "stapsdt") != 0)
+            continue;
+
+        // pc, base and semaphore, then provider, name and argument specs
+        uint64_t pc, linkBase;
+        memcpy(&pc, desc, 8);
+        memcpy(&linkBase, desc + 8, 8);
+        const char * noteProvider = desc + 24;
+        const char * probeName = noteProvider + strlen(noteProvider) + 1;
+        const char * argSpecs = probeName + strlen(probeName) + 1;
+        if (strcmp(noteProvider, provider) != 0)
+            continue;
+
+        Probe probe;
+        probe.name = probeName;
+        probe.site = (uint8_t *)(loadBias + pc + (base->sh_addr - linkBase));
+        probe.argCount = 0;
+
+        std::string specs = argSpecs;
+        for (size_t start = 0; start < specs.size(); ) {
+            size_t space = specs.find(' ', start);
+            if (space == std::string::npos)
+                space = specs.size();
+            if (probe.argCount == MAX_ARGS
+                || !ParseArg(specs.substr(start, space - start).c_str(), &probe.args[probe.argCount++])) {
+                fprintf(stderr, "Can't evaluate arguments of %s: %s\n", probeName, argSpecs);
+                return false;
+            }
+            start = space + 1;
+        }
+
+        // Untraced probes are nops
+        if (*probe.site != 0x90) {
+            fprintf(stderr, "Probe %s at %p is not a nop\n", probeName, probe.site);
+            return false;
+        }
+        if (m_probes.size() == MAX_PROBES)
+            return false;
+        m_probes.push_back(probe);
+    }
+    return !m_probes.empty();
+}
+
+inline bool CProbeTracer::SetSite(uint8_t * site, uint8_t opcode) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    void * page = (void *)((uintptr_t)site & ~(uintptr_t)(pageSize - 1));
+    if (mprotect(page, pageSize, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+        return false;
+    *(volatile uint8_t *)site = opcode;
+    return mprotect(page, pageSize, PROT_READ | PROT_EXEC) == 0;
+}
+
+inline void CProbeTracer::OnTrap(int signal, siginfo_t * info, void * context) {
+    (void)signal;
+    (void)info;
+    greg_t * regs = ((ucontext_t *)context)->uc_mcontext.gregs;
+
+    // int3 leaves RIP after itself, which is after the nop it replaced
+    CProbeTracer * tracer = Active();
+    uint8_t * site = (uint8_t *)regs[REG_RIP] - 1;
+    for (unsigned i = 0; i < tracer->m_probes.size(); i++) {
+        const Probe & probe = tracer->m_probes[i];
+        if (probe.site != site)
+            continue;
+
+        unsigned index = tracer->m_eventCount.fetch_add(1, std::memory_order_relaxed);
+        if (index >= MAX_EVENTS)
+            return;
+
+        Event & event = tracer->m_events[index];
+        event.probe = i;
+        for (unsigned arg = 0; arg < probe.argCount; arg++) {
+            const Arg & spec = probe.args[arg];
+            if (spec.kind == ARG_IMMEDIATE)
+                event.args[arg] = (uint64_t)spec.value;
+            else if (spec.kind == ARG_REGISTER)
+                event.args[arg] = (uint64_t)regs[spec.reg];
+            else
+                event.args[arg] = *(const uint64_t *)(regs[spec.reg] + spec.value);
+        }
+        event.ready.store(1, std::memory_order_release);
+        return;
+    }
+}
+
+inline bool CProbeTracer::Attach() {
+    if (m_attached || Active() != NULL)
+        return false;
+
+    Active() = this;
+    ClearEvents();
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = OnTrap;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGTRAP, &action, &m_oldAction) != 0) {
+        Active() = NULL;
+        return false;
+    }
+
+    m_attached = true;
+    for (unsigned i = 0; i < m_probes.size(); i++) {
+        if (!SetSite(m_probes[i].site, 0xCC)) {
+            Detach();
+            return false;
+        }
+    }
+    return true;
+}
+
+inline void CProbeTracer::Detach() {
+    if (!m_attached)
+        return;
+
+    for (unsigned i = 0; i < m_probes.size(); i++)
+        SetSite(m_probes[i].site, 0x90);
+    sigaction(SIGTRAP, &m_oldAction, NULL);
+    Active() = NULL;
+    m_attached = false;
+}
+
+inline void CProbeTracer::ClearEvents() {
+    unsigned count = GetEventCount();
+    for (unsigned i = 0; i < count; i++)
+        m_events[i].ready.store(0, std::memory_order_relaxed);
+    m_eventCount.store(0, std::memory_order_seq_cst);
+}
+
+inline unsigned CProbeTracer::GetEventCount() const {
+    unsigned count = m_eventCount.load(std::memory_order_acquire);
+    return count < MAX_EVENTS ? count : MAX_EVENTS;
+}
+
+inline const char * CProbeTracer::GetEventName(const Event & event) const {
+    return m_probes[event.probe].name.c_str();
+}
+
+inline unsigned CProbeTracer::GetEventArgCount(const Event & event) const {
+    return m_probes[event.probe].argCount;
+}
+
+inline bool CProbeTracer::WaitForEvent(const char * name, const void * lock, unsigned timeoutMs) const {
+    for (unsigned waited = 0; waited <= timeoutMs; waited++) {
+        unsigned count = GetEventCount();
+        for (unsigned i = 0; i < count; i++) {
+            const Event & event = m_events[i];
+            if (event.ready.load(std::memory_order_acquire)
+                && event.args[0] == (uint64_t)(uintptr_t)lock
+                && strcmp(GetEventName(event), name) == 0)
+                return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+#endif /* RWLOCK_HAVE_PROBES && __x86_64__ */
+
+
+#endif /* PROBETRACER_H */
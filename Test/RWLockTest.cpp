@@ -9,7 +9,9 @@
 #include "stdafx.h"
 #pragma hdrstop
 
+#if defined(_MSC_VER)
 #pragma comment(lib, "RWLock.lib")
+#endif
 
 using namespace std;
 
@@ -18,26 +20,48 @@ char ( &_ArraySizeHelper( T (&array)[N] ))[N];
 
 #define countof( array ) (sizeof( _ArraySizeHelper( array ) ))
 
-#define CACHE_LINE  64
-#define CACHE_ALIGN __declspec(align(CACHE_LINE))
-
 //===========================================================================
 // R/W lock abstract class
+//  Test threads run ThreadProc<Lock> instantiated for the concrete (final)
+//  lock class, so lock calls in the test loop are static and inline the
+//  same as in production code. Virtual calls are for setup only.
+//  Latency recording (--latency) is a separate instantiation, so runs
+//  without it don't pay for it.
 //===========================================================================
-struct __declspec(novtable) RWLock {
+template <class Lock, bool Latency>
+static DWORD WINAPI ThreadProc (LPVOID lpParameter);
+
+struct NOVTABLE RWLock {
 public:
     virtual void EnterRead() = 0;
     virtual void LeaveRead() = 0;
     virtual void EnterWrite() = 0;
     virtual void LeaveWrite() = 0;
 
-    virtual char* GetName() = 0;
+    // Optimistic (seqlock) read, see CRWLock::ReadBegin()
+    virtual bool IsOptimistic() { return false; }
+    virtual unsigned ReadBegin() { return 0; }
+    virtual bool ReadValidate(unsigned /* version */) { return true; }
+
+    virtual const char * GetName() = 0;
+
+    // Test thread procedure for this lock type
+    virtual LPTHREAD_START_ROUTINE GetThreadProc(bool latency) = 0;
+};
+
+template <class Derived>
+struct NOVTABLE RWLockImpl : RWLock {
+    LPTHREAD_START_ROUTINE GetThreadProc(bool latency)
+    {
+        return latency ? ThreadProc<Derived, true> : ThreadProc<Derived, false>;
+    }
 };
 
 //===========================================================================
 // Windows slim reader/writer (SRW) lock.
 //===========================================================================
-class CSRWLock : public RWLock {
+#if defined(_WIN32)
+class CSRWLock final : public RWLockImpl<CSRWLock> {
 public:
     CSRWLock()
     {
@@ -64,7 +88,7 @@ public:
         ReleaseSRWLockExclusive(&m_lock);
     }
 
-    char * GetName()
+    const char * GetName()
     {
         return "SRWLock";
     }
@@ -72,10 +96,95 @@ public:
 private:
     SRWLOCK m_lock;
 };
+#endif
+
+//===========================================================================
+// Standard library and POSIX reader/writer locks as baselines
+//===========================================================================
+#if defined(RWLOCKTEST_SHARED_MUTEX)
+class CSharedMutexTest final : public RWLockImpl<CSharedMutexTest> {
+public:
+    void EnterRead()
+    {
+        m_lock.lock_shared();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.unlock_shared();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.lock();
+    }
+
+    void LeaveWrite()
+    {
+        m_lock.unlock();
+    }
+
+    const char * GetName()
+    {
+        return "shared_mutex";
+    }
+
+private:
+    std::shared_mutex m_lock;
+};
+#endif
+
+#if !defined(_WIN32)
+class CPthreadRWLockTest final : public RWLockImpl<CPthreadRWLockTest> {
+public:
+    CPthreadRWLockTest()
+    {
+        pthread_rwlock_init(&m_lock, NULL);
+    }
+
+    ~CPthreadRWLockTest()
+    {
+        pthread_rwlock_destroy(&m_lock);
+    }
+
+    void EnterRead()
+    {
+        pthread_rwlock_rdlock(&m_lock);
+    }
+    
+    void LeaveRead()
+    {
+        pthread_rwlock_unlock(&m_lock);
+    }
+    
+    void EnterWrite()
+    {
+        pthread_rwlock_wrlock(&m_lock);
+    }
+
+    void LeaveWrite()
+    {
+        pthread_rwlock_unlock(&m_lock);
+    }
+
+    const char * GetName()
+    {
+        return "pthread_rwlock";
+    }
+
+private:
+    pthread_rwlock_t m_lock;
+};
+#endif
 
-class CAsymRWLockTest : public RWLock {
+class CAsymRWLockTest final : public RWLockImpl<CAsymRWLockTest> {
 public:
-    CAsymRWLockTest() { }
+    CAsymRWLockTest()
+    {
+#if defined(RWLOCK_STATS)
+        m_lock.GetStats().SetName("Asymmetric");
+#endif
+    }
 
     void EnterRead()
     {
@@ -97,7 +206,7 @@ public:
         m_lock.LeaveWrite();
     }
 
-    char * GetName()
+    const char * GetName()
     {
         return "Asymmetric";
     }
@@ -106,9 +215,100 @@ private:
     CRWLock m_lock;
 };
 
-class CPerProcRWLockTest : public RWLock {
+class CInlineAsymRWLockTest final : public RWLockImpl<CInlineAsymRWLockTest> {
+public:
+    CInlineAsymRWLockTest() { }
+
+    void EnterRead()
+    {
+        m_lock.EnterRead();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.LeaveRead();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.EnterWrite();
+    }
+
+    void LeaveWrite()
+    {
+        m_lock.LeaveWrite();
+    }
+
+    const char * GetName()
+    {
+        return "Asym-Inline";
+    }
+
+private:
+    TAsymRWLock<>   m_lock;
+};
+
+class COptimisticRWLockTest final : public RWLockImpl<COptimisticRWLockTest> {
+public:
+    COptimisticRWLockTest()
+    {
+#if defined(RWLOCK_STATS)
+        m_lock.GetStats().SetName("Optimistic");
+#endif
+    }
+
+    void EnterRead()
+    {
+        m_lock.EnterRead();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.LeaveRead();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.EnterWrite();
+    }
+
+    void LeaveWrite()
+    {
+        m_lock.LeaveWrite();
+    }
+
+    bool IsOptimistic()
+    {
+        return true;
+    }
+
+    unsigned ReadBegin()
+    {
+        return m_lock.ReadBegin();
+    }
+
+    bool ReadValidate(unsigned version)
+    {
+        return m_lock.ReadValidate(version);
+    }
+
+    const char * GetName()
+    {
+        return "Optimistic";
+    }
+
+private:
+    CRWLock m_lock;
+};
+
+class CPerProcRWLockTest final : public RWLockImpl<CPerProcRWLockTest> {
 public:
-    CPerProcRWLockTest() { }
+    CPerProcRWLockTest()
+    {
+#if defined(RWLOCK_STATS)
+        m_lock.GetStats().SetName("Per-Proc");
+#endif
+    }
 
     void EnterRead()
     {
@@ -130,7 +330,7 @@ public:
         m_lock.LeaveWrite();
     }
 
-    char * GetName()
+    const char * GetName()
     {
         return "Per-Proc";
     }
@@ -139,11 +339,114 @@ private:
     CRWLock2 m_lock;
 };
 
+template <class Lock>
+class CBravoRWLockTest final : public RWLockImpl<CBravoRWLockTest<Lock> > {
+public:
+    CBravoRWLockTest(const char * name) : m_name(name) { }
+
+    void EnterRead()
+    {
+        m_lock.EnterRead();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.LeaveRead();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.EnterWrite();
+    }
+    
+    void LeaveWrite()
+    {
+        m_lock.LeaveWrite();
+    }
+
+    const char * GetName()
+    {
+        return m_name;
+    }
+
+private:
+    TBravoRWLock<Lock>  m_lock;
+    const char *        m_name;
+};
+
+template <class Lock>
+class CPhaseFairRWLockTest final : public RWLockImpl<CPhaseFairRWLockTest<Lock> > {
+public:
+    CPhaseFairRWLockTest(const char * name) : m_name(name) { }
+
+    void EnterRead()
+    {
+        m_lock.EnterRead();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.LeaveRead();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.EnterWrite();
+    }
+    
+    void LeaveWrite()
+    {
+        m_lock.LeaveWrite();
+    }
+
+    const char * GetName()
+    {
+        return m_name;
+    }
+
+private:
+    Lock            m_lock;
+    const char *    m_name;
+};
+
+class CHybridRWLockTest final : public RWLockImpl<CHybridRWLockTest> {
+public:
+    CHybridRWLockTest() { }
+
+    void EnterRead()
+    {
+        m_lock.EnterRead();
+    }
+    
+    void LeaveRead()
+    {
+        m_lock.LeaveRead();
+    }
+    
+    void EnterWrite()
+    {
+        m_lock.EnterWrite();
+    }
+    
+    void LeaveWrite()
+    {
+        m_lock.LeaveWrite();
+    }
+
+    const char * GetName()
+    {
+        return "Hybrid";
+    }
+
+private:
+    CHybridRWLock m_lock;
+};
+
 //===========================================================================
 // Using Critical Section to use it as baseline performance and can compare
 // RWLock's worst case (100% writer) with simple critical section.
 //===========================================================================
-class CCritsectRwLock : public RWLock {
+class CCritsectRwLock final : public RWLockImpl<CCritsectRwLock> {
 public:
     void EnterRead()
     {
@@ -165,7 +468,7 @@ public:
         m_lock.Leave();
     }
 
-    char * GetName()
+    const char * GetName()
     {
         return "CritSect";
     }
@@ -178,24 +481,94 @@ private:
 //===========================================================================
 // Test Consts and Globals
 //===========================================================================
-const unsigned MAX_RWLOCKS = 12;
 const unsigned MAX_THREADS = 128;
-const unsigned TOTAL_TEST_TIME_MS = 5000;
+const unsigned TOTAL_TEST_TIME_MS = 5000;   // Default of --duration
+const unsigned DEFAULT_PROFILE_RATE = 1000; // Default of --profile-rate
 const unsigned TOTAL_TEST_ITEM = 10000;
 
 struct TestItem {
-    volatile CACHE_ALIGN unsigned data;
+    CACHE_ALIGN volatile unsigned data;
 };
 
 typedef list<TestItem *> TEST_LIST;
 
-struct TestCase {
-    char *      name;
-    float       readRate;    // Read ratio
-    RWLock *    rwLocks[MAX_RWLOCKS];
+//===========================================================================
+// Test matrix (command line options)
+//===========================================================================
+struct TestOptions {
+    vector<RWLock *>    locks;
+    vector<float>       readRates;      // Read ratio
+    vector<int>         workSizes;
+    vector<unsigned>    threadCounts;   // Empty: 1 .. g_totalThreads
+    bool                pin;            // Pin test thread i to processor i
+    bool                latency;        // Per-operation latency histograms
+    FILE *              csv;
+    FILE *              json;
+    unsigned            jsonRecords;
+    const char *        statsPath;      // Prometheus file (RWLOCK_STATS)
+    const char *        profilePath;    // Collapsed stacks (RWLOCK_PROFILE)
+    unsigned            profileRate;    // Sample 1 in profileRate acquisitions
+};
+
+// One row of the main test
+struct TestResult {
+    unsigned        testId;
+    const char *    lockName;
+    float           readRate;
+    unsigned        workSize;
+    unsigned        threadCount;
+    double          seconds;
+    double          readsPerSec;
+    double          writesPerSec;
+    double          cpuPerOp;       // Cycles (Windows) or ns (Linux)
+    ResourceUsage   usage;          // Whole process during the run
+    const struct LatencyStats * latency;    // All threads, NULL without --latency
+
+    // Fairness: ops/sec of each thread, Jain's index over them
+    // ((sum x)^2 / (n * sum x^2), 1 when all equal, 1/n when one thread
+    // does everything) and the longest EnterWrite() of any thread
+    vector<double>  threadOps;
+    double          jainIndex;
+    double          minThreadOps;
+    double          maxThreadOps;
+    double          maxWriteWaitUs;
+};
+
+//===========================================================================
+// Per thread latency histograms (--latency), in timestamp ticks
+//  Acquire is the Enter call, hold is from its return to the Leave call.
+//  For optimistic reads acquire is the time spent on failed attempts and
+//  hold is the attempt that validated.
+//===========================================================================
+struct LatencyStats {
+    CLatencyHistogram   readAcquire;
+    CLatencyHistogram   readHold;
+    CLatencyHistogram   writeAcquire;
+    CLatencyHistogram   writeHold;
+
+    void Clear()
+    {
+        readAcquire.Clear();
+        readHold.Clear();
+        writeAcquire.Clear();
+        writeHold.Clear();
+    }
 
+    void Add(const LatencyStats & other)
+    {
+        readAcquire.Add(other.readAcquire);
+        readHold.Add(other.readHold);
+        writeAcquire.Add(other.writeAcquire);
+        writeHold.Add(other.writeHold);
+    }
 };
 
+template <bool Latency>
+static inline uint64_t LatencyStamp()
+{
+    return Latency ? ReadTimestamp() : 0;
+}
+
 //===========================================================================
 // Per thread stat
 //===========================================================================
@@ -208,6 +581,8 @@ struct ThreadStat {
     ULONG64         cpuCycles;
     unsigned        iterRead;
     unsigned        iterWrite;
+    uint64_t        maxWriteWait;   // Timestamp ticks
+    LatencyStats *  latency;
 };
 
 struct ThreadStatAligned : ThreadStat {
@@ -226,128 +601,136 @@ HANDLE          g_runTestEvent;
 
 CACHE_ALIGN bool                    g_runTest = false;
 CACHE_ALIGN CAsymRWLockTest         g_asymRWLock;
+CACHE_ALIGN CInlineAsymRWLockTest   g_inlineAsymRWLock;
 CACHE_ALIGN CPerProcRWLockTest      g_perProcRWLock;
+CACHE_ALIGN CHybridRWLockTest       g_hybridRWLock;
+CACHE_ALIGN COptimisticRWLockTest   g_optimisticRWLock;
+CACHE_ALIGN CBravoRWLockTest<CCritSectRWLock>   g_bravoCritsectLock("BRAVO-CS");
+CACHE_ALIGN CBravoRWLockTest<CFutexRWLock>      g_bravoFutexLock("BRAVO-Futex");
+CACHE_ALIGN CPhaseFairRWLockTest<CPhaseFairSpinRWLock>  g_phaseFairSpinLock("PhaseFair-Spin");
+CACHE_ALIGN CPhaseFairRWLockTest<CPhaseFairRWLock>      g_phaseFairFutexLock("PhaseFair-Futex");
+#if defined(_WIN32)
 CACHE_ALIGN CSRWLock                g_slimRWLock;
+#else
+CACHE_ALIGN CPthreadRWLockTest      g_pthreadRWLock;
+#endif
+#if defined(RWLOCKTEST_SHARED_MUTEX)
+CACHE_ALIGN CSharedMutexTest        g_sharedMutexRWLock;
+#endif
 CACHE_ALIGN CCritsectRwLock         g_critsectRwLock;
 CACHE_ALIGN TEST_LIST               g_testList;
 CACHE_ALIGN TEST_LIST               g_freeList;
 
+// Flat copy of the test data (worksize words) for optimistic readers,
+// which can't walk g_testList while a writer may be changing it
+CACHE_ALIGN volatile unsigned       g_testRecord[TOTAL_TEST_ITEM];
+unsigned                            g_testRecordSize;
+
 CACHE_ALIGN HANDLE              g_threads[MAX_THREADS];
 CACHE_ALIGN ThreadStatAligned   g_threadStats[MAX_THREADS];
+LatencyStats *                  g_latencyStats;     // MAX_THREADS, with --latency
+LatencyStats                    g_latencyTotal;
+
+// All locks of the main test, in --locks order
+RWLock * g_allLocks[] = {
+    &g_asymRWLock, &g_inlineAsymRWLock, &g_perProcRWLock,
+#if defined(_WIN32)
+    &g_slimRWLock,
+#else
+    &g_pthreadRWLock,
+#endif
+#if defined(RWLOCKTEST_SHARED_MUTEX)
+    &g_sharedMutexRWLock,
+#endif
+    &g_critsectRwLock,
+    &g_hybridRWLock, &g_optimisticRWLock,
+    &g_bravoCritsectLock, &g_bravoFutexLock,
+    &g_phaseFairSpinLock, &g_phaseFairFutexLock,
+};
+
+// Default read ratios and dummy load sizes. Worksize 4 is a few words of
+// config or stats, where optimistic readers matter most.
+const float g_readRates[] = { 0.99f, 0.95f, 0.90f, 0.80f, 0.70f, 0.50f, 0.30f, 0.10f };
+const int   g_workSizes[] = { 4, 100, 200, 400, 800, 4000 };
+
+TestOptions g_options;
+unsigned    g_testTimeMs = TOTAL_TEST_TIME_MS;
+
+
+
+//===========================================================================
+// Timing functions
+//===========================================================================
+static __int64 GetPerfCounters() {
+    LARGE_INTEGER li;
+    QueryPerformanceCounter(&li);
+    return li.QuadPart;
+}
+
+static __int64 GetPerfFreq() {
+    LARGE_INTEGER li;
+    QueryPerformanceFrequency(&li);
+    return li.QuadPart;
+}
 
-TestCase g_testCases[] = {
+// Returns false on a torn read, which only optimistic readers may see
+static bool ReadRecord() {
+    unsigned seq = g_testRecord[0];
+    bool consistent = true;
+    for (unsigned i = 1; i < g_testRecordSize; i++)
     {
-        "R(99%)/W(1%)",
-        (float)0.99f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(95%)/W(5%)",
-        (float)0.95f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(90%)/W(10%)",
-        (float)0.99f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(80%)/W(20%)",
-        (float)0.80f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(70%)/W(30%)",
-        (float)0.70f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(50%)/W(50%)",
-        (float)0.50f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(30%)/W(70%)",
-        (float)0.30f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-    {
-        "R(10%)/W(90%)",
-        (float)0.10f,
-        {
-            &g_asymRWLock, &g_perProcRWLock,
-            &g_slimRWLock, &g_critsectRwLock,
-        }
-    },
-};
-
-
-
-//===========================================================================
-// Timing functions
-//===========================================================================
-static __int64 GetPerfCounters() {
-    LARGE_INTEGER li;
-    QueryPerformanceCounter(&li);
-    return li.QuadPart;
+        if (g_testRecord[i] != seq)
+            consistent = false;
+    }
+    return consistent;
 }
 
-static __int64 GetPerfFreq() {
-    LARGE_INTEGER li;
-    QueryPerformanceFrequency(&li);
-    return li.QuadPart;
+static void WriteRecord() {
+    for (unsigned i = 0; i < g_testRecordSize; i++)
+        g_testRecord[i]++;
 }
 
-static void ReadList() {
-    volatile unsigned seq = g_testList.front()->data;
-    TEST_LIST::iterator it;
-    for (it = g_testList.begin() ; it != g_testList.end(); it++)
+static void ReadList(const TEST_LIST & testList) {
+    volatile unsigned seq = testList.front()->data;
+    TEST_LIST::const_iterator it;
+    for (it = testList.begin() ; it != testList.end(); it++)
     {
         if ((*it)->data != seq)
             _ASSERT(false);
     }
 }
 
-static void WriteList() {
+static void ReadList() {
+    ReadList(g_testList);
+}
+
+static void WriteList(TEST_LIST & testList, TEST_LIST & freeList) {
     TestItem * item;
     unsigned data;
-    item = g_testList.front();
+    item = testList.front();
     data = item->data;
 
-    g_testList.pop_front();
-    g_freeList.push_back(item);
+    testList.pop_front();
+    freeList.push_back(item);
     item->data = (unsigned)-1;
 
-    item = g_freeList.front();
-    g_freeList.pop_front();
-    g_testList.push_back(item);
+    item = freeList.front();
+    freeList.pop_front();
+    testList.push_back(item);
     item->data = data;
 }
 
+static void WriteList() {
+    WriteList(g_testList, g_freeList);
+    WriteRecord();
+}
+
+template <class Lock, bool Latency>
 static DWORD WINAPI ThreadProc (LPVOID lpParameter)
 {
     ThreadStat * threadStat = (ThreadStat *) lpParameter;
+    Lock * rwLock = static_cast<Lock *>(threadStat->rwLock);
+    LatencyStats * latency = threadStat->latency;
 
     AtomicIncrement(&g_readyWaitThreads);
     WaitForSingleObject(g_runTestEvent, INFINITE);
@@ -364,23 +747,66 @@ static DWORD WINAPI ThreadProc (LPVOID lpParameter)
 
     while (g_runTest)
     {
-        if (rnd < readRate || readRate == 1.0f)
+        if ((rnd < readRate || readRate == 1.0f) && rwLock->IsOptimistic())
+        {
+            unsigned version;
+            bool consistent;
+            uint64_t start = LatencyStamp<Latency>();
+            uint64_t attempt;
+            do
+            {
+                attempt = LatencyStamp<Latency>();
+                version = rwLock->ReadBegin();
+                consistent = ReadRecord();
+            } while (!rwLock->ReadValidate(version));
+            _ASSERT(consistent);
+
+            if (Latency)
+            {
+                uint64_t end = LatencyStamp<Latency>();
+                latency->readAcquire.Record(attempt - start);
+                latency->readHold.Record(end - attempt);
+            }
+
+            rnd    = (float)ranObject.Random();
+            threadStat->iterRead++;
+        }
+        else if (rnd < readRate || readRate == 1.0f)
         {
-            threadStat->rwLock->EnterRead();
+            uint64_t start = LatencyStamp<Latency>();
+            rwLock->EnterRead();
+            uint64_t acquired = LatencyStamp<Latency>();
             rnd    = (float)ranObject.Random();
             ReadList();
             threadStat->iterRead++;
-            threadStat->rwLock->LeaveRead();
+            if (Latency)
+            {
+                uint64_t end = LatencyStamp<Latency>();
+                latency->readAcquire.Record(acquired - start);
+                latency->readHold.Record(end - acquired);
+            }
+            rwLock->LeaveRead();
 
         }
         else
         {
-            threadStat->rwLock->EnterWrite();
+            // Writer wait is always timed, for the starvation report
+            uint64_t start = ReadTimestamp();
+            rwLock->EnterWrite();
+            uint64_t acquired = ReadTimestamp();
             rnd    = (float)ranObject.Random();
             ReadList();
             WriteList();
             threadStat->iterWrite++;
-            threadStat->rwLock->LeaveWrite();
+            if (acquired - start > threadStat->maxWriteWait)
+                threadStat->maxWriteWait = acquired - start;
+            if (Latency)
+            {
+                uint64_t end = LatencyStamp<Latency>();
+                latency->writeAcquire.Record(acquired - start);
+                latency->writeHold.Record(end - acquired);
+            }
+            rwLock->LeaveWrite();
         }
 
     }
@@ -398,7 +824,7 @@ void InitTest()
 {
     // Init test data. Add all test items to free list.
     TestItem * item;
-    for (int i = 0; i < TOTAL_TEST_ITEM; i++)
+    for (unsigned i = 0; i < TOTAL_TEST_ITEM; i++)
     {
         item = (TestItem *)_aligned_malloc(sizeof(TestItem), CACHE_LINE);
         g_freeList.push_back(item);
@@ -412,6 +838,10 @@ void InitTest()
     g_numProcessors = info.dwNumberOfProcessors;
     g_totalThreads  = info.dwNumberOfProcessors * 2;
     printf("Number of Processors: %d\n", info.dwNumberOfProcessors);
+
+    printf("Timestamp frequency: %.0f MHz\n", GetTimestampFreq() / 1e6);
+    if (g_options.latency)
+        g_latencyStats = new LatencyStats[MAX_THREADS];
 }
 
 void InitThreads(RWLock * rwLock, float readRate, int threadCount)
@@ -422,12 +852,17 @@ void InitThreads(RWLock * rwLock, float readRate, int threadCount)
         g_threadStats[i].threadIdx = i;
         g_threadStats[i].rwLock = rwLock;
         g_threadStats[i].readRate = readRate;
+        if (g_latencyStats)
+        {
+            g_latencyStats[i].Clear();
+            g_threadStats[i].latency = &g_latencyStats[i];
+        }
 
         DWORD threadId;
         g_threads[i] = (HANDLE) CreateThread(
             (LPSECURITY_ATTRIBUTES) 0,
             0,    // stack size
-            ThreadProc,
+            rwLock->GetThreadProc(g_latencyStats != NULL),
             (LPVOID)&g_threadStats[i],    // argument
             0,
             &threadId
@@ -435,9 +870,193 @@ void InitThreads(RWLock * rwLock, float readRate, int threadCount)
 
         // Set test thread priority higher
         SetThreadPriority(g_threads[i], THREAD_PRIORITY_ABOVE_NORMAL);
+
+        if (g_options.pin)
+            PinThread(g_threads[i], (unsigned)i % g_numProcessors);
     }
 }
 
+//===========================================================================
+// Result output: table on stdout, optionally CSV and JSON files
+//===========================================================================
+struct LatencyKind {
+    const char *                        title;
+    const char *                        name;
+    CLatencyHistogram LatencyStats::*   histogram;
+};
+
+const LatencyKind g_latencyKinds[] = {
+    { "Read acquire",   "read_acquire",     &LatencyStats::readAcquire },
+    { "Read hold",      "read_hold",        &LatencyStats::readHold },
+    { "Write acquire",  "write_acquire",    &LatencyStats::writeAcquire },
+    { "Write hold",     "write_hold",       &LatencyStats::writeHold },
+};
+
+// Percentiles reported besides the max, and their column suffixes
+const double        g_latencyPercents[] = { 50.0, 90.0, 99.0, 99.9 };
+const char * const  g_latencyPercentNames[] = { "p50", "p90", "p99", "p999" };
+
+static double LatencyNs(uint64_t ticks)
+{
+    return (double)ticks * 1e9 / GetTimestampFreq();
+}
+
+static void WriteCsvHeader(FILE * file)
+{
+    fprintf(
+        file,
+        "test,lock,read_rate,worksize,threads,seconds,reads_per_sec,writes_per_sec,"
+        "total_per_sec,cpu_per_op,user_sec,system_sec,voluntary_switches,involuntary_switches,"
+        "jain_index,thread_ops_min,thread_ops_max,max_write_wait_us"
+    );
+    if (g_options.latency)
+    {
+        for (unsigned k = 0; k < countof(g_latencyKinds); k++)
+        {
+            const char * name = g_latencyKinds[k].name;
+            fprintf(file, ",%s_count", name);
+            for (unsigned p = 0; p < countof(g_latencyPercents); p++)
+                fprintf(file, ",%s_%s_ns", name, g_latencyPercentNames[p]);
+            fprintf(file, ",%s_max_ns", name);
+        }
+    }
+    fprintf(file, "\n");
+}
+
+static void WriteCsv(FILE * file, const TestResult & result)
+{
+    fprintf(
+        file,
+        "%u,%s,%.4f,%u,%u,%.3f,%.1f,%.1f,%.1f,%.1f,%.3f,%.3f,%llu,%llu,%.4f,%.1f,%.1f,%.1f",
+        result.testId,
+        result.lockName,
+        result.readRate,
+        result.workSize,
+        result.threadCount,
+        result.seconds,
+        result.readsPerSec,
+        result.writesPerSec,
+        result.readsPerSec + result.writesPerSec,
+        result.cpuPerOp,
+        result.usage.userSeconds,
+        result.usage.systemSeconds,
+        (unsigned long long)result.usage.voluntarySwitches,
+        (unsigned long long)result.usage.involuntarySwitches,
+        result.jainIndex,
+        result.minThreadOps,
+        result.maxThreadOps,
+        result.maxWriteWaitUs
+    );
+    if (result.latency)
+    {
+        for (unsigned k = 0; k < countof(g_latencyKinds); k++)
+        {
+            const CLatencyHistogram & histogram = result.latency->*g_latencyKinds[k].histogram;
+            fprintf(file, ",%llu", (unsigned long long)histogram.GetCount());
+            for (unsigned p = 0; p < countof(g_latencyPercents); p++)
+                fprintf(file, ",%.0f", LatencyNs(histogram.GetPercentile(g_latencyPercents[p])));
+            fprintf(file, ",%.0f", LatencyNs(histogram.GetMax()));
+        }
+    }
+    fprintf(file, "\n");
+    fflush(file);
+}
+
+static void WriteJson(FILE * file, unsigned index, const TestResult & result)
+{
+    fprintf(
+        file,
+        "%s\n  {\"test\": %u, \"lock\": \"%s\", \"read_rate\": %.4f, \"worksize\": %u, "
+        "\"threads\": %u, \"seconds\": %.3f, \"reads_per_sec\": %.1f, \"writes_per_sec\": %.1f, "
+        "\"total_per_sec\": %.1f, \"cpu_per_op\": %.1f, \"user_sec\": %.3f, \"system_sec\": %.3f, "
+        "\"voluntary_switches\": %llu, \"involuntary_switches\": %llu, "
+        "\"jain_index\": %.4f, \"max_write_wait_us\": %.1f, \"thread_ops_per_sec\": [",
+        index ? "," : "",
+        result.testId,
+        result.lockName,
+        result.readRate,
+        result.workSize,
+        result.threadCount,
+        result.seconds,
+        result.readsPerSec,
+        result.writesPerSec,
+        result.readsPerSec + result.writesPerSec,
+        result.cpuPerOp,
+        result.usage.userSeconds,
+        result.usage.systemSeconds,
+        (unsigned long long)result.usage.voluntarySwitches,
+        (unsigned long long)result.usage.involuntarySwitches,
+        result.jainIndex,
+        result.maxWriteWaitUs
+    );
+    for (unsigned i = 0; i < result.threadOps.size(); i++)
+        fprintf(file, "%s%.1f", i ? ", " : "", result.threadOps[i]);
+    fprintf(file, "]");
+    if (result.latency)
+    {
+        fprintf(file, ", \"latency_ns\": {");
+        for (unsigned k = 0; k < countof(g_latencyKinds); k++)
+        {
+            const CLatencyHistogram & histogram = result.latency->*g_latencyKinds[k].histogram;
+            fprintf(
+                file,
+                "%s\"%s\": {\"count\": %llu",
+                k ? ", " : "",
+                g_latencyKinds[k].name,
+                (unsigned long long)histogram.GetCount()
+            );
+            for (unsigned p = 0; p < countof(g_latencyPercents); p++)
+                fprintf(file, ", \"%s\": %.0f", g_latencyPercentNames[p], LatencyNs(histogram.GetPercentile(g_latencyPercents[p])));
+            fprintf(file, ", \"max\": %.0f}", LatencyNs(histogram.GetMax()));
+        }
+        fprintf(file, "}");
+    }
+    fprintf(file, "}");
+    fflush(file);
+}
+
+static void WriteLatency(const LatencyStats & latency)
+{
+    printf("       Latency ns            Count");
+    for (unsigned p = 0; p < countof(g_latencyPercents); p++)
+        printf(" %9s", g_latencyPercentNames[p]);
+    printf(" %9s\n", "max");
+
+    for (unsigned k = 0; k < countof(g_latencyKinds); k++)
+    {
+        const CLatencyHistogram & histogram = latency.*g_latencyKinds[k].histogram;
+        printf("       %-15s %11llu", g_latencyKinds[k].title, (unsigned long long)histogram.GetCount());
+        for (unsigned p = 0; p < countof(g_latencyPercents); p++)
+            printf(" %9.0f", LatencyNs(histogram.GetPercentile(g_latencyPercents[p])));
+        printf(" %9.0f\n", LatencyNs(histogram.GetMax()));
+    }
+}
+
+static void WriteResult(const TestResult & result)
+{
+    printf(
+        "%3d, %5d, %14s,  %2d, %10.1f, %10.1f, %10.1f, %8.1f, %6.3f, %7.3f, %10.1f\n",
+        result.testId,
+        result.workSize,
+        result.lockName,
+        result.threadCount,
+        (float)result.readsPerSec,
+        (float)result.writesPerSec,
+        (float)(result.readsPerSec + result.writesPerSec),
+        (float)result.cpuPerOp,
+        result.jainIndex,
+        result.maxThreadOps > 0 ? result.minThreadOps / result.maxThreadOps : 0.0,
+        result.maxWriteWaitUs
+    );
+    if (result.latency)
+        WriteLatency(*result.latency);
+
+    if (g_options.csv)
+        WriteCsv(g_options.csv, result);
+    if (g_options.json)
+        WriteJson(g_options.json, g_options.jsonRecords++, result);
+}
+
 void RunOneTest(
     unsigned    testId,
     RWLock *    rwLock,
@@ -445,6 +1064,9 @@ void RunOneTest(
     unsigned    workSize,
     unsigned    threadCount)
 {
+    ResourceUsage startUsage;
+    GetResourceUsage(&startUsage);
+
     // Create test threads
     InitThreads(rwLock, readRate, threadCount);
 
@@ -452,15 +1074,17 @@ void RunOneTest(
     while ((unsigned)g_readyWaitThreads < threadCount)
         Sleep(100);
 
-    SetEvent(g_runTestEvent);
-
     ////////////////
     // Start test //
     ////////////////
+    // Raise the flag before waking threads, or a thread scheduled ahead
+    // of this one sees it clear and exits without running
     g_runTest = true;
     MemoryBarrier();
 
-    Sleep(TOTAL_TEST_TIME_MS);
+    SetEvent(g_runTestEvent);
+
+    Sleep(g_testTimeMs);
 
     // Cause all threads exit
     g_runTest = false;
@@ -469,21 +1093,41 @@ void RunOneTest(
     // Wait all thread exit
     WaitForMultipleObjects(threadCount, g_threads, true, INFINITE);
     ResetEvent(g_runTestEvent);
+    for (unsigned i = 0; i < threadCount; i++)
+        CloseHandle(g_threads[i]);
     //////////////
     // End test //
     //////////////
 
-
+    ResourceUsage endUsage;
+    GetResourceUsage(&endUsage);
 
     // Collects test result stored in per-thread data
     __int64 procCounter = 0;
     __int64 totalReads  = 0;
     __int64 totalWrties = 0;
     ULONG64    totalCpuCycles = 0;
+    uint64_t   maxWriteWait = 0;
+    TestResult result;
+    g_latencyTotal.Clear();
     for (unsigned i = 0; i < threadCount; i++) {
         ThreadStatAligned *threadStat = &g_threadStats[i];
+
+        // A thread that never started counts as starved
+        double threadOps = 0;
+        if (threadStat->startTime && threadStat->endTime > threadStat->startTime)
+        {
+            threadOps = (double)(threadStat->iterRead + threadStat->iterWrite) * GetPerfFreq()
+                / (double)(threadStat->endTime - threadStat->startTime);
+        }
+        result.threadOps.push_back(threadOps);
+
         if (threadStat->startTime)
         {
+            if (threadStat->latency)
+                g_latencyTotal.Add(*threadStat->latency);
+            if (threadStat->maxWriteWait > maxWriteWait)
+                maxWriteWait = threadStat->maxWriteWait;
             procCounter += threadStat->endTime - threadStat->startTime;
             totalCpuCycles += threadStat->cpuCycles;
             totalReads  += threadStat->iterRead;
@@ -495,25 +1139,77 @@ void RunOneTest(
             threadStat->cpuCycles = 0;
             threadStat->iterRead  = 0;
             threadStat->iterWrite = 0;
+            threadStat->maxWriteWait = 0;
         }
     }
 
-    // Average total perf counter for a thread
-    float freq = (float) procCounter / (float) threadCount;
-    // Frequency per second
-    freq = freq / (float)GetPerfFreq();
+    // Average run time of a thread in seconds
+    double seconds = (double)procCounter / threadCount / GetPerfFreq();
+
+    result.testId       = testId;
+    result.lockName     = rwLock->GetName();
+    result.readRate     = readRate;
+    result.workSize     = workSize;
+    result.threadCount  = threadCount;
+    result.seconds      = seconds;
+    // Keep rates finite (JSON has no inf/nan) if no thread got to run
+    __int64 totalOps = totalReads + totalWrties;
+    result.readsPerSec  = seconds > 0 ? totalReads / seconds : 0;
+    result.writesPerSec = seconds > 0 ? totalWrties / seconds : 0;
+    result.cpuPerOp     = totalOps ? (double)totalCpuCycles / totalOps : 0;
+    result.usage.userSeconds         = endUsage.userSeconds - startUsage.userSeconds;
+    result.usage.systemSeconds       = endUsage.systemSeconds - startUsage.systemSeconds;
+    result.usage.voluntarySwitches   = endUsage.voluntarySwitches - startUsage.voluntarySwitches;
+    result.usage.involuntarySwitches = endUsage.involuntarySwitches - startUsage.involuntarySwitches;
+    result.latency      = g_latencyStats ? &g_latencyTotal : NULL;
+
+    double sum = 0;
+    double sumSquares = 0;
+    result.minThreadOps = result.threadOps[0];
+    result.maxThreadOps = result.threadOps[0];
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        double ops = result.threadOps[i];
+        sum        += ops;
+        sumSquares += ops * ops;
+        result.minThreadOps = min(result.minThreadOps, ops);
+        result.maxThreadOps = max(result.maxThreadOps, ops);
+    }
+    result.jainIndex      = sumSquares > 0 ? sum * sum / (threadCount * sumSquares) : 0;
+    result.maxWriteWaitUs = (double)maxWriteWait * 1e6 / GetTimestampFreq();
+    WriteResult(result);
+
+#if defined(RWLOCK_STATS)
+    if (g_options.statsPath && !WriteLockStatsPrometheus(g_options.statsPath))
+        fprintf(stderr, "Can't write %s\n", g_options.statsPath);
+#endif
+}
 
-    printf(
-        "%3d, %5d, %12s,  %2d, %10.1f, %10.1f, %10.1f, %8.1f\n",
-        testId,
-        workSize,
-        rwLock->GetName(),
-        threadCount,
-        (float)totalReads  / freq,
-        (float)totalWrties / freq,
-        (float)(totalReads + totalWrties) / freq,
-        (float)((double)totalCpuCycles / (totalReads + totalWrties))
-    );
+static void ResetTestList(int worksize)
+{
+    TestItem * item;
+
+    // Move all to free list
+    while (!g_testList.empty())
+    {
+        item = g_testList.front();
+        g_testList.pop_front();
+        g_freeList.push_back(item);
+    }
+
+    // Add worksize items (dummy load)
+    for (int i = 0; i < worksize; i++)
+    {
+        item = g_freeList.front();
+        g_freeList.pop_front();
+
+        item->data = worksize;
+        g_testList.push_back(item);
+    }
+
+    for (int i = 0; i < worksize; i++)
+        g_testRecord[i] = worksize;
+    g_testRecordSize = worksize;
 }
 
 static void RunTests()
@@ -525,45 +1221,35 @@ static void RunTests()
     int testId = 0;
 
     // For differnt dummy load sizes
-    for (int worksize = 100; worksize <= 1000; worksize *= 2)
+    for (unsigned w = 0; w < g_options.workSizes.size(); w++)
     {
-        TestItem * item;
-
-        // Move all to free list
-        while (!g_testList.empty())
-        {
-            item = g_testList.front();
-            g_testList.pop_front();
-            g_freeList.push_back(item);
-        }
-
-        // Add worksize items (dummy load)
-        for (int i = 0; i < worksize; i++)
-        {
-            item = g_freeList.front();
-            g_freeList.pop_front();
-
-            item->data = worksize;
-            g_testList.push_back(item);
-        }
+        int worksize = g_options.workSizes[w];
+        ResetTestList(worksize);
 
-        // For each test to run
-        for (int i = 0; i < countof(g_testCases); i++)
+        // For each read ratio to run
+        for (unsigned r = 0; r < g_options.readRates.size(); r++)
         {
-            printf("=== %s ===\n", g_testCases[i].name);
-                    //"%3d, %5d, %12s  %2d, %10.1f, %10.1f, %10.1f, %I64d\n",
-            printf("      Work    Name     Threads  Reads/sec  Writes/sec   Total/sec   CPU/Op\n");
+            float readRate = g_options.readRates[r];
+            printf("=== R(%.4g%%)/W(%.4g%%) ===\n", readRate * 100.0f, (1.0f - readRate) * 100.0f);
+            printf("      Work      Name       Threads  Reads/sec  Writes/sec   Total/sec   CPU/Op    Jain  Min/Max  WrWait(us)\n");
 
             // Run this test for each desired thread count
-            for (int threadCount = 1; threadCount <= g_totalThreads; threadCount++)
+            unsigned threadRuns = g_options.threadCounts.empty()
+                ? (unsigned)g_totalThreads
+                : (unsigned)g_options.threadCounts.size();
+            for (unsigned t = 0; t < threadRuns; t++)
             {
-                for (RWLock ** rwLock = g_testCases[i].rwLocks; *rwLock != NULL; rwLock++)
+                unsigned threadCount = g_options.threadCounts.empty()
+                    ? t + 1
+                    : g_options.threadCounts[t];
+
+                for (unsigned l = 0; l < g_options.locks.size(); l++)
                 {
                     testId++;
                     RunOneTest(
                         testId,
-                        *rwLock,
-                        g_testCases[i].readRate,
+                        g_options.locks[l],
+                        readRate,
                         worksize,
                         threadCount
                     );
@@ -580,27 +1266,2023 @@ static void RunTests()
     printf ("Done.  Duration: %10.4f\n", totalRunTime);
 }
 
-void Cleanup()
+//===========================================================================
+// Reader slot benchmark
+//  Cost of CRWLock::EnterRead/LeaveRead while other threads hold reader
+//  slots (inline and overflow slots) and after thread churn recycled them.
+//===========================================================================
+const unsigned SLOT_BENCH_ITERATIONS    = 10000000;
+const unsigned SLOT_BENCH_CHURN_THREADS = 2000;
+const unsigned SLOT_BENCH_MAX_HOLDERS   = 512;
+
+CACHE_ALIGN CRWLock     g_slotBenchLock;
+volatile long           g_slotHolders;
+HANDLE                  g_slotHolderThreads[SLOT_BENCH_MAX_HOLDERS];
+
+static DWORD WINAPI SlotHolderProc (LPVOID)
 {
-    TestItem * item;
-    while (!g_testList.empty())
+    // Take a reader slot and keep it until the test ends
+    g_slotBenchLock.EnterRead();
+    g_slotBenchLock.LeaveRead();
+
+    AtomicIncrement(&g_slotHolders);
+    WaitForSingleObject(g_runTestEvent, INFINITE);
+    return 0;
+}
+
+static DWORD WINAPI SlotChurnProc (LPVOID)
+{
+    g_slotBenchLock.EnterRead();
+    g_slotBenchLock.LeaveRead();
+    g_slotBenchLock.EnterWrite();
+    g_slotBenchLock.LeaveWrite();
+    return 0;
+}
+
+static DWORD WINAPI ReadFastPathProc (LPVOID lpParameter)
+{
+    float * nsPerRead = (float *)lpParameter;
+
+    // First call assigns reader slot
+    g_slotBenchLock.EnterRead();
+    g_slotBenchLock.LeaveRead();
+
+    __int64 start = GetPerfCounters();
+    for (unsigned i = 0; i < SLOT_BENCH_ITERATIONS; i++)
     {
-        item = g_testList.front();
-        free(item);
+        g_slotBenchLock.EnterRead();
+        g_slotBenchLock.LeaveRead();
     }
+    __int64 end = GetPerfCounters();
 
-    while (!g_freeList.empty())
+    *nsPerRead = (float)((double)(end - start) * 1e9 / GetPerfFreq() / SLOT_BENCH_ITERATIONS);
+    return 0;
+}
+
+static float MeasureReadFastPath()
+{
+    float nsPerRead = 0;
+    HANDLE thread = CreateThread(NULL, 0, ReadFastPathProc, &nsPerRead, 0, NULL);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    return nsPerRead;
+}
+
+static void StartSlotHolders(unsigned holders)
+{
+    g_slotHolders = 0;
+    for (unsigned i = 0; i < holders; i++)
+        g_slotHolderThreads[i] = CreateThread(NULL, 0, SlotHolderProc, NULL, 0, NULL);
+    while ((unsigned)g_slotHolders < holders)
+        Sleep(10);
+}
+
+static void StopSlotHolders(unsigned holders)
+{
+    SetEvent(g_runTestEvent);
+    for (unsigned i = 0; i < holders; i++)
     {
-        item = g_freeList.front();
-        free(item);
+        WaitForSingleObject(g_slotHolderThreads[i], INFINITE);
+        CloseHandle(g_slotHolderThreads[i]);
     }
+    ResetEvent(g_runTestEvent);
 }
 
-int main(int argc, char * argv[])
+static void RunSlotBench()
 {
-    InitTest();
-    RunTests();
-    Cleanup();
+    printf("=== Reader slots ===\n");
+    printf("  Live threads    ns/Read\n");
+
+    for (unsigned holders = 0; holders <= SLOT_BENCH_MAX_HOLDERS; holders = holders ? holders * 4 : 2)
+    {
+        StartSlotHolders(holders);
+
+        // Measuring thread gets slot right after holders. Beyond
+        // RWLOCK_INLINE_READER_COUNT it runs on an overflow slot.
+        printf("  %12u %10.2f\n", holders + 1, MeasureReadFastPath());
+
+        StopSlotHolders(holders);
+    }
+
+    // Short lived threads. Would run out of slots without recycling.
+    for (unsigned i = 0; i < SLOT_BENCH_CHURN_THREADS; i++)
+    {
+        HANDLE thread = CreateThread(NULL, 0, SlotChurnProc, NULL, 0, NULL);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+    printf("  After %u threads exited: %10.2f\n", SLOT_BENCH_CHURN_THREADS, MeasureReadFastPath());
+}
+
+//===========================================================================
+// Writer drain benchmark
+//  Latency of an uncontended CRWLock::EnterWrite/LeaveWrite pair against
+//  number of threads that registered a reader slot. Includes the process
+//  wide barrier, so compare it with the 1 thread row. Next to it, the
+//  reader flag scan alone over the same high water, for each scan
+//  implementation ("-" if not available), as the barrier hides it.
+//===========================================================================
+const unsigned DRAIN_BENCH_ITERATIONS      = 100000;
+const unsigned DRAIN_BENCH_SCAN_ITERATIONS = 1000000;
+
+static const char * const s_scanNames[] = { "Scalar", "SSE2", "AVX2" };
+
+// All clear, so every scan goes to the end like a drain without readers
+CACHE_ALIGN std::atomic<uint8_t>    g_drainScanFlags[MAX_RWLOCK_READER_COUNT];
+volatile unsigned                   g_drainScanSink;
+
+static float MeasureReaderScan(FindBusyRWLockReaderFn scan, unsigned count)
+{
+    unsigned sink = 0;
+    __int64 start = GetPerfCounters();
+    for (unsigned i = 0; i < DRAIN_BENCH_SCAN_ITERATIONS; i++)
+        sink += scan(g_drainScanFlags, count);
+    __int64 end = GetPerfCounters();
+
+    g_drainScanSink = sink;
+    return (float)((double)(end - start) * 1e9 / GetPerfFreq() / DRAIN_BENCH_SCAN_ITERATIONS);
+}
+
+static void RunDrainBench()
+{
+    printf("=== Writer drain ===\n");
+    printf("  Registered threads    ns/Write  High water   Scan ns:");
+    for (unsigned s = 0; s < countof(s_scanNames); s++)
+        printf(" %7s", s_scanNames[s]);
+    printf("\n");
+
+    for (unsigned holders = 0; holders <= SLOT_BENCH_MAX_HOLDERS; holders = holders ? holders * 2 : 1)
+    {
+        StartSlotHolders(holders);
+
+        __int64 start = GetPerfCounters();
+        for (unsigned i = 0; i < DRAIN_BENCH_ITERATIONS; i++)
+        {
+            g_slotBenchLock.EnterWrite();
+            g_slotBenchLock.LeaveWrite();
+        }
+        __int64 end = GetPerfCounters();
+
+        unsigned highWater = GetRWLockThreadHighWater();
+        printf(
+            "  %18u %11.1f %11u %9s",
+            holders + 1,
+            (float)((double)(end - start) * 1e9 / GetPerfFreq() / DRAIN_BENCH_ITERATIONS),
+            highWater,
+            ""
+        );
+        for (unsigned s = 0; s < countof(s_scanNames); s++)
+        {
+            FindBusyRWLockReaderFn scan = GetFindBusyRWLockReader(s_scanNames[s]);
+            if (scan != NULL)
+                printf(" %7.1f", MeasureReaderScan(scan, highWater));
+            else
+                printf(" %7s", "-");
+        }
+        printf("\n");
+
+        StopSlotHolders(holders);
+    }
+}
+
+//===========================================================================
+// Benchmark fixture
+//  The benchmarks below run g_totalThreads threads calling one iteration
+//  body until stopped. A benchmark supplies its per thread stat (derived
+//  from BenchStat) and the body, and reports from the stats afterwards.
+//===========================================================================
+struct BenchStat {
+    int             threadIdx;
+    float           readRate;
+    unsigned        reads;
+    unsigned        writes;
+};
+
+template <class Stat>
+struct BenchStatAligned : Stat {
+    // Padded data for cache line align
+    uint8_t    pad[
+        CACHELINE_SIZE - (sizeof(Stat) % CACHELINE_SIZE)
+    ];
+};
+
+struct BenchTotal {
+    unsigned        reads;
+    unsigned        writes;
+    double          seconds;
+};
+
+CACHE_ALIGN const void *    g_benchBody;
+CACHE_ALIGN __int64         g_benchStart;
+
+template <class Stat>
+static BenchStatAligned<Stat> * GetBenchStats()
+{
+    CACHE_ALIGN static BenchStatAligned<Stat> s_stats[MAX_THREADS];
+    return s_stats;
+}
+
+template <class Stat, class Body>
+static DWORD WINAPI BenchProc (LPVOID lpParameter)
+{
+    Stat * stat = (Stat *) lpParameter;
+    const Body & body = *(const Body *) g_benchBody;
+    CRandomMersenne ranObject(stat->threadIdx);
+
+    AtomicIncrement(&g_readyWaitThreads);
+    while (g_runTest)
+        body(*stat, ranObject);
     return 0;
 }
 
+// Body is called as body(Stat &, CRandomMersenne &). Returns once every
+// thread runs it.
+template <class Stat, class Body>
+static BenchStatAligned<Stat> * StartBench(float readRate, const Body & body)
+{
+    BenchStatAligned<Stat> * stats = GetBenchStats<Stat>();
+    unsigned threadCount = (unsigned)g_totalThreads;
+
+    ZeroMemory(stats, sizeof(BenchStatAligned<Stat>) * MAX_THREADS);
+    g_benchBody = &body;
+    g_readyWaitThreads = 0;
+    g_runTest = true;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        stats[i].threadIdx = i;
+        stats[i].readRate = readRate;
+        g_threads[i] = CreateThread(NULL, 0, BenchProc<Stat, Body>, &stats[i], 0, NULL);
+    }
+    while ((unsigned)g_readyWaitThreads < threadCount)
+        Sleep(10);
+
+    g_benchStart = GetPerfCounters();
+    return stats;
+}
+
+template <class Stat>
+static BenchTotal StopBench(const BenchStatAligned<Stat> * stats)
+{
+    unsigned threadCount = (unsigned)g_totalThreads;
+    BenchTotal total = { 0, 0, 0.0 };
+
+    g_runTest = false;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        WaitForSingleObject(g_threads[i], INFINITE);
+        CloseHandle(g_threads[i]);
+
+        total.reads += stats[i].reads;
+        total.writes += stats[i].writes;
+    }
+    total.seconds = (double)(GetPerfCounters() - g_benchStart) / GetPerfFreq();
+    return total;
+}
+
+// Runs body for g_testTimeMs. GetBenchStats<Stat>() has the per thread
+// stats until the next run.
+template <class Stat, class Body>
+static BenchTotal RunBench(float readRate, const Body & body)
+{
+    BenchStatAligned<Stat> * stats = StartBench<Stat>(readRate, body);
+    Sleep(g_testTimeMs);
+    return StopBench(stats);
+}
+
+static int WritePercent(float readRate)
+{
+    return (int)((1.0f - readRate) * 100.0f + 0.5f);
+}
+
+//===========================================================================
+// Writer wait policy benchmark
+//  Oversubscribed readers (2 per processor) keep the lock busy while one
+//  writer takes it over and over. Reports writer CPU cycles per acquisition
+//  for the original yield loop and for the adaptive spin/yield/park policy.
+//===========================================================================
+const int WAIT_BENCH_WORKSIZE = 100;
+
+CACHE_ALIGN CRWLock g_yieldWaitLock(RWLOCK_WAIT_YIELD);
+CACHE_ALIGN CRWLock g_adaptiveWaitLock(RWLOCK_WAIT_ADAPTIVE);
+
+static void RunWaitBenchOne(const char * name, CRWLock * lock)
+{
+    auto body = [lock](BenchStat &, CRandomMersenne &)
+    {
+        lock->EnterRead();
+        ReadList();
+        lock->LeaveRead();
+    };
+    BenchStatAligned<BenchStat> * stats = StartBench<BenchStat>(1.0f, body);
+
+    unsigned writes = 0;
+    ULONG64 startCycles, endCycles;
+    __int64 start = GetPerfCounters();
+    __int64 end = start + GetPerfFreq() * g_testTimeMs / 1000;
+
+    QueryThreadCycleTime(GetCurrentThread(), &startCycles);
+    do
+    {
+        lock->EnterWrite();
+        WriteList();
+        lock->LeaveWrite();
+        writes++;
+    } while (GetPerfCounters() < end);
+    QueryThreadCycleTime(GetCurrentThread(), &endCycles);
+    end = GetPerfCounters();
+
+    StopBench(stats);
+
+    printf(
+        "  %10s, %2u, %10.1f, %12.1f\n",
+        name,
+        (unsigned)g_totalThreads,
+        (float)((double)writes * GetPerfFreq() / (end - start)),
+        (float)((double)(endCycles - startCycles) / writes)
+    );
+}
+
+static void RunWaitBench()
+{
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Writer wait policy ===\n");
+    printf("        Name  Readers  Writes/sec  Writer CPU/Op\n");
+    RunWaitBenchOne("Yield", &g_yieldWaitLock);
+    RunWaitBenchOne("Adaptive", &g_adaptiveWaitLock);
+}
+
+//===========================================================================
+// Reader resume benchmark
+//  Time from a writer releasing CRWLock to each reader it blocked getting
+//  the read lock, for 10/30/50% write mixes. The last row has half of the
+//  threads writing back-to-back: blocked readers must still get in after
+//  each write (Max wait stays small, Resumes doesn't drop to zero).
+//===========================================================================
+struct ResumeStat : BenchStat {
+    unsigned        resumes;
+    __int64         totalLatency;
+    __int64         maxLatency;
+    __int64         maxWait;
+};
+
+CACHE_ALIGN CRWLock             g_resumeLock;
+CACHE_ALIGN volatile __int64    g_lastWriteRelease;
+
+static void RunResumeBenchOne(const char * mix, float readRate, unsigned writers)
+{
+    // First writers threads only write
+    auto body = [writers](ResumeStat & stat, CRandomMersenne & ranObject)
+    {
+        if ((unsigned)stat.threadIdx >= writers && (float)ranObject.Random() < stat.readRate)
+        {
+            __int64 enter = GetPerfCounters();
+            g_resumeLock.EnterRead();
+            __int64 entered = GetPerfCounters();
+
+            // Written under the write lock, so stable here. A release after
+            // we started means we were blocked by that writer.
+            __int64 released = g_lastWriteRelease;
+            if (released > enter)
+            {
+                __int64 latency = entered - released;
+                stat.resumes++;
+                stat.totalLatency += latency;
+                if (latency > stat.maxLatency)
+                    stat.maxLatency = latency;
+                if (entered - enter > stat.maxWait)
+                    stat.maxWait = entered - enter;
+            }
+
+            ReadList();
+            g_resumeLock.LeaveRead();
+        }
+        else
+        {
+            g_resumeLock.EnterWrite();
+            ReadList();
+            WriteList();
+            g_lastWriteRelease = GetPerfCounters();
+            g_resumeLock.LeaveWrite();
+        }
+    };
+    RunBench<ResumeStat>(readRate, body);
+
+    const BenchStatAligned<ResumeStat> * stats = GetBenchStats<ResumeStat>();
+    unsigned threadCount = (unsigned)g_totalThreads;
+    unsigned resumes = 0;
+    __int64 totalLatency = 0;
+    __int64 maxLatency = 0;
+    __int64 maxWait = 0;
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        resumes += stats[i].resumes;
+        totalLatency += stats[i].totalLatency;
+        if (stats[i].maxLatency > maxLatency)
+            maxLatency = stats[i].maxLatency;
+        if (stats[i].maxWait > maxWait)
+            maxWait = stats[i].maxWait;
+    }
+
+    double usPerTick = 1e6 / GetPerfFreq();
+    printf(
+        "  %8s, %7u, %10u, %7.1f, %7.1f, %10.1f\n",
+        mix,
+        threadCount,
+        resumes,
+        resumes ? (float)(totalLatency * usPerTick / resumes) : 0.0f,
+        (float)(maxLatency * usPerTick),
+        (float)(maxWait * usPerTick)
+    );
+}
+
+static void RunResumeBench()
+{
+    static const float s_readRates[] = { 0.90f, 0.70f, 0.50f };
+
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Reader resume after write ===\n");
+    printf("       Mix  Threads    Resumes  Avg us   Max us  Max wait us\n");
+
+    for (unsigned r = 0; r < countof(s_readRates); r++)
+    {
+        char mix[16];
+        sprintf(mix, "W(%3d%%)", WritePercent(s_readRates[r]));
+        RunResumeBenchOne(mix, s_readRates[r], 0);
+    }
+
+    // Back-to-back writers, at least one reader
+    unsigned writers = (unsigned)g_totalThreads / 2;
+    if (writers == 0)
+        writers = 1;
+    RunResumeBenchOne("W-burst", 1.0f, writers);
+}
+
+//===========================================================================
+// Try-lock benchmark
+//  Success rate and latency of TryEnterXXX() and EnterXXXUntil() under
+//  contention, for CRWLock and CRWLock2. Latency is the time spent in the
+//  acquire call, whether it succeeds or gives up.
+//===========================================================================
+const unsigned TRY_BENCH_TIMEOUT_US = 100;
+const unsigned TRY_BENCH_BUCKETS    = 6;    // <1us, <10us, ... , >=10ms
+
+// Attempts in BenchStat::reads and writes
+struct TryStat : BenchStat {
+    unsigned        successes[2];   // read, write
+    unsigned        latency[TRY_BENCH_BUCKETS];
+};
+
+CACHE_ALIGN CRWLock         g_tryAsymLock;
+CACHE_ALIGN CRWLock2        g_tryPerProcLock;
+
+static void AddTryLatency(TryStat * stat, __int64 ticks)
+{
+    static const double s_usPerTick = 1e6 / GetPerfFreq();
+    double us = ticks * s_usPerTick;
+    unsigned bucket = 0;
+    for (double limit = 1.0; us >= limit && bucket < TRY_BENCH_BUCKETS - 1; limit *= 10.0)
+        bucket++;
+    stat->latency[bucket]++;
+}
+
+template <class Lock>
+static void RunTryBenchOne(
+    const char *    name,
+    Lock *          lock,
+    float           readRate,
+    bool            timed
+) {
+    auto body = [lock, timed](TryStat & stat, CRandomMersenne & ranObject)
+    {
+        bool read = (float)ranObject.Random() < stat.readRate;
+        LockClock::time_point deadline =
+            LockClock::now() + std::chrono::microseconds(TRY_BENCH_TIMEOUT_US);
+
+        __int64 start = GetPerfCounters();
+        bool acquired;
+        if (read)
+            acquired = timed ? lock->EnterReadUntil(deadline) : lock->TryEnterRead();
+        else
+            acquired = timed ? lock->EnterWriteUntil(deadline) : lock->TryEnterWrite();
+        AddTryLatency(&stat, GetPerfCounters() - start);
+
+        if (read)
+            stat.reads++;
+        else
+            stat.writes++;
+        if (!acquired)
+            return;
+
+        stat.successes[read ? 0 : 1]++;
+        ReadList();
+        if (read)
+        {
+            lock->LeaveRead();
+        }
+        else
+        {
+            WriteList();
+            lock->LeaveWrite();
+        }
+    };
+    BenchTotal total = RunBench<TryStat>(readRate, body);
+
+    const BenchStatAligned<TryStat> * stats = GetBenchStats<TryStat>();
+    unsigned successes[2] = { 0, 0 };
+    unsigned latency[TRY_BENCH_BUCKETS] = { 0 };
+    for (unsigned i = 0; i < (unsigned)g_totalThreads; i++)
+    {
+        for (unsigned k = 0; k < 2; k++)
+            successes[k] += stats[i].successes[k];
+        for (unsigned b = 0; b < TRY_BENCH_BUCKETS; b++)
+            latency[b] += stats[i].latency[b];
+    }
+
+    unsigned attempts = total.reads + total.writes;
+    printf(
+        "  %-10s %-5s W(%3d%%), %6.1f%%, %6.1f%%,",
+        name,
+        timed ? "Until" : "Try",
+        WritePercent(readRate),
+        total.reads ? 100.0f * successes[0] / total.reads : 0.0f,
+        total.writes ? 100.0f * successes[1] / total.writes : 0.0f
+    );
+    for (unsigned b = 0; b < TRY_BENCH_BUCKETS; b++)
+        printf(" %5.1f%%", attempts ? 100.0f * latency[b] / attempts : 0.0f);
+    printf("\n");
+}
+
+static void RunTryBench()
+{
+    static const float s_readRates[] = { 0.99f, 0.90f, 0.50f };
+
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Try/timed acquire, %u threads, Until = %u us deadline ===\n",
+        (unsigned)g_totalThreads, TRY_BENCH_TIMEOUT_US);
+    printf("                          Mix   Read OK  Write OK   <1us  <10us <100us   <1ms  <10ms  >10ms\n");
+
+    for (unsigned r = 0; r < countof(s_readRates); r++)
+    {
+        for (unsigned timed = 0; timed < 2; timed++)
+        {
+            RunTryBenchOne("Asymmetric", &g_tryAsymLock, s_readRates[r], timed != 0);
+            RunTryBenchOne("Per-Proc", &g_tryPerProcLock, s_readRates[r], timed != 0);
+        }
+    }
+}
+
+
+//===========================================================================
+// Upgrade benchmark
+//  Read-modify-write through CRWLock: drop the read lock, take the write
+//  lock and read again ("Relock") against EnterUpgradable() +
+//  UpgradeToWrite() ("Upgrade"). Other operations are plain reads.
+//===========================================================================
+CACHE_ALIGN CRWLock             g_upgradeLock;
+
+static void RunUpgradeBenchOne(float readRate, bool upgrade)
+{
+    auto body = [upgrade](BenchStat & stat, CRandomMersenne & ranObject)
+    {
+        if ((float)ranObject.Random() < stat.readRate)
+        {
+            g_upgradeLock.EnterRead();
+            ReadList();
+            g_upgradeLock.LeaveRead();
+            stat.reads++;
+        }
+        else if (upgrade)
+        {
+            g_upgradeLock.EnterUpgradable();
+            ReadList();
+            g_upgradeLock.UpgradeToWrite();
+            WriteList();
+            g_upgradeLock.LeaveWrite();
+            stat.writes++;
+        }
+        else
+        {
+            g_upgradeLock.EnterRead();
+            ReadList();
+            g_upgradeLock.LeaveRead();
+
+            // List may have changed in between, read it again
+            g_upgradeLock.EnterWrite();
+            ReadList();
+            WriteList();
+            g_upgradeLock.LeaveWrite();
+            stat.writes++;
+        }
+    };
+    BenchTotal total = RunBench<BenchStat>(readRate, body);
+
+    printf(
+        "  %-8s W(%3d%%), %7u, %12.1f, %12.1f\n",
+        upgrade ? "Upgrade" : "Relock",
+        WritePercent(readRate),
+        (unsigned)g_totalThreads,
+        (float)(total.reads / total.seconds),
+        (float)(total.writes / total.seconds)
+    );
+}
+
+static void RunUpgradeBench()
+{
+    static const float s_readRates[] = { 0.99f, 0.90f, 0.70f };
+
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Read-modify-write ===\n");
+    printf("                Mix  Threads     Reads/sec   Updates/sec\n");
+
+    for (unsigned r = 0; r < countof(s_readRates); r++)
+    {
+        RunUpgradeBenchOne(s_readRates[r], false);
+        RunUpgradeBenchOne(s_readRates[r], true);
+    }
+}
+
+
+//===========================================================================
+// Combining benchmark
+//  CRWLock writes through EnterWrite/LeaveWrite against ExecuteWrite()
+//  (flat combining) for every read/write mix of the main test.
+//===========================================================================
+CACHE_ALIGN CRWLock             g_combineLock;
+
+static void RunCombineBenchOne(const char * name, float readRate, bool combine)
+{
+    auto body = [combine](BenchStat & stat, CRandomMersenne & ranObject)
+    {
+        if ((float)ranObject.Random() < stat.readRate)
+        {
+            g_combineLock.EnterRead();
+            ReadList();
+            g_combineLock.LeaveRead();
+            stat.reads++;
+        }
+        else if (combine)
+        {
+            g_combineLock.ExecuteWrite([] {
+                ReadList();
+                WriteList();
+            });
+            stat.writes++;
+        }
+        else
+        {
+            g_combineLock.EnterWrite();
+            ReadList();
+            WriteList();
+            g_combineLock.LeaveWrite();
+            stat.writes++;
+        }
+    };
+    BenchTotal total = RunBench<BenchStat>(readRate, body);
+
+    printf(
+        "  %-14s %-12s %7u, %12.1f, %12.1f\n",
+        name,
+        combine ? "ExecuteWrite" : "EnterWrite",
+        (unsigned)g_totalThreads,
+        (float)(total.reads / total.seconds),
+        (float)(total.writes / total.seconds)
+    );
+}
+
+static void RunCombineBench()
+{
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Flat combining ===\n");
+    printf("  Mix            Writes       Threads     Reads/sec    Writes/sec\n");
+
+    for (unsigned i = 0; i < countof(g_readRates); i++)
+    {
+        char name[32];
+        sprintf(name, "R(%.4g%%)/W(%.4g%%)", g_readRates[i] * 100.0f, (1.0f - g_readRates[i]) * 100.0f);
+        RunCombineBenchOne(name, g_readRates[i], false);
+        RunCombineBenchOne(name, g_readRates[i], true);
+    }
+}
+
+
+//===========================================================================
+// Hybrid lock phase benchmark
+//  Write mix changes every phase, like a bulk reload window between
+//  steady-state reads. CHybridRWLock against CRWLock, with the hybrid
+//  lock's mode switch counters after every phase.
+//===========================================================================
+const unsigned HYBRID_BENCH_PHASE_MS = 1000;
+
+// Sampled while running, so not in BenchStat::reads and writes
+struct PhaseStat : BenchStat {
+    volatile long   ops;
+};
+
+CACHE_ALIGN CRWLock             g_phaseAsymLock;
+CACHE_ALIGN CHybridRWLock       g_phaseHybridLock;
+CACHE_ALIGN volatile float      g_phaseReadRate;
+
+static void PrintModeSwitches(CRWLock *)
+{
+    printf("\n");
+}
+
+static void PrintModeSwitches(CHybridRWLock * lock)
+{
+    printf(
+        ", %-10s %6u, %6u\n",
+        lock->IsSymmetric() ? "Symmetric" : "Asymmetric",
+        (unsigned)lock->GetSymmetricSwitches(),
+        (unsigned)lock->GetAsymmetricSwitches()
+    );
+}
+
+template <class Lock>
+static void RunPhaseBenchOne(const char * name, Lock * lock)
+{
+    static const float s_readRates[] = { 0.99f, 0.50f, 0.10f, 0.99f, 1.0f };
+    unsigned threadCount = (unsigned)g_totalThreads;
+
+    auto body = [lock](PhaseStat & stat, CRandomMersenne & ranObject)
+    {
+        if ((float)ranObject.Random() < g_phaseReadRate)
+        {
+            lock->EnterRead();
+            ReadList();
+            lock->LeaveRead();
+        }
+        else
+        {
+            lock->EnterWrite();
+            ReadList();
+            WriteList();
+            lock->LeaveWrite();
+        }
+        stat.ops++;
+    };
+    g_phaseReadRate = s_readRates[0];
+    BenchStatAligned<PhaseStat> * stats = StartBench<PhaseStat>(s_readRates[0], body);
+
+    for (unsigned p = 0; p < countof(s_readRates); p++)
+    {
+        g_phaseReadRate = s_readRates[p];
+
+        long startOps = 0;
+        for (unsigned i = 0; i < threadCount; i++)
+            startOps += stats[i].ops;
+        __int64 start = GetPerfCounters();
+
+        Sleep(HYBRID_BENCH_PHASE_MS);
+
+        long endOps = 0;
+        for (unsigned i = 0; i < threadCount; i++)
+            endOps += stats[i].ops;
+        __int64 end = GetPerfCounters();
+
+        printf(
+            "  %-10s W(%3d%%), %12.1f",
+            name,
+            WritePercent(s_readRates[p]),
+            (float)((double)(endOps - startOps) * GetPerfFreq() / (end - start))
+        );
+        PrintModeSwitches(lock);
+    }
+
+    StopBench(stats);
+}
+
+static void RunHybridBench()
+{
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Phased write mix, %u threads ===\n", (unsigned)g_totalThreads);
+    printf("  Name           Mix       Ops/sec, Mode       ToSym  ToAsym\n");
+    RunPhaseBenchOne("Asymmetric", &g_phaseAsymLock);
+    RunPhaseBenchOne("Hybrid", &g_phaseHybridLock);
+}
+
+
+//===========================================================================
+// Lock table benchmark
+//  Many small objects guarded by a TRWLockTable, keys drawn from a Zipf
+//  distribution so a few hot objects (and their stripes) take most of the
+//  traffic. Asymmetric and per-proc stripes, several stripe counts.
+//===========================================================================
+const unsigned TABLE_BENCH_OBJECTS  = 1000000;
+const double   TABLE_BENCH_ZIPF     = 0.99;
+const float    TABLE_BENCH_READRATE = 0.95f;
+
+static unsigned *           s_tableObjects;
+static double *             s_zipfCdf;
+
+static void InitZipf()
+{
+    if (s_zipfCdf != NULL)
+        return;
+
+    // Rank r (0 based) has weight 1 / (r + 1)^s
+    s_zipfCdf = new double[TABLE_BENCH_OBJECTS];
+    double sum = 0.0;
+    for (unsigned r = 0; r < TABLE_BENCH_OBJECTS; r++)
+    {
+        sum += 1.0 / pow((double)(r + 1), TABLE_BENCH_ZIPF);
+        s_zipfCdf[r] = sum;
+    }
+    for (unsigned r = 0; r < TABLE_BENCH_OBJECTS; r++)
+        s_zipfCdf[r] /= sum;
+
+    s_tableObjects = new unsigned[TABLE_BENCH_OBJECTS];
+    ZeroMemory(s_tableObjects, sizeof(unsigned) * TABLE_BENCH_OBJECTS);
+}
+
+static unsigned NextZipfKey(CRandomMersenne & ranObject)
+{
+    double u = ranObject.Random();
+    unsigned lo = 0;
+    unsigned hi = TABLE_BENCH_OBJECTS - 1;
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+        if (s_zipfCdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    // Scatter ranks so hot objects are not neighbors
+    return (unsigned)(((uint64_t)lo * 2654435761u) % TABLE_BENCH_OBJECTS);
+}
+
+template <class Lock>
+static void RunTableBenchOne(const char * name, unsigned stripeCount)
+{
+    TRWLockTable<Lock> table(stripeCount);
+
+    auto body = [&table](BenchStat & stat, CRandomMersenne & ranObject)
+    {
+        unsigned key = NextZipfKey(ranObject);
+        unsigned * object = &s_tableObjects[key];
+        if ((float)ranObject.Random() < stat.readRate)
+        {
+            table.EnterRead(object);
+            volatile unsigned value = *object;
+            (void)value;
+            table.LeaveRead(object);
+            stat.reads++;
+        }
+        else
+        {
+            table.EnterWrite(object);
+            (*object)++;
+            table.LeaveWrite(object);
+            stat.writes++;
+        }
+    };
+    BenchTotal total = RunBench<BenchStat>(TABLE_BENCH_READRATE, body);
+
+    printf(
+        "  %-10s %7u, %7u, %12.1f, %12.1f\n",
+        name,
+        table.GetStripeCount(),
+        (unsigned)g_totalThreads,
+        (float)(total.reads / total.seconds),
+        (float)(total.writes / total.seconds)
+    );
+}
+
+static void RunTableBench()
+{
+    static const unsigned s_stripeCounts[] = { 16, 256, 4096 };
+
+    InitZipf();
+
+    printf(
+        "=== Lock table, %u objects, Zipf %.2f, W(%d%%) ===\n",
+        TABLE_BENCH_OBJECTS,
+        TABLE_BENCH_ZIPF,
+        WritePercent(TABLE_BENCH_READRATE)
+    );
+    printf("  Name       Stripes  Threads     Reads/sec    Writes/sec\n");
+
+    for (unsigned i = 0; i < countof(s_stripeCounts); i++)
+    {
+        RunTableBenchOne<CRWLock>("Asymmetric", s_stripeCounts[i]);
+        RunTableBenchOne<CRWLock2>("Per-Proc", s_stripeCounts[i]);
+    }
+}
+
+
+//===========================================================================
+// Cohort lock benchmark
+//  CCohortRWLock with the detected topology and with fake 2 and 4 node
+//  topologies, against CRWLock and CRWLock2. Local handoffs keep the
+//  writer lock on one node, global ones move it between nodes.
+//===========================================================================
+static void PrintHandoffs(void *)
+{
+    printf("\n");
+}
+
+static void PrintHandoffs(CCohortRWLock * lock)
+{
+    printf(
+        ", %10u, %10u\n",
+        (unsigned)lock->GetLocalHandoffs(),
+        (unsigned)lock->GetGlobalHandoffs()
+    );
+}
+
+template <class Lock>
+static void RunCohortBenchOne(const char * name, Lock * lock, float readRate)
+{
+    auto body = [lock](BenchStat & stat, CRandomMersenne & ranObject)
+    {
+        if ((float)ranObject.Random() < stat.readRate)
+        {
+            lock->EnterRead();
+            ReadList();
+            lock->LeaveRead();
+            stat.reads++;
+        }
+        else
+        {
+            lock->EnterWrite();
+            ReadList();
+            WriteList();
+            lock->LeaveWrite();
+            stat.writes++;
+        }
+    };
+    BenchTotal total = RunBench<BenchStat>(readRate, body);
+
+    printf(
+        "  %-12s W(%3d%%), %7u, %12.1f, %12.1f",
+        name,
+        WritePercent(readRate),
+        (unsigned)g_totalThreads,
+        (float)(total.reads / total.seconds),
+        (float)(total.writes / total.seconds)
+    );
+    PrintHandoffs(lock);
+}
+
+static void RunCohortBench()
+{
+    static const float s_readRates[] = { 0.99f, 0.90f, 0.50f };
+    CNumaTopology fake2(2);
+    CNumaTopology fake4(4);
+
+    ResetTestList(WAIT_BENCH_WORKSIZE);
+
+    printf("=== Cohort lock, %u NUMA node(s) detected ===\n", CNumaTopology::System().GetNodeCount());
+    printf("  Name            Mix   Threads     Reads/sec    Writes/sec  Local hand  Global hand\n");
+
+    for (unsigned r = 0; r < countof(s_readRates); r++)
+    {
+        CRWLock asymLock;
+        CRWLock2 perProcLock;
+        CCohortRWLock cohortLock;
+        CCohortRWLock cohortLock2(fake2);
+        CCohortRWLock cohortLock4(fake4);
+
+        RunCohortBenchOne("Asymmetric", &asymLock, s_readRates[r]);
+        RunCohortBenchOne("Per-Proc", &perProcLock, s_readRates[r]);
+        RunCohortBenchOne("Cohort", &cohortLock, s_readRates[r]);
+        RunCohortBenchOne("Cohort(2)", &cohortLock2, s_readRates[r]);
+        RunCohortBenchOne("Cohort(4)", &cohortLock4, s_readRates[r]);
+    }
+}
+
+
+//===========================================================================
+// RCU benchmark
+//  Readers look up a read-mostly record, one updater replaces it. With
+//  CRWLock the updater writes under the write lock. With CRCUDomain it
+//  publishes a copy and frees the old one after Synchronize() (sync) or
+//  hands it to Retire() (retire). Update latency is EnterWrite() to
+//  LeaveWrite(), Synchronize(), or Retire() respectively.
+//===========================================================================
+const unsigned RCU_BENCH_VALUES = 64;
+
+enum RcuBenchMode {
+    RCU_BENCH_RWLOCK,
+    RCU_BENCH_SYNC,
+    RCU_BENCH_RETIRE,
+};
+
+struct RcuRecord {
+    unsigned        values[RCU_BENCH_VALUES];
+};
+
+// Updates in BenchStat::writes
+struct RcuStat : BenchStat {
+    unsigned        torn;
+    __int64         updateTicks;
+    __int64         maxUpdateTicks;
+};
+
+CACHE_ALIGN CRWLock                 g_rcuLock;
+CACHE_ALIGN CRCUDomain *            g_rcuDomain;
+CACHE_ALIGN std::atomic<RcuRecord *> g_rcuRecord;
+
+static bool ReadRcuRecord(const RcuRecord * record)
+{
+    unsigned value = record->values[0];
+    for (unsigned i = 1; i < RCU_BENCH_VALUES; i++)
+    {
+        if (record->values[i] != value)
+            return false;
+    }
+    return true;
+}
+
+static void DeleteRcuRecord(void * record)
+{
+    delete (RcuRecord *) record;
+}
+
+static void UpdateRcuRecord(RcuStat * stat, RcuBenchMode mode)
+{
+    __int64 start = GetPerfCounters();
+    if (mode == RCU_BENCH_RWLOCK)
+    {
+        g_rcuLock.EnterWrite();
+        RcuRecord * record = g_rcuRecord.load(std::memory_order_relaxed);
+        for (unsigned i = 0; i < RCU_BENCH_VALUES; i++)
+            record->values[i]++;
+        g_rcuLock.LeaveWrite();
+    }
+    else
+    {
+        RcuRecord * record = new RcuRecord(*g_rcuRecord.load(std::memory_order_relaxed));
+        for (unsigned i = 0; i < RCU_BENCH_VALUES; i++)
+            record->values[i]++;
+        start = GetPerfCounters();
+
+        RcuRecord * old = g_rcuRecord.exchange(record, std::memory_order_release);
+        if (mode == RCU_BENCH_SYNC)
+        {
+            g_rcuDomain->Synchronize();
+            delete old;
+        }
+        else
+        {
+            g_rcuDomain->Retire(old, DeleteRcuRecord);
+        }
+    }
+
+    __int64 ticks = GetPerfCounters() - start;
+    stat->updateTicks += ticks;
+    if (ticks > stat->maxUpdateTicks)
+        stat->maxUpdateTicks = ticks;
+    stat->writes++;
+}
+
+static void RunRcuBenchOne(const char * name, RcuBenchMode mode, unsigned intervalMs)
+{
+    // Thread 0 updates, the others read
+    auto body = [mode, intervalMs](RcuStat & stat, CRandomMersenne &)
+    {
+        if (stat.threadIdx == 0)
+        {
+            UpdateRcuRecord(&stat, mode);
+            if (intervalMs)
+                Sleep(intervalMs);
+            return;
+        }
+
+        bool ok;
+        if (mode == RCU_BENCH_RWLOCK)
+        {
+            g_rcuLock.EnterRead();
+            ok = ReadRcuRecord(g_rcuRecord.load(std::memory_order_relaxed));
+            g_rcuLock.LeaveRead();
+        }
+        else
+        {
+            g_rcuDomain->ReadLock();
+            ok = ReadRcuRecord(g_rcuRecord.load(std::memory_order_acquire));
+            g_rcuDomain->ReadUnlock();
+        }
+        if (!ok)
+            stat.torn++;
+        stat.reads++;
+    };
+    g_rcuRecord = new RcuRecord();
+    BenchTotal total = RunBench<RcuStat>(1.0f, body);
+
+    if (mode == RCU_BENCH_RETIRE)
+        g_rcuDomain->Barrier();
+    delete g_rcuRecord.load();
+
+    const BenchStatAligned<RcuStat> * stats = GetBenchStats<RcuStat>();
+    unsigned torn = 0;
+    for (unsigned i = 0; i < (unsigned)g_totalThreads; i++)
+        torn += stats[i].torn;
+
+    const RcuStat & updater = stats[0];
+    double ticksPerUs = (double)GetPerfFreq() / 1000000.0;
+    printf(
+        "  %-10s %3ums, %7u, %12.1f, %10.1f, %10.2f, %10.2f, %u\n",
+        name,
+        intervalMs,
+        (unsigned)g_totalThreads - 1,
+        (float)(total.reads / total.seconds),
+        (float)(updater.writes / total.seconds),
+        updater.writes ? (float)(updater.updateTicks / ticksPerUs / updater.writes) : 0.0f,
+        (float)(updater.maxUpdateTicks / ticksPerUs),
+        torn
+    );
+}
+
+static void RunRcuBench()
+{
+    static const unsigned s_updateIntervals[] = { 1, 0 };
+    CRCUDomain domain;
+    g_rcuDomain = &domain;
+
+    printf("=== RCU vs asymmetric lock, 1 updater ===\n");
+    printf("  Name      Interval Readers     Reads/sec  Updates/sec   Avg(us)     Max(us), Torn\n");
+    for (unsigned i = 0; i < countof(s_updateIntervals); i++)
+    {
+        RunRcuBenchOne("Asymmetric", RCU_BENCH_RWLOCK, s_updateIntervals[i]);
+        RunRcuBenchOne("RCU sync", RCU_BENCH_SYNC, s_updateIntervals[i]);
+        RunRcuBenchOne("RCU retire", RCU_BENCH_RETIRE, s_updateIntervals[i]);
+    }
+    printf("  Grace periods %u, reclaimed %u\n",
+        (unsigned)domain.GetGracePeriods(),
+        (unsigned)domain.GetReclaimedCount()
+    );
+    g_rcuDomain = NULL;
+}
+
+
+//===========================================================================
+// Left-Right benchmark
+//  List workload of the main test under CRWLock and under TLeftRight,
+//  which keeps two copies of the list. Left-Right readers never wait for
+//  the writer, but every write is done twice.
+//===========================================================================
+struct LeftRightList {
+    TEST_LIST       items;
+    TEST_LIST       freeItems;
+
+    ~LeftRightList()
+    {
+        Clear();
+    }
+
+    void Clear()
+    {
+        while (!items.empty())
+        {
+            delete items.front();
+            items.pop_front();
+        }
+        while (!freeItems.empty())
+        {
+            delete freeItems.front();
+            freeItems.pop_front();
+        }
+    }
+
+    // worksize items, plus one spare item WriteList() rotates through
+    void Reset(int worksize)
+    {
+        Clear();
+        for (int i = 0; i < worksize; i++)
+        {
+            TestItem * item = new TestItem;
+            item->data = worksize;
+            items.push_back(item);
+        }
+        freeItems.push_back(new TestItem);
+    }
+};
+
+struct ResetLeftRightList {
+    int     worksize;
+    void operator()(LeftRightList & list) const { list.Reset(worksize); }
+};
+
+struct ReadLeftRightList {
+    void operator()(const LeftRightList & list) const { ReadList(list.items); }
+};
+
+struct WriteLeftRightList {
+    void operator()(LeftRightList & list) const { WriteList(list.items, list.freeItems); }
+};
+
+CACHE_ALIGN CRWLock                     g_leftRightAsymLock;
+CACHE_ALIGN TLeftRight<LeftRightList>   g_leftRightList;
+
+static float RunLeftRightBenchOne(bool leftRight, float readRate)
+{
+    auto body = [leftRight](BenchStat & stat, CRandomMersenne & ranObject)
+    {
+        bool read = (float)ranObject.Random() < stat.readRate;
+        if (leftRight)
+        {
+            if (read)
+                g_leftRightList.Read(ReadLeftRightList());
+            else
+                g_leftRightList.Write(WriteLeftRightList());
+        }
+        else if (read)
+        {
+            g_leftRightAsymLock.EnterRead();
+            ReadList();
+            g_leftRightAsymLock.LeaveRead();
+        }
+        else
+        {
+            g_leftRightAsymLock.EnterWrite();
+            WriteList(g_testList, g_freeList);
+            g_leftRightAsymLock.LeaveWrite();
+        }
+
+        if (read)
+            stat.reads++;
+        else
+            stat.writes++;
+    };
+    BenchTotal total = RunBench<BenchStat>(readRate, body);
+
+    return (float)((total.reads + total.writes) / total.seconds);
+}
+
+static void RunLeftRightBench()
+{
+    static const int s_workSizes[] = { 4, 100, 4000 };
+    static const float s_readRates[] = { 1.0f, 0.999f, 0.99f, 0.90f, 0.50f };
+
+    printf("=== Left-Right vs asymmetric lock, %u threads ===\n", (unsigned)g_totalThreads);
+    printf("  Worksize       Mix    Asymmetric    Left-Right\n");
+    for (unsigned w = 0; w < countof(s_workSizes); w++)
+    {
+        ResetLeftRightList reset = { s_workSizes[w] };
+        ResetTestList(s_workSizes[w]);
+        g_leftRightList.Write(reset);
+
+        for (unsigned r = 0; r < countof(s_readRates); r++)
+        {
+            float asymOps = RunLeftRightBenchOne(false, s_readRates[r]);
+            float leftRightOps = RunLeftRightBenchOne(true, s_readRates[r]);
+            printf(
+                "  %8d  W(%4.1f%%), %12.1f, %12.1f\n",
+                s_workSizes[w],
+                (1.0f - s_readRates[r]) * 100.0f,
+                asymOps,
+                leftRightOps
+            );
+        }
+    }
+}
+
+
+//===========================================================================
+// USDT probe self-test
+//  CProbeTracer attaches to the rwlock probes of this program like perf or
+//  bpftrace would. Each case runs a fixed lock sequence, with a helper
+//  thread for the contended ones, and compares the probes that fired for
+//  the lock (and their arguments) with the expected sequence.
+//===========================================================================
+#if defined(RWLOCK_HAVE_PROBE_TRACER)
+
+const unsigned PROBE_WAIT_MS = 5000;
+
+// '*' matches any run of characters
+static bool MatchProbes(const char * pattern, const char * text)
+{
+    if (*pattern == 0)
+        return *text == 0;
+    if (*pattern == '*')
+        return MatchProbes(pattern + 1, text) || (*text && MatchProbes(pattern, text + 1));
+    return *pattern == *text && MatchProbes(pattern + 1, text + 1);
+}
+
+// Probes of lock in hit order, e.g. "read_acquire(0) read_release".
+// Arguments after the lock follow in parentheses.
+static string FormatProbes(const CProbeTracer & tracer, const void * lock)
+{
+    string text;
+    for (unsigned i = 0; i < tracer.GetEventCount(); i++)
+    {
+        const CProbeTracer::Event & event = tracer.GetEvent(i);
+        if (!event.ready.load(std::memory_order_acquire) || event.args[0] != (uint64_t)(uintptr_t)lock)
+            continue;
+
+        if (!text.empty())
+            text += ' ';
+        text += tracer.GetEventName(event);
+
+        unsigned argCount = tracer.GetEventArgCount(event);
+        for (unsigned arg = 1; arg < argCount; arg++)
+        {
+            char value[32];
+            snprintf(value, sizeof(value), "%s%llu", arg == 1 ? "(" : ",", (unsigned long long)event.args[arg]);
+            text += value;
+        }
+        if (argCount > 1)
+            text += ')';
+    }
+    return text;
+}
+
+static bool CheckProbes(CProbeTracer & tracer, const void * lock, const char * name, const char * expected)
+{
+    string actual = FormatProbes(tracer, lock);
+    bool ok = MatchProbes(expected, actual.c_str());
+    printf("  %-34s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        printf("    expected: %s\n    actual:   %s\n", expected, actual.c_str());
+    tracer.ClearEvents();
+    return ok;
+}
+
+// Helper thread takes the lock (write if holdWrite) and holds it until
+// the probe waitName fired, meanwhile the main thread enters (write if
+// enterWrite) and leaves.
+template <class Lock>
+static bool RunProbeHolder(
+    CProbeTracer &  tracer,
+    Lock &          lock,
+    bool            holdWrite,
+    bool            enterWrite,
+    const char *    waitName
+)
+{
+    std::atomic<bool> held(false);
+    bool seen = false;
+    std::thread holder([&]()
+    {
+        if (holdWrite)
+            lock.EnterWrite();
+        else
+            lock.EnterRead();
+        held = true;
+
+        seen = tracer.WaitForEvent(waitName, &lock, PROBE_WAIT_MS);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (holdWrite)
+            lock.LeaveWrite();
+        else
+            lock.LeaveRead();
+    });
+
+    while (!held)
+        std::this_thread::yield();
+    if (enterWrite)
+    {
+        lock.EnterWrite();
+        lock.LeaveWrite();
+    }
+    else
+    {
+        lock.EnterRead();
+        lock.LeaveRead();
+    }
+    holder.join();
+    return seen;
+}
+
+static bool RunProbeTest()
+{
+    CProbeTracer tracer;
+    if (!tracer.Load("rwlock"))
+    {
+        printf("No usable rwlock probes in this program\n");
+        return false;
+    }
+    printf("=== USDT probes (%u sites) ===\n", tracer.GetProbeCount());
+    if (!tracer.Attach())
+    {
+        printf("Can't attach to the probes\n");
+        return false;
+    }
+
+    bool ok = true;
+    {
+        CRWLock lock;
+        lock.EnterRead();
+        lock.LeaveRead();
+        lock.EnterWrite();
+        lock.LeaveWrite();
+        ok &= CheckProbes(tracer, &lock, "Asymmetric uncontended",
+            "read_acquire(0) read_release barrier drain_done(0,0,0) write_acquire write_release");
+    }
+    {
+        CRWLock lock;
+        ok &= RunProbeHolder(tracer, lock, true, false, "read_contend");
+        ok &= CheckProbes(tracer, &lock, "Asymmetric reader waits for writer",
+            "barrier drain_done(0,0,0) write_acquire read_contend write_release read_acquire(1) read_release");
+    }
+    {
+        // Writer may park, which issues another barrier
+        CRWLock lock;
+        ok &= RunProbeHolder(tracer, lock, false, true, "write_contend");
+        ok &= CheckProbes(tracer, &lock, "Asymmetric writer waits for reader",
+            "read_acquire(0) barrier write_contend(1)* read_release drain_done(*) write_acquire write_release");
+    }
+    {
+        CRWLock lock;
+        ok &= RunProbeHolder(tracer, lock, true, true, "write_contend");
+        ok &= CheckProbes(tracer, &lock, "Asymmetric writer waits for writer",
+            "barrier drain_done(0,0,0) write_acquire write_contend(0) write_release "
+            "barrier drain_done(0,0,0) write_acquire write_release");
+    }
+    {
+        CRWLock2 lock;
+        lock.EnterRead();
+        lock.LeaveRead();
+        lock.EnterWrite();
+        lock.LeaveWrite();
+        ok &= CheckProbes(tracer, &lock, "Per-Proc uncontended",
+            "read_acquire(0) read_release write_acquire write_release");
+    }
+    {
+        CRWLock2 lock;
+        ok &= RunProbeHolder(tracer, lock, true, false, "read_contend");
+        ok &= CheckProbes(tracer, &lock, "Per-Proc reader waits for writer",
+            "write_acquire read_contend write_release read_acquire(1) read_release");
+    }
+    {
+        // Reader holds the shard of its processor only, other shards are
+        // taken without waiting
+        CRWLock2 lock;
+        ok &= RunProbeHolder(tracer, lock, false, true, "write_contend");
+        ok &= CheckProbes(tracer, &lock, "Per-Proc writer waits for reader",
+            "read_acquire(0) write_contend(2) read_release write_acquire write_release");
+    }
+
+    tracer.Detach();
+    printf("%s\n", ok ? "All probes fired as expected" : "Probe test FAILED");
+    return ok;
+}
+
+#else
+
+static bool RunProbeTest()
+{
+    printf("Probe self-test needs USDT probes on x86-64 Linux\n");
+    return true;
+}
+
+#endif
+
+
+//===========================================================================
+// Multi-process benchmark
+//  Forked workers share one MAP_SHARED mapping holding the lock and a row
+//  of counters. Writers increment every counter, readers check that they
+//  are all equal. CSharedRWLock runs next to a process-shared
+//  pthread_rwlock_t. Then workers die holding the read or the write lock
+//  and the rest must get the lock anyway.
+//===========================================================================
+#if !defined(_WIN32)
+const unsigned MAX_SHARED_WORKERS = 64;
+const unsigned SHARED_BENCH_ITEMS = 100;
+
+// Longest recovery from a dead lock holder still counted as a pass
+const unsigned SHARED_RECOVERY_MAX_MS = 1000;
+
+// Process-shared pthread_rwlock_t with the interface of CSharedRWLock
+struct SharedPthreadRWLock {
+    pthread_rwlock_t    lock;
+
+    void Init()
+    {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_rwlock_init(&lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    void EnterRead()    { pthread_rwlock_rdlock(&lock); }
+    void LeaveRead()    { pthread_rwlock_unlock(&lock); }
+    void EnterWrite()   { pthread_rwlock_wrlock(&lock); }
+    void LeaveWrite()   { pthread_rwlock_unlock(&lock); }
+};
+
+struct SharedBenchStat {
+    uint64_t    reads;
+    uint64_t    writes;
+    uint64_t    torn;       // Reads that saw a write half done
+};
+
+struct SharedBenchStatAligned : SharedBenchStat {
+    // Padded data for cache line align
+    uint8_t    pad[
+        CACHELINE_SIZE - (sizeof(SharedBenchStat) % CACHELINE_SIZE)
+    ];
+};
+
+// Everything the workers share, in one MAP_SHARED anonymous mapping
+struct SharedBenchRegion {
+    CSharedRWLock           lock;
+    SharedPthreadRWLock     pthreadLock;
+    std::atomic<uint32_t>   ready;
+    std::atomic<uint32_t>   run;        // 0 wait, 1 run, 2 stop
+    SharedBenchStatAligned  stats[MAX_SHARED_WORKERS];
+    volatile uint64_t       items[SHARED_BENCH_ITEMS];
+};
+
+template <class Lock>
+static void SharedBenchWorker(SharedBenchRegion * region, Lock & lock, unsigned index, float readRate)
+{
+    SharedBenchStat & stat = region->stats[index];
+    CRandomMersenne ranObject(index);
+
+    region->ready.fetch_add(1);
+    while (region->run.load() == 0)
+        SwitchToThread();
+
+    while (region->run.load(std::memory_order_relaxed) == 1)
+    {
+        if ((float)ranObject.Random() < readRate)
+        {
+            lock.EnterRead();
+            uint64_t first = region->items[0];
+            for (unsigned i = 1; i < SHARED_BENCH_ITEMS; i++)
+            {
+                if (region->items[i] != first)
+                {
+                    stat.torn++;
+                    break;
+                }
+            }
+            lock.LeaveRead();
+            stat.reads++;
+        }
+        else
+        {
+            lock.EnterWrite();
+            for (unsigned i = 0; i < SHARED_BENCH_ITEMS; i++)
+                region->items[i]++;
+            lock.LeaveWrite();
+            stat.writes++;
+        }
+    }
+}
+
+// Returns ops/sec of all workers
+template <class Lock>
+static float RunSharedBenchOne(SharedBenchRegion * region, Lock & lock, unsigned workers, float readRate, uint64_t & torn)
+{
+    pid_t pids[MAX_SHARED_WORKERS];
+
+    ZeroMemory(region->stats, sizeof(region->stats));
+    region->ready = 0;
+    region->run = 0;
+    fflush(stdout);
+    for (unsigned i = 0; i < workers; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            SharedBenchWorker(region, lock, i, readRate);
+            region->lock.ReleaseSlot();
+            _exit(0);
+        }
+    }
+    while (region->ready.load() < workers)
+        Sleep(1);
+
+    __int64 start = GetPerfCounters();
+    region->run = 1;
+    Sleep(g_testTimeMs);
+    region->run = 2;
+    for (unsigned i = 0; i < workers; i++)
+        waitpid(pids[i], NULL, 0);
+    __int64 end = GetPerfCounters();
+
+    uint64_t ops = 0;
+    for (unsigned i = 0; i < workers; i++)
+    {
+        ops += region->stats[i].reads + region->stats[i].writes;
+        torn += region->stats[i].torn;
+    }
+    return (float)((double)ops * GetPerfFreq() / (end - start));
+}
+
+// Child takes the lock (write if holdWrite) and exits without releasing
+// it. Returns the child, exited but not reaped yet (a zombie) unless reap.
+static pid_t ForkDeadHolder(SharedBenchRegion * region, bool holdWrite, bool reap)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (holdWrite)
+            region->lock.EnterWrite();
+        else
+            region->lock.EnterRead();
+        _exit(0);
+    }
+
+    if (reap)
+    {
+        waitpid(pid, NULL, 0);
+    }
+    else
+    {
+        siginfo_t info;
+        waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+    }
+    return pid;
+}
+
+static bool CheckRecovery(const char * name, __int64 start, bool ok)
+{
+    double ms = (double)(GetPerfCounters() - start) * 1000.0 / GetPerfFreq();
+    ok = ok && ms < SHARED_RECOVERY_MAX_MS;
+    printf("  %-44s %6.1f ms  %s\n", name, ms, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static bool RunSharedRecovery(SharedBenchRegion * region)
+{
+    CSharedRWLock & lock = region->lock;
+    bool ok = true;
+
+    printf("=== Dead holder recovery ===\n");
+    {
+        unsigned dead = lock.GetDeadReaders();
+        ForkDeadHolder(region, false, true);
+        __int64 start = GetPerfCounters();
+        lock.EnterWrite();
+        lock.LeaveWrite();
+        ok &= CheckRecovery("Reader died, writer enters", start, lock.GetDeadReaders() == dead + 1);
+    }
+    {
+        unsigned dead = lock.GetDeadReaders();
+        pid_t pid = ForkDeadHolder(region, false, false);
+        __int64 start = GetPerfCounters();
+        lock.EnterWrite();
+        lock.LeaveWrite();
+        ok &= CheckRecovery("Reader died (zombie), writer enters", start, lock.GetDeadReaders() == dead + 1);
+        waitpid(pid, NULL, 0);
+    }
+    {
+        unsigned dead = lock.GetDeadWriters();
+        pid_t pid = ForkDeadHolder(region, true, false);
+        __int64 start = GetPerfCounters();
+        lock.EnterRead();
+        lock.LeaveRead();
+        ok &= CheckRecovery("Writer died (zombie), reader enters", start, lock.GetDeadWriters() == dead + 1);
+        waitpid(pid, NULL, 0);
+    }
+    {
+        unsigned dead = lock.GetDeadWriters();
+        ForkDeadHolder(region, true, true);
+        __int64 start = GetPerfCounters();
+        lock.EnterWrite();
+        lock.LeaveWrite();
+        lock.EnterRead();
+        lock.LeaveRead();
+        ok &= CheckRecovery("Writer died, writer then reader enter", start, lock.GetDeadWriters() == dead + 1);
+    }
+    return ok;
+}
+
+static bool RunSharedBench()
+{
+    static const float s_readRates[] = { 1.0f, 0.99f, 0.90f, 0.50f };
+
+    SharedBenchRegion * region = (SharedBenchRegion *)mmap(
+        NULL,
+        sizeof(SharedBenchRegion),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    if (region == MAP_FAILED)
+    {
+        printf("Can't map shared memory\n");
+        return false;
+    }
+    new (&region->lock) CSharedRWLock;
+    region->pthreadLock.Init();
+
+    unsigned maxWorkers = (unsigned)g_totalThreads;
+    if (maxWorkers > MAX_SHARED_WORKERS)
+        maxWorkers = MAX_SHARED_WORKERS;
+
+    uint64_t torn = 0;
+    printf("=== Multi-process lock, forked workers ===\n");
+    printf("  Workers       Mix  CSharedRWLock  pthread_rwlock\n");
+    for (unsigned workers = 1; workers <= maxWorkers; workers *= 2)
+    {
+        for (unsigned r = 0; r < countof(s_readRates); r++)
+        {
+            float sharedOps = RunSharedBenchOne(region, region->lock, workers, s_readRates[r], torn);
+            float pthreadOps = RunSharedBenchOne(region, region->pthreadLock, workers, s_readRates[r], torn);
+            printf(
+                "  %7u  W(%4.1f%%), %12.1f, %12.1f\n",
+                workers,
+                (1.0f - s_readRates[r]) * 100.0f,
+                sharedOps,
+                pthreadOps
+            );
+        }
+    }
+    if (torn)
+        printf("  %llu torn reads\n", (unsigned long long)torn);
+
+    bool ok = RunSharedRecovery(region) && torn == 0;
+    printf("%s\n", ok ? "Shared lock test passed" : "Shared lock test FAILED");
+
+    region->lock.~CSharedRWLock();
+    pthread_rwlock_destroy(&region->pthreadLock.lock);
+    munmap(region, sizeof(SharedBenchRegion));
+    return ok;
+}
+
+#else
+
+static bool RunSharedBench()
+{
+    printf("Multi-process benchmark needs Linux\n");
+    return true;
+}
+
+#endif
+
+
+void Cleanup()
+{
+    TestItem * item;
+    while (!g_testList.empty())
+    {
+        item = g_testList.front();
+        g_testList.pop_front();
+        _aligned_free(item);
+    }
+
+    while (!g_freeList.empty())
+    {
+        item = g_freeList.front();
+        g_freeList.pop_front();
+        _aligned_free(item);
+    }
+
+    delete [] g_latencyStats;
+    g_latencyStats = NULL;
+}
+
+//===========================================================================
+// Command line
+//===========================================================================
+static void PrintUsage()
+{
+    printf(
+        "Usage: RWLockTest [mode] [options]\n"
+        "  mode               One of the benchmarks below, or none for the lock matrix\n"
+        "                     slots, drain, wait, resume, trylock, upgrade, combine,\n"
+        "                     hybrid, table, cohort, rcu, leftright, shared (forked\n"
+        "                     workers, exit code 1 if dead holder recovery fails) or\n"
+        "                     probes (USDT probe self-test, exit code 1 on failure)\n"
+        "  --locks=a,b,...    Locks of the matrix by name (default: all, see --list)\n"
+        "  --read=r,...       Read ratios, 0..1 (default: 0.99,0.95,0.9,0.8,0.7,0.5,0.3,0.1)\n"
+        "  --work=n,...       Dummy load sizes (default: 4,100,200,400,800,4000)\n"
+        "  --threads=n,...    Thread counts (default: 1 .. 2 x processors)\n"
+        "  --duration=ms      Run time of each test (default: %u)\n"
+        "  --pin              Pin test thread i to processor i\n"
+        "  --latency          Acquire and hold time percentiles of reads and writes\n"
+        "  --csv=file         Write matrix results as CSV\n"
+        "  --json=file        Write matrix results as JSON\n"
+        "  --stats=file       Write lock statistics after each test, Prometheus text\n"
+        "                     format (build with RWLOCK_STATS)\n"
+        "  --profile=file     Sample lock hold times, write them as collapsed stacks\n"
+        "                     for flamegraph.pl (build with RWLOCK_PROFILE)\n"
+        "  --profile-rate=n   Sample 1 in n acquisitions (default: %u)\n"
+        "  --list             List lock names\n",
+        TOTAL_TEST_TIME_MS,
+        DEFAULT_PROFILE_RATE
+    );
+}
+
+static bool ParseFloats(const char * value, vector<float> & out)
+{
+    out.clear();
+    for (;;)
+    {
+        char * end;
+        double number = strtod(value, &end);
+        if (end == value || number < 0.0 || number > 1.0)
+            return false;
+        out.push_back((float)number);
+        if (*end == 0)
+            return true;
+        if (*end != ',')
+            return false;
+        value = end + 1;
+    }
+}
+
+template <class T>
+static bool ParseCounts(const char * value, T maxCount, vector<T> & out)
+{
+    out.clear();
+    for (;;)
+    {
+        char * end;
+        long number = strtol(value, &end, 10);
+        if (end == value || number < 1 || (unsigned long)number > (unsigned long)maxCount)
+            return false;
+        out.push_back((T)number);
+        if (*end == 0)
+            return true;
+        if (*end != ',')
+            return false;
+        value = end + 1;
+    }
+}
+
+static bool ParseLocks(const char * value, vector<RWLock *> & out)
+{
+    out.clear();
+    for (;;)
+    {
+        const char * end = strchr(value, ',');
+        string name = end ? string(value, end) : string(value);
+
+        bool found = false;
+        for (unsigned i = 0; i < countof(g_allLocks); i++)
+        {
+            if (strcasecmp(name.c_str(), "all") == 0 || strcasecmp(name.c_str(), g_allLocks[i]->GetName()) == 0)
+            {
+                out.push_back(g_allLocks[i]);
+                found = true;
+            }
+        }
+        if (!found)
+        {
+            fprintf(stderr, "Unknown lock %s\n", name.c_str());
+            return false;
+        }
+
+        if (end == NULL)
+            return true;
+        value = end + 1;
+    }
+}
+
+static FILE * OpenOutput(const char * path)
+{
+    FILE * file = fopen(path, "w");
+    if (file == NULL)
+        fprintf(stderr, "Can't open %s\n", path);
+    return file;
+}
+
+static bool ParseOptions(int argc, char * argv[], int first)
+{
+    for (int i = first; i < argc; i++)
+    {
+        const char * arg = argv[i];
+        const char * value = strchr(arg, '=');
+        value = value ? value + 1 : "";
+
+        bool ok;
+        if (strncmp(arg, "--locks=", 8) == 0)
+            ok = ParseLocks(value, g_options.locks);
+        else if (strncmp(arg, "--read=", 7) == 0)
+            ok = ParseFloats(value, g_options.readRates);
+        else if (strncmp(arg, "--work=", 7) == 0)
+            ok = ParseCounts<int>(value, TOTAL_TEST_ITEM - 1, g_options.workSizes);
+        else if (strncmp(arg, "--threads=", 10) == 0)
+            ok = ParseCounts<unsigned>(value, MAX_THREADS, g_options.threadCounts);
+        else if (strncmp(arg, "--duration=", 11) == 0)
+            ok = (g_testTimeMs = (unsigned)strtoul(value, NULL, 10)) != 0;
+        else if (strcmp(arg, "--pin") == 0)
+            ok = g_options.pin = true;
+        else if (strcmp(arg, "--latency") == 0)
+            ok = g_options.latency = true;
+        else if (strncmp(arg, "--csv=", 6) == 0)
+            ok = (g_options.csv = OpenOutput(value)) != NULL;
+        else if (strncmp(arg, "--json=", 7) == 0)
+            ok = (g_options.json = OpenOutput(value)) != NULL;
+#if defined(RWLOCK_STATS)
+        else if (strncmp(arg, "--stats=", 8) == 0)
+            ok = *(g_options.statsPath = value) != 0;
+#endif
+#if defined(RWLOCK_PROFILE)
+        else if (strncmp(arg, "--profile=", 10) == 0)
+            ok = *(g_options.profilePath = value) != 0;
+        else if (strncmp(arg, "--profile-rate=", 15) == 0)
+            ok = (g_options.profileRate = (unsigned)strtoul(value, NULL, 10)) != 0;
+#endif
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            fprintf(stderr, "Bad option %s\n", arg);
+            return false;
+        }
+    }
+
+    if (g_options.locks.empty())
+        g_options.locks.assign(g_allLocks, g_allLocks + countof(g_allLocks));
+    if (g_options.readRates.empty())
+        g_options.readRates.assign(g_readRates, g_readRates + countof(g_readRates));
+    if (g_options.workSizes.empty())
+        g_options.workSizes.assign(g_workSizes, g_workSizes + countof(g_workSizes));
+
+    if (g_options.csv)
+        WriteCsvHeader(g_options.csv);
+    if (g_options.json)
+        fprintf(g_options.json, "[");
+#if defined(RWLOCK_PROFILE)
+    if (g_options.profilePath)
+        SetLockProfileRate(g_options.profileRate ? g_options.profileRate : DEFAULT_PROFILE_RATE);
+#endif
+    return true;
+}
+
+static void CloseOutputs()
+{
+    if (g_options.csv)
+        fclose(g_options.csv);
+    if (g_options.json)
+    {
+        fprintf(g_options.json, "\n]\n");
+        fclose(g_options.json);
+    }
+#if defined(RWLOCK_PROFILE)
+    if (g_options.profilePath)
+    {
+        PrintLockProfileTop(stdout, 10);
+        if (!WriteLockProfileCollapsed(g_options.profilePath))
+            fprintf(stderr, "Can't write %s\n", g_options.profilePath);
+    }
+#endif
+}
+
+int main(int argc, char * argv[])
+{
+    // First argument not starting with "--" selects the benchmark
+    const char * mode = argc > 1 && strncmp(argv[1], "--", 2) != 0 ? argv[1] : "";
+    if (argc > 1 && (strcmp(argv[argc - 1], "--help") == 0 || strcmp(argv[argc - 1], "-h") == 0))
+    {
+        PrintUsage();
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[argc - 1], "--list") == 0)
+    {
+        for (unsigned i = 0; i < countof(g_allLocks); i++)
+            printf("%s\n", g_allLocks[i]->GetName());
+        return 0;
+    }
+    if (!ParseOptions(argc, argv, *mode ? 2 : 1))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    InitTest();
+    int result = 0;
+    if (strcmp(mode, "slots") == 0)
+        RunSlotBench();
+    else if (strcmp(mode, "drain") == 0)
+        RunDrainBench();
+    else if (strcmp(mode, "wait") == 0)
+        RunWaitBench();
+    else if (strcmp(mode, "resume") == 0)
+        RunResumeBench();
+    else if (strcmp(mode, "trylock") == 0)
+        RunTryBench();
+    else if (strcmp(mode, "upgrade") == 0)
+        RunUpgradeBench();
+    else if (strcmp(mode, "combine") == 0)
+        RunCombineBench();
+    else if (strcmp(mode, "hybrid") == 0)
+        RunHybridBench();
+    else if (strcmp(mode, "table") == 0)
+        RunTableBench();
+    else if (strcmp(mode, "cohort") == 0)
+        RunCohortBench();
+    else if (strcmp(mode, "rcu") == 0)
+        RunRcuBench();
+    else if (strcmp(mode, "leftright") == 0)
+        RunLeftRightBench();
+    else if (strcmp(mode, "probes") == 0)
+        result = RunProbeTest() ? 0 : 1;
+    else if (strcmp(mode, "shared") == 0)
+        result = RunSharedBench() ? 0 : 1;
+    else if (*mode == 0)
+        RunTests();
+    else
+        PrintUsage();
+    CloseOutputs();
+    Cleanup();
+    return result;
+}
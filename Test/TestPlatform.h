@@ -0,0 +1,322 @@
+/**
+ *      File: TestPlatform.h
+ *    Author: CS Lim
+ *   Purpose: Platform layer of the test program
+ *
+ *   Notes:
+ *      - On Linux the Win32 calls the test uses (threads, events, timers,
+ *        thread CPU time) are implemented with std::thread, std::mutex,
+ *        clock_gettime() and friends, so the benchmarks build unchanged.
+ *      - QueryPerformanceCounter() is CLOCK_MONOTONIC in nanoseconds.
+ *        QueryThreadCycleTime() is CLOCK_THREAD_CPUTIME_ID in nanoseconds,
+ *        so CPU/Op is cycles on Windows but nanoseconds on Linux.
+ *      - PinThread(), ReadTimestamp() and GetResourceUsage() are for both
+ *        platforms.
+ */
+
+#ifndef TESTPLATFORM_H
+#define TESTPLATFORM_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#define CACHE_LINE  64
+
+#if defined(_WIN32)
+
+#define CACHE_ALIGN __declspec(align(CACHE_LINE))
+#define NOVTABLE    __declspec(novtable)
+
+#define strcasecmp  _stricmp
+
+#else
+
+#define CACHE_ALIGN alignas(CACHE_LINE)
+#define NOVTABLE
+
+//===========================================================================
+// Win32 types
+//===========================================================================
+typedef int64_t         __int64;
+typedef uint64_t        ULONG64;
+typedef uint32_t        DWORD;
+typedef void *          LPVOID;
+typedef void *          LPSECURITY_ATTRIBUTES;
+typedef DWORD        (* LPTHREAD_START_ROUTINE)(LPVOID);
+
+#define WINAPI
+#define INFINITE        0xFFFFFFFF
+
+#define THREAD_PRIORITY_ABOVE_NORMAL    1
+#define THREAD_PRIORITY_TIME_CRITICAL   15
+
+struct LARGE_INTEGER {
+    int64_t     QuadPart;
+};
+
+struct SYSTEM_INFO {
+    DWORD       dwNumberOfProcessors;
+};
+
+//===========================================================================
+// Waitable handles (threads and manual/auto reset events)
+//===========================================================================
+struct TestHandle {
+    virtual ~TestHandle() { }
+    virtual void Wait() = 0;
+};
+
+typedef TestHandle * HANDLE;
+
+struct TestThread : TestHandle {
+    std::thread thread;
+
+    ~TestThread()
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+
+    void Wait()
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+};
+
+struct TestEvent : TestHandle {
+    std::mutex              mutex;
+    std::condition_variable signal;
+    bool                    manualReset;
+    bool                    signaled;
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!signaled)
+            signal.wait(lock);
+        if (!manualReset)
+            signaled = false;
+    }
+};
+
+inline HANDLE CreateThread (
+    LPSECURITY_ATTRIBUTES,
+    size_t,
+    LPTHREAD_START_ROUTINE  proc,
+    LPVOID                  param,
+    DWORD,
+    DWORD *                 threadId
+) {
+    TestThread * handle = new TestThread;
+    handle->thread = std::thread(proc, param);
+    if (threadId)
+        *threadId = 0;
+    return handle;
+}
+
+inline HANDLE CreateEvent (LPSECURITY_ATTRIBUTES, bool manualReset, bool initialState, const char *)
+{
+    TestEvent * handle = new TestEvent;
+    handle->manualReset = manualReset;
+    handle->signaled = initialState;
+    return handle;
+}
+
+inline bool SetEvent (HANDLE handle)
+{
+    TestEvent * event = static_cast<TestEvent *>(handle);
+    std::lock_guard<std::mutex> lock(event->mutex);
+    event->signaled = true;
+    event->signal.notify_all();
+    return true;
+}
+
+inline bool ResetEvent (HANDLE handle)
+{
+    TestEvent * event = static_cast<TestEvent *>(handle);
+    std::lock_guard<std::mutex> lock(event->mutex);
+    event->signaled = false;
+    return true;
+}
+
+inline DWORD WaitForSingleObject (HANDLE handle, DWORD ms)
+{
+    // Only waiting forever is used
+    _ASSERT(ms == INFINITE);
+    handle->Wait();
+    return 0;
+}
+
+inline DWORD WaitForMultipleObjects (DWORD count, const HANDLE * handles, bool waitAll, DWORD ms)
+{
+    _ASSERT(waitAll && ms == INFINITE);
+    for (DWORD i = 0; i < count; i++)
+        handles[i]->Wait();
+    return 0;
+}
+
+inline bool CloseHandle (HANDLE handle)
+{
+    delete handle;
+    return true;
+}
+
+//===========================================================================
+// Threads
+//===========================================================================
+inline HANDLE GetCurrentThread ()
+{
+    // Pseudo handle, only passed back to the functions below
+    return NULL;
+}
+
+inline bool SetThreadPriority (HANDLE, int)
+{
+    // Needs privileges on Linux, run at normal priority
+    return true;
+}
+
+inline void Sleep (DWORD ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void GetSystemInfo (SYSTEM_INFO * info)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    info->dwNumberOfProcessors = count > 0 ? (DWORD)count : 1;
+}
+
+//===========================================================================
+// Timers
+//===========================================================================
+inline bool QueryPerformanceCounter (LARGE_INTEGER * counter)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    counter->QuadPart = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return true;
+}
+
+inline bool QueryPerformanceFrequency (LARGE_INTEGER * frequency)
+{
+    frequency->QuadPart = 1000000000;
+    return true;
+}
+
+inline bool QueryThreadCycleTime (HANDLE, ULONG64 * cycles)
+{
+    // Calling thread only (GetCurrentThread())
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    *cycles = (ULONG64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    return true;
+}
+
+//===========================================================================
+// Memory
+//===========================================================================
+#define ZeroMemory(dest, size)  memset((dest), 0, (size))
+#define MemoryBarrier()         std::atomic_thread_fence(std::memory_order_seq_cst)
+
+inline void * _aligned_malloc (size_t size, size_t alignment)
+{
+    void * mem;
+    if (posix_memalign(&mem, alignment, size))
+        return NULL;
+    return mem;
+}
+
+inline void _aligned_free (void * mem)
+{
+    free(mem);
+}
+
+#endif
+
+//===========================================================================
+// Thread pinning
+//===========================================================================
+inline bool PinThread (HANDLE thread, unsigned cpu)
+{
+#if defined(_WIN32)
+    return SetThreadAffinityMask(thread, (DWORD_PTR)1 << (cpu % (sizeof(DWORD_PTR) * 8))) != 0;
+#else
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu % CPU_SETSIZE, &cpus);
+    std::thread & handle = static_cast<TestThread *>(thread)->thread;
+    return pthread_setaffinity_np(handle.native_handle(), sizeof(cpus), &cpus) == 0;
+#endif
+}
+
+//===========================================================================
+// Timestamp counter for per-operation latency
+//  rdtsc where available, a few ns per read. Ticks per second is
+//  calibrated once against QueryPerformanceCounter().
+//===========================================================================
+inline uint64_t ReadTimestamp ()
+{
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(_WIN32)
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)counter.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+inline double GetTimestampFreq ()
+{
+    static double s_freq;
+    if (s_freq == 0)
+    {
+        LARGE_INTEGER freq, start, end;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&start);
+        uint64_t ticks = ReadTimestamp();
+        Sleep(50);
+        ticks = ReadTimestamp() - ticks;
+        QueryPerformanceCounter(&end);
+        s_freq = (double)ticks * freq.QuadPart / (double)(end.QuadPart - start.QuadPart);
+    }
+    return s_freq;
+}
+
+//===========================================================================
+// Process resource usage
+//===========================================================================
+struct ResourceUsage {
+    double      userSeconds;
+    double      systemSeconds;
+    uint64_t    voluntarySwitches;      // Not available on Windows
+    uint64_t    involuntarySwitches;    // Not available on Windows
+};
+
+inline void GetResourceUsage (ResourceUsage * usage)
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+    usage->userSeconds = (((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime) / 1e7;
+    usage->systemSeconds = (((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) / 1e7;
+    usage->voluntarySwitches = 0;
+    usage->involuntarySwitches = 0;
+#else
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    usage->userSeconds = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    usage->systemSeconds = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    usage->voluntarySwitches = (uint64_t)ru.ru_nvcsw;
+    usage->involuntarySwitches = (uint64_t)ru.ru_nivcsw;
+#endif
+}
+
+
+#endif /* TESTPLATFORM_H */
@@ -7,7 +7,10 @@
 
 // System includes
 
-#define NTDDI_VERSION _WIN32_WINNT_VISTA
+#if defined(_WIN32)
+
+#define NTDDI_VERSION   NTDDI_WIN8
+#define _WIN32_WINNT    _WIN32_WINNT_WIN8
 #include <SDKDDKVer.h>
 
 #define STRICT
@@ -15,17 +18,78 @@
 #include <windows.h>
 #include <winbase.h>
 #include <intrin.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <crtdbg.h>
 
+#else
+
+#include <assert.h>
+#include <elf.h>
+#include <limits.h>
+#include <link.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ucontext.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#endif
+
 // STL headers
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// std::shared_mutex baseline (C++17)
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <shared_mutex>
+#define RWLOCKTEST_SHARED_MUTEX
+#endif
 
 // Project includes
-#include "Random\randomc.h"
+#include "Random/randomc.h"
 #include <Common.h>
 #include <RWLock.h>
+#include <LockStats.h>
+#include <LockProfiler.h>
+#include <LockProbes.h>
 #include <RWLock2.h>
-
+#include <HybridRWLock.h>
+#include <RWLockTable.h>
+#include <BravoRWLock.h>
+#include <CohortRWLock.h>
+#include <RCU.h>
+#include <LeftRight.h>
+#include <AsymRWLock.h>
+#include <PhaseFairRWLock.h>
+#include <SharedRWLock.h>
+#include "TestPlatform.h"
+#include "LatencyHistogram.h"
+#include "ProbeTracer.h"
\ No newline at end of file
@@ -7,6 +7,27 @@ set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -std=c++11")
 # C++14: set(CMAKE_CXX_FLAGS "${CMAKE_CXX_FLAGS} -std=c++1y")
 
 
+# Lock contention statistics (include/LockStats.h). Changes the layout of
+# the lock classes, so the library and the test must agree.
+option(RWLOCK_STATS "Per-thread lock contention statistics" OFF)
+if(RWLOCK_STATS)
+    add_definitions(-DRWLOCK_STATS)
+endif()
+
+# Sampling hold time profiler of CRWLock (include/LockProfiler.h). Costs a
+# thread local decrement per lock call even while sampling is off.
+option(RWLOCK_PROFILE "Sampling lock hold time profiler" OFF)
+if(RWLOCK_PROFILE)
+    add_definitions(-DRWLOCK_PROFILE)
+endif()
+
+# USDT probes of the locks (include/LockProbes.h), a nop each until traced
+option(RWLOCK_PROBES "USDT static tracepoints on Linux" ON)
+if(NOT RWLOCK_PROBES)
+    add_definitions(-DRWLOCK_NO_PROBES)
+endif()
+
+
 #
 # Platfor specific flags
 #
@@ -39,7 +60,7 @@ elseif(${UNIX})
 
     # These are all required on Xcode 4.5.1 + iOS, because the defaults are no good.
     set(CMAKE_C_FLAGS "-pthread -g")
-    set(CMAKE_CXX_FLAGS "-pthread -g")
+    set(CMAKE_CXX_FLAGS "-std=c++11 -pthread -g")
     set(CMAKE_C_FLAGS_DEBUG "-O0")
     set(CMAKE_CXX_FLAGS_DEBUG "-O0")
     set(CMAKE_C_FLAGS_RELEASE "-Os")
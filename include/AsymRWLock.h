@@ -0,0 +1,312 @@
+/**
+ *      File: AsymRWLock.h
+ *    Author: CS Lim
+ *   Purpose: Header-only asymmetric reader writer lock with compile-time
+ *            policies, so the reader fast path inlines into the caller
+ *
+ *   Notes:
+ *      - Same algorithm as CRWLock: a reader sets its own flag and checks
+ *        m_writerPending, the writer sets m_writerPending, issues the
+ *        barrier and waits for the flags to clear.
+ *      - EnterRead()/LeaveRead() fast paths are inline. Waiting, the shared
+ *        reader counter and the writer's drain are RWLOCK_NOINLINE so they
+ *        don't bloat the callers.
+ *      - MaxReaders flags are embedded in the lock. Threads with a thread
+ *        index beyond (see GetRWLockThreadIndex()) fall back to a shared
+ *        reader counter (one atomic add per read) instead of allocating.
+ *      - W -> R is allowed. W -> W and R -> W are "NOT" supported.
+ *
+ *   Policies:
+ *      WaitPolicy      static void Wait(unsigned iteration), called while
+ *                      a reader waits for the writer or the writer for a
+ *                      reader. RWLockSpinWait, RWLockYieldWait.
+ *      BarrierPolicy   static void ReaderFence() between the reader's flag
+ *                      store and m_writerPending load, static void
+ *                      WriterFence() between the writer's m_writerPending
+ *                      store and flag loads. RWLockProcessBarrier
+ *                      (asymmetric), RWLockFenceBarrier (symmetric).
+ *      StatsPolicy     Base class notified of slow path events.
+ *                      RWLockNoStats, RWLockCountStats.
+ */
+
+#ifndef CASYMRWLOCK_H
+#define CASYMRWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+// Pause instructions before RWLockSpinWait starts yielding
+const unsigned RWLOCK_SPIN_WAIT_LIMIT = 256;
+
+//===========================================================================
+// Wait policies
+//===========================================================================
+struct RWLockSpinWait {
+    static void Wait(unsigned iteration) {
+        if (iteration < RWLOCK_SPIN_WAIT_LIMIT)
+            YieldProcessor();
+        else
+            SwitchToThread();
+    }
+};
+
+struct RWLockYieldWait {
+    static void Wait(unsigned) {
+        SwitchToThread();
+    }
+};
+
+//===========================================================================
+// Barrier policies
+//===========================================================================
+
+// Reader: compiler barrier only. Writer: FlushProcessWriteBuffers().
+struct RWLockProcessBarrier {
+    static void ReaderFence() {
+        _ReadWriteBarrier();
+    }
+    static void WriterFence() {
+        FlushProcessWriteBuffers();
+    }
+};
+
+// Full fence on both sides. For comparison, and for processes where the
+// writer's barrier is too expensive.
+struct RWLockFenceBarrier {
+    static void ReaderFence() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    static void WriterFence() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+};
+
+//===========================================================================
+// Stats policies
+//===========================================================================
+class RWLockNoStats {
+protected:
+    void OnReadWait() { }
+    void OnSharedRead() { }
+    void OnWrite() { }
+    void OnWriteWait(unsigned) { }
+};
+
+class RWLockCountStats {
+private:
+    std::atomic<uint64_t>   m_readWaits;
+    std::atomic<uint64_t>   m_sharedReads;
+    std::atomic<uint64_t>   m_writes;
+    std::atomic<uint64_t>   m_writeWaits;
+
+protected:
+    RWLockCountStats() : m_readWaits(0), m_sharedReads(0), m_writes(0), m_writeWaits(0) { }
+    void OnReadWait() { m_readWaits.fetch_add(1, std::memory_order_relaxed); }
+    void OnSharedRead() { m_sharedReads.fetch_add(1, std::memory_order_relaxed); }
+    void OnWrite() { m_writes.fetch_add(1, std::memory_order_relaxed); }
+    void OnWriteWait(unsigned waits) { m_writeWaits.fetch_add(waits, std::memory_order_relaxed); }
+
+public:
+    uint64_t GetReadWaits() const { return m_readWaits.load(std::memory_order_relaxed); }
+    uint64_t GetSharedReads() const { return m_sharedReads.load(std::memory_order_relaxed); }
+    uint64_t GetWrites() const { return m_writes.load(std::memory_order_relaxed); }
+    uint64_t GetWriteWaits() const { return m_writeWaits.load(std::memory_order_relaxed); }
+};
+
+//===========================================================================
+// TAsymRWLock Declaration
+//===========================================================================
+template <
+    unsigned    MaxReaders      = RWLOCK_INLINE_READER_COUNT,
+    class       WaitPolicy      = RWLockSpinWait,
+    class       BarrierPolicy   = RWLockProcessBarrier,
+    class       StatsPolicy     = RWLockNoStats
+>
+class TAsymRWLock : public StatsPolicy {
+private:
+    static_assert(MaxReaders > 1 && MaxReaders <= MAX_RWLOCK_READER_COUNT, "1 < MaxReaders <= MAX_RWLOCK_READER_COUNT");
+
+    CCritSect               m_critSect;
+    std::atomic<bool>       m_writerPending;
+
+    // Thread index of the writer, 0 if none
+    std::atomic<unsigned>   m_ownerThreadId;
+
+    // Readers without a flag (thread index >= MaxReaders)
+    std::atomic<uint32_t>   m_sharedReaders;
+
+    // Private flag for every reader
+    std::atomic<uint8_t>    m_readers[MaxReaders];
+
+    RWLOCK_NOINLINE void EnterReadSlow(unsigned index);
+    RWLOCK_NOINLINE void EnterSharedRead(unsigned index);
+    RWLOCK_NOINLINE void WaitForReaders();
+
+    // Non-copyable
+    TAsymRWLock(const TAsymRWLock &);
+    TAsymRWLock & operator=(const TAsymRWLock &);
+
+public:
+    TAsymRWLock();
+    void EnterRead();
+    void EnterWrite();
+    void LeaveRead();
+    void LeaveWrite();
+};
+
+//===========================================================================
+// TAsymRWLock inline implementation
+//===========================================================================
+#define ASYM_RWLOCK_TEMPLATE \
+    template <unsigned MaxReaders, class WaitPolicy, class BarrierPolicy, class StatsPolicy>
+#define ASYM_RWLOCK \
+    TAsymRWLock<MaxReaders, WaitPolicy, BarrierPolicy, StatsPolicy>
+
+ASYM_RWLOCK_TEMPLATE
+ASYM_RWLOCK::TAsymRWLock() {
+    m_writerPending.store(false, std::memory_order_relaxed);
+    m_ownerThreadId.store(0, std::memory_order_relaxed);
+    m_sharedReaders.store(0, std::memory_order_relaxed);
+    for (unsigned i = 0; i < MaxReaders; i++)
+        m_readers[i].store(0, std::memory_order_relaxed);
+}
+
+ASYM_RWLOCK_TEMPLATE
+inline void ASYM_RWLOCK::EnterRead() {
+    unsigned index = GetRWLockThreadIndex();
+    if (index >= MaxReaders) {
+        EnterSharedRead(index);
+        return;
+    }
+
+    m_readers[index].store(1, std::memory_order_relaxed);
+    BarrierPolicy::ReaderFence();
+    if (m_writerPending.load(std::memory_order_acquire))
+        EnterReadSlow(index);
+}
+
+ASYM_RWLOCK_TEMPLATE
+inline void ASYM_RWLOCK::LeaveRead() {
+    unsigned index = t_rwlockThreadIndex;
+    _ASSERT(index != 0);
+    if (index >= MaxReaders)
+        m_sharedReaders.fetch_sub(1, std::memory_order_release);
+    else
+        m_readers[index].store(0, std::memory_order_release);
+}
+
+ASYM_RWLOCK_TEMPLATE
+void ASYM_RWLOCK::EnterReadSlow(unsigned index) {
+    std::atomic<uint8_t> & flag = m_readers[index];
+    for (;;) {
+        // W -> R
+        if (m_ownerThreadId.load(std::memory_order_relaxed) == index)
+            return;
+
+        // Back off so the writer can drain, wait and try again
+        flag.store(0, std::memory_order_release);
+        StatsPolicy::OnReadWait();
+        for (unsigned i = 0; m_writerPending.load(std::memory_order_acquire); i++)
+            WaitPolicy::Wait(i);
+
+        flag.store(1, std::memory_order_relaxed);
+        BarrierPolicy::ReaderFence();
+        if (!m_writerPending.load(std::memory_order_acquire))
+            return;
+    }
+}
+
+ASYM_RWLOCK_TEMPLATE
+void ASYM_RWLOCK::EnterSharedRead(unsigned index) {
+    StatsPolicy::OnSharedRead();
+    for (;;) {
+        // seq_cst pairs with WriterFence() in EnterWrite()
+        m_sharedReaders.fetch_add(1, std::memory_order_seq_cst);
+        if (!m_writerPending.load(std::memory_order_seq_cst))
+            return;
+        if (m_ownerThreadId.load(std::memory_order_relaxed) == index)
+            return;
+
+        m_sharedReaders.fetch_sub(1, std::memory_order_release);
+        StatsPolicy::OnReadWait();
+        for (unsigned i = 0; m_writerPending.load(std::memory_order_acquire); i++)
+            WaitPolicy::Wait(i);
+    }
+}
+
+ASYM_RWLOCK_TEMPLATE
+void ASYM_RWLOCK::WaitForReaders() {
+    unsigned waits = 0;
+
+    unsigned count = GetRWLockThreadHighWater();
+    if (count > MaxReaders)
+        count = MaxReaders;
+
+    unsigned index = FindBusyRWLockReader(m_readers, count);
+    while (index < count) {
+        while (m_readers[index].load(std::memory_order_acquire))
+            WaitPolicy::Wait(waits++);
+        index++;
+        index += FindBusyRWLockReader(m_readers + index, count - index);
+    }
+
+    while (m_sharedReaders.load(std::memory_order_acquire))
+        WaitPolicy::Wait(waits++);
+
+    StatsPolicy::OnWriteWait(waits);
+}
+
+ASYM_RWLOCK_TEMPLATE
+void ASYM_RWLOCK::EnterWrite() {
+    unsigned index = GetRWLockThreadIndex();
+    m_critSect.Enter();
+    m_ownerThreadId.store(index, std::memory_order_relaxed);
+    m_writerPending.store(true, std::memory_order_relaxed);
+
+    // Here we are sure that:
+    //       (1) writer will see (m_readers[i]    == true)
+    //    or (2) reader will see (m_writerPending == true)
+    BarrierPolicy::WriterFence();
+    WaitForReaders();
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    StatsPolicy::OnWrite();
+}
+
+ASYM_RWLOCK_TEMPLATE
+inline void ASYM_RWLOCK::LeaveWrite() {
+    m_ownerThreadId.store(0, std::memory_order_relaxed);
+    m_writerPending.store(false, std::memory_order_release);
+    m_critSect.Leave();
+}
+
+#undef ASYM_RWLOCK_TEMPLATE
+#undef ASYM_RWLOCK
+
+
+#endif /* CASYMRWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,188 @@
+/**
+ *      File: BravoRWLock.h
+ *    Author: CS Lim
+ *   Purpose: Reader bias wrapper for any reader writer lock
+ *            (BRAVO, Dice & Kogan, "BRAVO - Biased Locking for
+ *            Reader-Writer Locks", USENIX ATC 2019)
+ *
+ *   Notes:
+ *      - While reader bias is on, a reader publishes the lock's address in
+ *        one slot of a global table, hashed by (lock, thread), and doesn't
+ *        touch the underlying lock at all.
+ *      - Writer takes the underlying lock, turns bias off and waits until
+ *        no table slot points to the lock any more (revocation).
+ *      - A slow-path reader turns bias back on once the inhibit time has
+ *        passed, BRAVO_INHIBIT_MULTIPLIER times the last revocation time.
+ *      - Readers that find their slot taken use the underlying lock.
+ *      - R -> R on the same lock is "NOT" supported. Inner read goes slow
+ *        path and deadlocks with a writer waiting for the outer one.
+ *      - W -> R works if the underlying lock supports it (CRWLock). The
+ *        writer's read goes slow path and leaves bias off.
+ */
+
+#ifndef CBRAVORWLOCK_H
+#define CBRAVORWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+// Slots of the global visible readers table
+const unsigned BRAVO_TABLE_SIZE = 4096;
+
+// Bias stays off for this many times the last revocation time
+const unsigned BRAVO_INHIBIT_MULTIPLIER = 9;
+
+//===========================================================================
+// Visible readers table (BravoRWLock.cpp)
+//===========================================================================
+// Publish a fast-path read of lock. False if the slot is in use.
+bool BravoPublish(const void * lock);
+
+// Withdraw a fast-path read. False if this thread has none for lock.
+bool BravoWithdraw(const void * lock);
+
+// Wait until no reader has lock published
+void BravoRevoke(const void * lock);
+
+// Identifies the calling thread
+const void * BravoThreadId();
+
+//===========================================================================
+// CCritSect with reader writer interface, exclusive for readers too
+//===========================================================================
+class CCritSectRWLock {
+private:
+    CCritSect   m_lock;
+
+public:
+    void EnterRead ()   { m_lock.Enter(); }
+    void LeaveRead ()   { m_lock.Leave(); }
+    void EnterWrite ()  { m_lock.Enter(); }
+    void LeaveWrite ()  { m_lock.Leave(); }
+};
+
+//===========================================================================
+// TBravoRWLock Declaration
+//===========================================================================
+template <class Lock>
+class TBravoRWLock {
+private:
+    Lock                        m_lock;
+    std::atomic<bool>           m_readBias;
+
+    // Bias stays off until then (LockClock ticks)
+    std::atomic<LockClock::rep> m_inhibitUntil;
+
+    // BravoThreadId() of the writer, NULL if none
+    std::atomic<const void *>   m_writer;
+
+    // Non-copyable
+    TBravoRWLock(const TBravoRWLock &);
+    TBravoRWLock & operator=(const TBravoRWLock &);
+
+public:
+    TBravoRWLock();
+    void EnterRead();
+    void LeaveRead();
+    void EnterWrite();
+    void LeaveWrite();
+
+    bool IsReadBiased() const;
+};
+
+//===========================================================================
+// TBravoRWLock inline implementation
+//===========================================================================
+template <class Lock>
+TBravoRWLock<Lock>::TBravoRWLock() {
+    m_readBias = true;
+    m_inhibitUntil = 0;
+    m_writer = NULL;
+}
+
+template <class Lock>
+void TBravoRWLock<Lock>::EnterRead() {
+    if (m_readBias.load(std::memory_order_relaxed)) {
+        // seq_cst pairs with EnterWrite(): either the writer sees our slot
+        // or we see bias turned off
+        if (BravoPublish(this)) {
+            if (m_readBias.load(std::memory_order_seq_cst))
+                return;
+            BravoWithdraw(this);
+        }
+    }
+
+    m_lock.EnterRead();
+
+    // Turn bias back on. No writer can be revoking while we hold the lock,
+    // unless we are that writer (W -> R): then fast-path readers would
+    // get in alongside us.
+    if (!m_readBias.load(std::memory_order_relaxed)
+        && m_writer.load(std::memory_order_relaxed) != BravoThreadId()) {
+        LockClock::rep now = LockClock::now().time_since_epoch().count();
+        if (now >= m_inhibitUntil.load(std::memory_order_relaxed))
+            m_readBias.store(true, std::memory_order_relaxed);
+    }
+}
+
+template <class Lock>
+void TBravoRWLock<Lock>::LeaveRead() {
+    if (!BravoWithdraw(this))
+        m_lock.LeaveRead();
+}
+
+template <class Lock>
+void TBravoRWLock<Lock>::EnterWrite() {
+    m_lock.EnterWrite();
+    m_writer.store(BravoThreadId(), std::memory_order_relaxed);
+
+    if (m_readBias.load(std::memory_order_relaxed)) {
+        LockClock::time_point start = LockClock::now();
+        m_readBias.store(false, std::memory_order_seq_cst);
+        BravoRevoke(this);
+
+        // Keep bias off long enough to amortize what revocation cost
+        LockClock::time_point now = LockClock::now();
+        LockClock::time_point until = now + (now - start) * BRAVO_INHIBIT_MULTIPLIER;
+        m_inhibitUntil.store(until.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+}
+
+template <class Lock>
+void TBravoRWLock<Lock>::LeaveWrite() {
+    m_writer.store(NULL, std::memory_order_relaxed);
+    m_lock.LeaveWrite();
+}
+
+template <class Lock>
+bool TBravoRWLock<Lock>::IsReadBiased() const {
+    return m_readBias.load(std::memory_order_relaxed);
+}
+
+
+#endif /* CBRAVORWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,127 @@
+/**
+ *      File: CohortRWLock.h
+ *    Author: CS Lim
+ *   Purpose: NUMA-aware cohort reader writer lock
+ *            (Calciu et al., "NUMA-Aware Reader-Writer Locks", PPoPP 2013)
+ */
+
+#ifndef CCOHORTRWLOCK_H
+#define CCOHORTRWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+// Most NUMA nodes detected
+const unsigned MAX_NUMA_NODES = 64;
+
+// Writer lock handoffs within a node before it must go to another node
+const unsigned COHORT_MAX_LOCAL_HANDOFFS = 64;
+
+//===========================================================================
+// CNumaTopology
+//  Processor to node map from /sys/devices/system/node (Linux) or the
+//  NUMA API (Windows). A fake topology spreads threads round robin over
+//  the given number of nodes regardless of processor, so multi-node code
+//  paths run on single socket hosts too.
+//===========================================================================
+class CNumaTopology {
+private:
+    unsigned    m_nodeCount;
+    unsigned    m_cpuCount;
+    uint8_t *   m_cpuNode;
+    bool        m_fake;
+
+    void Detect();
+
+    // Non-copyable
+    CNumaTopology(const CNumaTopology &);
+    CNumaTopology & operator=(const CNumaTopology &);
+
+public:
+    // fakeNodes == 0 detects the real topology
+    CNumaTopology(unsigned fakeNodes = 0);
+    ~CNumaTopology();
+
+    // Real topology, or fake one if RWLOCK_FAKE_NUMA_NODES is set
+    static const CNumaTopology & System();
+
+    unsigned GetNodeCount() const;
+    bool IsFake() const;
+    unsigned GetCurrentNode() const;
+};
+
+//===========================================================================
+// CCohortRWLock Declaration
+//  Per-node reader counters and a cohort writer lock: a per-node local
+//  lock plus a global lock that stays on a node while writers of that
+//  node are waiting, up to COHORT_MAX_LOCAL_HANDOFFS times. Writer
+//  preference: readers back off while a writer is active.
+//===========================================================================
+class CCohortRWLock {
+private:
+    struct NodeState;
+
+    const CNumaTopology &   m_topology;
+    NodeState *             m_nodes;
+
+    // Global writer lock, passed between writers of a node.
+    // 0 free, 1 locked, 2 locked with sleepers.
+    std::atomic<uint32_t>   m_globalLock;
+
+    // Set while writers (of one cohort) own the lock
+    std::atomic<uint32_t>   m_writerActive;
+    std::atomic<uint32_t>   m_readersWaiting;
+
+    // Node of the current writer
+    unsigned                m_writerNode;
+
+    // Handoff counters
+    std::atomic<uint64_t>   m_localHandoffs;
+    std::atomic<uint64_t>   m_globalHandoffs;
+
+    void AcquireGlobal();
+    void ReleaseGlobal();
+
+    // Non-copyable
+    CCohortRWLock(const CCohortRWLock &);
+    CCohortRWLock & operator=(const CCohortRWLock &);
+
+public:
+    CCohortRWLock(const CNumaTopology & topology = CNumaTopology::System());
+    ~CCohortRWLock();
+    void EnterRead();
+    void EnterWrite();
+    void LeaveRead();
+    void LeaveWrite();
+
+    uint64_t GetLocalHandoffs() const;
+    uint64_t GetGlobalHandoffs() const;
+};
+
+
+#endif /* CCOHORTRWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
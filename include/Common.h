@@ -15,6 +15,22 @@
 
 const unsigned CACHELINE_SIZE = 64;
 
+// Clock of the deadlines taken by timed lock acquisition
+typedef std::chrono::steady_clock LockClock;
+
+#if defined(_WIN32)
+
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+// VS2013 (v120 toolset) has no C++11 thread_local keyword
+#define thread_local __declspec(thread)
+#endif
+
+// Keeps slow paths out of inlined fast paths
+#define RWLOCK_NOINLINE         __declspec(noinline)
+
+// Return address of the current function (call site of the caller)
+#define RWLOCK_RETURN_ADDRESS() _ReturnAddress()
+
 inline long AtomicIncrement (long volatile * addend)
 {
     // Returns the resulting incremented value
@@ -27,6 +43,187 @@ inline long AtomicDecrement (long volatile * addend)
     return _InterlockedDecrement(addend);
 }
 
+//===========================================================================
+// Futex helpers (WaitOnAddress API, Windows 8 and later)
+//===========================================================================
+#if defined(_MSC_VER)
+#pragma comment(lib, "Synchronization.lib")
+#endif
+
+inline void FutexWait (std::atomic<uint32_t> * addr, uint32_t expected)
+{
+    // Returns immediately if *addr != expected
+    WaitOnAddress(addr, &expected, sizeof(expected), INFINITE);
+}
+
+inline void FutexWaitUntil (
+    std::atomic<uint32_t> *         addr,
+    uint32_t                        expected,
+    const LockClock::time_point &   deadline
+) {
+    LockClock::time_point now = LockClock::now();
+    if (deadline <= now)
+        return;
+
+    // Round up so we don't wake up just before the deadline
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - now + std::chrono::milliseconds(1) - LockClock::duration(1)
+    ).count();
+    if (ms >= (long long)INFINITE)
+        ms = INFINITE - 1;
+    WaitOnAddress(addr, &expected, sizeof(expected), (DWORD)ms);
+}
+
+inline void FutexWakeAll (std::atomic<uint32_t> * addr)
+{
+    WakeByAddressAll(addr);
+}
+
+#else
+
+inline long AtomicIncrement (long volatile * addend)
+{
+    // Returns the resulting incremented value
+    return __sync_add_and_fetch(addend, 1);
+}
+
+inline long AtomicDecrement (long volatile * addend)
+{
+    // Returns the resulting incremented value
+    return __sync_sub_and_fetch(addend, 1);
+}
+
+//===========================================================================
+// Win32 compatibility for Linux builds
+//===========================================================================
+#define _ASSERT(expr)           assert(expr)
+
+// Compiler-only barrier, same as MSVC's _ReadWriteBarrier() intrinsic
+#define _ReadWriteBarrier()     std::atomic_signal_fence(std::memory_order_seq_cst)
+
+// Keeps slow paths out of inlined fast paths
+#define RWLOCK_NOINLINE         __attribute__((noinline))
+
+// Return address of the current function (call site of the caller)
+#define RWLOCK_RETURN_ADDRESS() __builtin_return_address(0)
+
+// pthread_mutex_clocklock() is in glibc 2.30 and later. Nested, an undefined
+// function-like macro is a syntax error even after a false &&.
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 30)
+#define RWLOCK_HAVE_CLOCKLOCK
+#endif
+#endif
+
+inline int SwitchToThread ()
+{
+    return sched_yield() == 0;
+}
+
+// Spin-wait hint (pause)
+inline void YieldProcessor ()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Process-wide memory barrier. Implemented with
+// membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED) in Common.cpp
+void FlushProcessWriteBuffers ();
+
+inline unsigned GetCurrentProcessorNumber ()
+{
+#if defined(RWLOCK_HAVE_RSEQ)
+    // glibc registered rseq area of this thread. Kernel keeps cpu_id up to
+    // date on every preemption, so reading it costs no syscall at all.
+    if (__rseq_size != 0) {
+        int cpu = ((struct rseq volatile *)
+            ((char *)__builtin_thread_pointer() + __rseq_offset))->cpu_id;
+        if (cpu >= 0)
+            return (unsigned)cpu;
+    }
+#endif
+    return (unsigned)sched_getcpu();
+}
+
+//===========================================================================
+// Futex helpers
+//===========================================================================
+inline void FutexWait (std::atomic<uint32_t> * addr, uint32_t expected)
+{
+    // Returns immediately if *addr != expected
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+inline void FutexWaitUntil (
+    std::atomic<uint32_t> *         addr,
+    uint32_t                        expected,
+    const LockClock::time_point &   deadline
+) {
+    if (deadline <= LockClock::now())
+        return;
+
+    // steady_clock is CLOCK_MONOTONIC, the clock FUTEX_WAIT_BITSET uses
+    // for its absolute timeout
+    std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        deadline.time_since_epoch()
+    );
+    struct timespec ts;
+    ts.tv_sec  = (time_t)(ns.count() / 1000000000);
+    ts.tv_nsec = (long)(ns.count() % 1000000000);
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, expected, &ts, NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+inline void FutexWakeAll (std::atomic<uint32_t> * addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
+
+
+// Index of lowest set bit. Value must not be zero.
+inline unsigned CountTrailingZeros (uint32_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
+
+//===========================================================================
+// Cache line aligned allocation
+//  Throws std::bad_alloc instead of returning NULL. Free with AlignedFree().
+//===========================================================================
+inline void * AlignedAlloc (size_t size)
+{
+#if defined(_WIN32)
+    void * mem = _aligned_malloc(size, CACHELINE_SIZE);
+#else
+    void * mem;
+    if (posix_memalign(&mem, CACHELINE_SIZE, size) != 0)
+        mem = NULL;
+#endif
+    if (mem == NULL)
+        throw std::bad_alloc();
+    return mem;
+}
+
+inline void AlignedFree (void * mem)
+{
+#if defined(_WIN32)
+    _aligned_free(mem);
+#else
+    free(mem);
+#endif
+}
 
 //===========================================================================
 // Simple Win32 Crtical Section wrapper class
@@ -34,18 +231,27 @@ inline long AtomicDecrement (long volatile * addend)
 class CCritSect
 {
 private:
+#if defined(_WIN32)
     CRITICAL_SECTION    m_crit;
+#else
+    // Recursive like CRITICAL_SECTION
+    pthread_mutex_t     m_crit;
+#endif
 
 public:
     CCritSect ();
     ~CCritSect ();
     void Enter ();
+    bool TryEnter ();
+    bool EnterUntil (const LockClock::time_point & deadline);
     void Leave ();
 };
 
 //===========================================================================
 // CCritSect inline implementation
 //===========================================================================
+#if defined(_WIN32)
+
 inline CCritSect::CCritSect ()
 {
     InitializeCriticalSection(&m_crit);
@@ -61,11 +267,246 @@ inline void CCritSect::Enter ()
     EnterCriticalSection(&m_crit);
 }
 
+inline bool CCritSect::TryEnter ()
+{
+    return TryEnterCriticalSection(&m_crit) != FALSE;
+}
+
+inline bool CCritSect::EnterUntil (const LockClock::time_point & deadline)
+{
+    // CRITICAL_SECTION has no timed wait
+    for (unsigned tries = 0; !TryEnter(); tries++) {
+        if (LockClock::now() >= deadline)
+            return false;
+        if (tries < 16)
+            SwitchToThread();
+        else
+            Sleep(1);
+    }
+    return true;
+}
+
 inline void CCritSect::Leave ()
 {
     LeaveCriticalSection(&m_crit);
 }
 
+#else
+
+inline CCritSect::CCritSect ()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&m_crit, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+inline CCritSect::~CCritSect ()
+{
+    pthread_mutex_destroy(&m_crit);
+}
+
+inline void CCritSect::Enter ()
+{
+    pthread_mutex_lock(&m_crit);
+}
+
+inline bool CCritSect::TryEnter ()
+{
+    return pthread_mutex_trylock(&m_crit) == 0;
+}
+
+inline bool CCritSect::EnterUntil (const LockClock::time_point & deadline)
+{
+    if (TryEnter())
+        return true;
+    if (deadline <= LockClock::now())
+        return false;
+
+#if !defined(RWLOCK_HAVE_CLOCKLOCK)
+    // No pthread_mutex_clocklock()
+    while (LockClock::now() < deadline) {
+        SwitchToThread();
+        if (TryEnter())
+            return true;
+    }
+    return false;
+#else
+    std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        deadline.time_since_epoch()
+    );
+    struct timespec ts;
+    ts.tv_sec  = (time_t)(ns.count() / 1000000000);
+    ts.tv_nsec = (long)(ns.count() % 1000000000);
+    return pthread_mutex_clocklock(&m_crit, CLOCK_MONOTONIC, &ts) == 0;
+#endif
+}
+
+inline void CCritSect::Leave ()
+{
+    pthread_mutex_unlock(&m_crit);
+}
+
+#endif
+
+
+//===========================================================================
+// Futex based shared/exclusive lock word (Linux counterpart of SRWLOCK)
+//  Also builds on Windows on top of WaitOnAddress.
+//===========================================================================
+class CFutexRWLock
+{
+private:
+    enum : uint32_t {
+        WRITER      = 0x80000000,
+        WAITERS     = 0x40000000,   // Someone sleeps on m_state
+        READER_MASK = 0x3fffffff,
+    };
+
+    // Writer bit, waiters bit and number of readers in a single word
+    std::atomic<uint32_t>   m_state;
+
+    // NULL deadline to wait forever
+    bool Wait (uint32_t state, const LockClock::time_point * deadline);
+    bool EnterRead (const LockClock::time_point * deadline);
+    bool EnterWrite (const LockClock::time_point * deadline);
+
+public:
+    CFutexRWLock ();
+    void EnterRead ();
+    void LeaveRead ();
+    void EnterWrite ();
+    void LeaveWrite ();
+
+    bool TryEnterRead ();
+    bool TryEnterWrite ();
+    bool EnterReadUntil (const LockClock::time_point & deadline);
+    bool EnterWriteUntil (const LockClock::time_point & deadline);
+};
+
+//===========================================================================
+// CFutexRWLock inline implementation
+//===========================================================================
+inline CFutexRWLock::CFutexRWLock ()
+    : m_state(0)
+{
+}
+
+inline bool CFutexRWLock::Wait (uint32_t state, const LockClock::time_point * deadline)
+{
+    // A waiter that gives up leaves WAITERS set. The lock holder clears it
+    // on release, so at worst it costs one extra wake.
+    if (deadline == NULL) {
+        FutexWait(&m_state, state);
+        return true;
+    }
+    if (LockClock::now() >= *deadline)
+        return false;
+    FutexWaitUntil(&m_state, state, *deadline);
+    return true;
+}
+
+inline bool CFutexRWLock::EnterRead (const LockClock::time_point * deadline)
+{
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    for (;;) {
+        // New readers also stay away while anyone waits so that a writer
+        // waiting for readers to drain is not starved (like SRWLOCK)
+        if (!(state & (WRITER | WAITERS))) {
+            if (m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+                return true;
+            continue;
+        }
+
+        if (!(state & WAITERS)
+            && !m_state.compare_exchange_weak(state, state | WAITERS, std::memory_order_relaxed))
+            continue;
+
+        if (!Wait(state | WAITERS, deadline))
+            return false;
+        state = m_state.load(std::memory_order_relaxed);
+    }
+}
+
+inline void CFutexRWLock::EnterRead ()
+{
+    EnterRead(NULL);
+}
+
+inline bool CFutexRWLock::TryEnterRead ()
+{
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    while (!(state & (WRITER | WAITERS))) {
+        if (m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
+inline bool CFutexRWLock::EnterReadUntil (const LockClock::time_point & deadline)
+{
+    return EnterRead(&deadline);
+}
+
+inline void CFutexRWLock::LeaveRead ()
+{
+    uint32_t prev = m_state.fetch_sub(1, std::memory_order_release);
+
+    // Last reader out wakes up everyone waiting for the readers to drain
+    if ((prev & (READER_MASK | WAITERS)) == (1 | WAITERS)) {
+        m_state.fetch_and(~WAITERS, std::memory_order_relaxed);
+        FutexWakeAll(&m_state);
+    }
+}
+
+inline bool CFutexRWLock::EnterWrite (const LockClock::time_point * deadline)
+{
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    for (;;) {
+        if (!(state & ~WAITERS)) {
+            // Keep waiters bit. Other sleepers are woken up in LeaveWrite()
+            if (m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire))
+                return true;
+            continue;
+        }
+
+        if (!(state & WAITERS)
+            && !m_state.compare_exchange_weak(state, state | WAITERS, std::memory_order_relaxed))
+            continue;
+
+        if (!Wait(state | WAITERS, deadline))
+            return false;
+        state = m_state.load(std::memory_order_relaxed);
+    }
+}
+
+inline void CFutexRWLock::EnterWrite ()
+{
+    EnterWrite(NULL);
+}
+
+inline bool CFutexRWLock::TryEnterWrite ()
+{
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    while (!(state & ~WAITERS)) {
+        if (m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
+inline bool CFutexRWLock::EnterWriteUntil (const LockClock::time_point & deadline)
+{
+    return EnterWrite(&deadline);
+}
+
+inline void CFutexRWLock::LeaveWrite ()
+{
+    if (m_state.exchange(0, std::memory_order_release) & WAITERS)
+        FutexWakeAll(&m_state);
+}
+
 #endif /* COMMON_H */
 
 //===========================================================================
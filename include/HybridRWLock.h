@@ -0,0 +1,116 @@
+/**
+ *      File: HybridRWLock.h
+ *    Author: CS Lim
+ *   Purpose: Reader writer lock switching between asymmetric (CRWLock)
+ *            and symmetric (shared reader counter) mode by write rate
+ */
+
+#ifndef CHYBRIDRWLOCK_H
+#define CHYBRIDRWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+//===========================================================================
+// Mode switch thresholds of CHybridRWLock
+//  Every windowMs the time writers spent in the barrier and reader drain
+//  is compared with what the reads of the window would have cost in
+//  symmetric mode (reads x readCostNs), in percent. Gap between
+//  symmetricPercent and asymmetricPercent, plus hotWindows and
+//  calmWindows, is the hysteresis.
+//===========================================================================
+struct HybridRWLockPolicy {
+    unsigned    windowMs;           // Sampling window
+    unsigned    readCostNs;         // Extra cost of a symmetric mode read
+    unsigned    symmetricPercent;   // Barrier time to count as hot
+    unsigned    asymmetricPercent;  // Most barrier time to count as calm
+    unsigned    hotWindows;         // Hot windows in a row to leave
+    unsigned    calmWindows;        // Calm windows in a row to go back
+};
+
+extern const HybridRWLockPolicy HYBRID_RWLOCK_DEFAULT;
+
+//===========================================================================
+// CHybridRWLock Declaration
+//===========================================================================
+class CHybridRWLock {
+private:
+    enum : uint32_t {
+        MODE_ASYMMETRIC,
+        MODE_SYMMETRIC,
+    };
+
+    // Writers always hold m_symLock, and m_asymLock too in asymmetric
+    // mode. Mode only changes while both are held for write, so it is
+    // stable for as long as anyone holds the lock.
+    CFutexRWLock            m_symLock;
+    CRWLock                 m_asymLock;
+    std::atomic<uint32_t>   m_mode;
+
+    // Mode switch counters
+    std::atomic<uint64_t>   m_toSymmetric;
+    std::atomic<uint64_t>   m_toAsymmetric;
+
+    // End of last write (LockClock ticks). Lets readers notice writes
+    // have stopped while in symmetric mode.
+    std::atomic<LockClock::rep> m_lastWrite;
+
+    // Reads of the current window, added by readers in batches
+    std::atomic<uint64_t>   m_windowReads;
+
+    // Write rate and barrier cost (changed under the write lock only).
+    // m_barrierNs is the measured cost per write (moving average), to
+    // estimate it in symmetric mode where writers don't pay it.
+    HybridRWLockPolicy      m_policy;
+    LockClock::time_point   m_windowStart;
+    unsigned                m_windowWrites;
+    uint64_t                m_windowBarrierNs;
+    uint64_t                m_barrierNs;
+    unsigned                m_hotWindows;
+    unsigned                m_calmWindows;
+
+    void CountRead();
+    void SampleWriteRate();
+    void SwitchToSymmetric();
+    void SwitchToAsymmetric();
+    void TrySwitchToAsymmetric();
+
+public:
+    CHybridRWLock(const HybridRWLockPolicy & policy = HYBRID_RWLOCK_DEFAULT);
+    void EnterRead();
+    void EnterWrite();
+    void LeaveRead();
+    void LeaveWrite();
+
+    bool IsSymmetric() const;
+    uint64_t GetSymmetricSwitches() const;
+    uint64_t GetAsymmetricSwitches() const;
+};
+
+
+#endif /* CHYBRIDRWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,222 @@
+/**
+ *      File: LeftRight.h
+ *    Author: CS Lim
+ *   Purpose: Left-Right concurrency control for small read-mostly objects
+ *            (Ramalhete & Correia, "Left-Right: A Concurrency Control
+ *            Technique with Wait-Free Population Oblivious Reads")
+ *
+ *   Notes:
+ *      - Two instances of T. Readers never block nor retry: they read the
+ *        instance m_leftRight points to while the writer changes the other
+ *        one, flips m_leftRight, waits for readers to drain and repeats
+ *        the change on the first instance.
+ *      - Reader indicators have the CRWLock layout: one byte per reader
+ *        thread index, first RWLOCK_INLINE_READER_COUNT inline, the rest
+ *        allocated on first use. Readers store to their own byte only,
+ *        the writer pays FlushProcessWriteBuffers() once per write.
+ *      - Write(fn) calls fn once per instance, so fn must make the same
+ *        change to both (no side effects outside the instance).
+ *      - Writers are serialized by a critical section. Read() may nest.
+ */
+
+#ifndef CLEFTRIGHT_H
+#define CLEFTRIGHT_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#include <utility>
+
+//===========================================================================
+// CReaderIndicator
+//  Per-thread reader counters (one byte each) indexed by the CRWLock
+//  thread index. Arrive()/Depart() are plain loads and stores by the
+//  owning thread.
+//===========================================================================
+class CReaderIndicator {
+private:
+    std::atomic<uint8_t>    m_readers[RWLOCK_INLINE_READER_COUNT];
+
+    // Counters for reader slots [RWLOCK_INLINE_READER_COUNT .. MAX_RWLOCK_READER_COUNT)
+    std::atomic<std::atomic<uint8_t> *> m_overflowReaders;
+
+    std::atomic<uint8_t> & ReaderFlag(unsigned index);
+    std::atomic<uint8_t> & OverflowReaderFlag(unsigned index);
+    void WaitForReaders(const std::atomic<uint8_t> * flags, unsigned count) const;
+
+    // Non-copyable
+    CReaderIndicator(const CReaderIndicator &);
+    CReaderIndicator & operator=(const CReaderIndicator &);
+
+public:
+    CReaderIndicator();
+    ~CReaderIndicator();
+
+    void Arrive(unsigned index);
+    void Depart(unsigned index);
+
+    // Wait until every reader that arrived before has departed. Caller
+    // must have called FlushProcessWriteBuffers() after its last store
+    // readers must see.
+    void WaitEmpty() const;
+};
+
+//===========================================================================
+// CLeftRight
+//  Instance selection and writer protocol of TLeftRight, independent of T
+//===========================================================================
+class CLeftRight {
+private:
+    CCritSect               m_writeLock;
+
+    // Instance readers use
+    std::atomic<uint32_t>   m_leftRight;
+
+    // Indicator new readers arrive on
+    std::atomic<uint32_t>   m_versionIndex;
+    CReaderIndicator        m_indicators[2];
+
+protected:
+    struct ReadGuard {
+        CLeftRight &    owner;
+        unsigned        thread;
+        unsigned        version;
+        unsigned        instance;
+
+        ReadGuard(CLeftRight & owner);
+        ~ReadGuard();
+    };
+
+    CLeftRight();
+
+    // Lock writers out, return instance readers don't use
+    unsigned BeginWrite();
+
+    // Point readers at the instance just written, wait until no reader
+    // uses the other one and return it
+    unsigned Publish();
+
+    void EndWrite();
+};
+
+//===========================================================================
+// TLeftRight Declaration
+//===========================================================================
+template <class T>
+class TLeftRight : private CLeftRight {
+private:
+    T       m_instances[2];
+
+    // Non-copyable
+    TLeftRight(const TLeftRight &);
+    TLeftRight & operator=(const TLeftRight &);
+
+public:
+    TLeftRight();
+    explicit TLeftRight(const T & initial);
+
+    // Return fn(const T &), run on an instance no writer touches
+    template <class Fn>
+    auto Read(const Fn & fn) -> decltype(fn(std::declval<const T &>()));
+
+    // Run fn(T &) on both instances, one after another
+    template <class Fn>
+    void Write(const Fn & fn);
+};
+
+//===========================================================================
+// CReaderIndicator inline implementation
+//===========================================================================
+inline std::atomic<uint8_t> & CReaderIndicator::ReaderFlag(unsigned index) {
+    if (index < RWLOCK_INLINE_READER_COUNT)
+        return m_readers[index];
+    return OverflowReaderFlag(index);
+}
+
+inline void CReaderIndicator::Arrive(unsigned index) {
+    std::atomic<uint8_t> & flag = ReaderFlag(index);
+    _ASSERT(flag.load(std::memory_order_relaxed) != 0xff);
+    flag.store(flag.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    // No explicit #StoreLoad, FlushProcessWriteBuffers() of the writer
+    // does it. Only the compiler must keep the caller's loads below.
+    _ReadWriteBarrier();
+}
+
+inline void CReaderIndicator::Depart(unsigned index) {
+    std::atomic<uint8_t> & flag = ReaderFlag(index);
+    _ASSERT(flag.load(std::memory_order_relaxed) != 0);
+    flag.store(flag.load(std::memory_order_relaxed) - 1, std::memory_order_release);
+}
+
+//===========================================================================
+// CLeftRight inline implementation
+//===========================================================================
+inline CLeftRight::ReadGuard::ReadGuard(CLeftRight & owner)
+    : owner(owner)
+{
+    thread = GetRWLockThreadIndex();
+    version = owner.m_versionIndex.load(std::memory_order_relaxed);
+    owner.m_indicators[version].Arrive(thread);
+    instance = owner.m_leftRight.load(std::memory_order_acquire);
+}
+
+inline CLeftRight::ReadGuard::~ReadGuard() {
+    owner.m_indicators[version].Depart(thread);
+}
+
+//===========================================================================
+// TLeftRight inline implementation
+//===========================================================================
+template <class T>
+TLeftRight<T>::TLeftRight() {
+}
+
+template <class T>
+TLeftRight<T>::TLeftRight(const T & initial) {
+    m_instances[0] = initial;
+    m_instances[1] = initial;
+}
+
+template <class T>
+template <class Fn>
+auto TLeftRight<T>::Read(const Fn & fn) -> decltype(fn(std::declval<const T &>())) {
+    ReadGuard guard(*this);
+    return fn((const T &)m_instances[guard.instance]);
+}
+
+template <class T>
+template <class Fn>
+void TLeftRight<T>::Write(const Fn & fn) {
+    fn(m_instances[BeginWrite()]);
+    fn(m_instances[Publish()]);
+    EndWrite();
+}
+
+
+#endif /* CLEFTRIGHT_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,132 @@
+/**
+ *      File: LockProbes.h
+ *    Author: CS Lim
+ *   Purpose: USDT (SystemTap SDT) static tracepoints of the locks
+ *
+ *   Notes:
+ *      - Same ELF note layout as <sys/sdt.h> (.note.stapsdt, provider
+ *        "rwlock"), so perf, bpftrace and SystemTap find the probes, but
+ *        with no dependency on systemtap-sdt-dev headers.
+ *      - A probe site is a single nop until a tracer attaches (and places
+ *        a breakpoint on it). Arguments are only named to the compiler, so
+ *        they cost at most a register that is live anyway.
+ *      - No semaphores: probe arguments must be cheap to have around.
+ *      - Linux on x86-64 and AArch64 with GCC or Clang. Elsewhere, or with
+ *        RWLOCK_NO_PROBES defined (CMake option RWLOCK_PROBES=OFF), the
+ *        macros expand to nothing.
+ *
+ *   Probes (arg0 is always the lock):
+ *      read_acquire(lock, slow)        Read lock taken, slow if a writer
+ *                                      was pending
+ *      read_contend(lock)              Reader starts waiting for a writer
+ *      read_release(lock)              Read lock about to be released
+ *      write_contend(lock, reason)     Writer starts waiting. Reason is
+ *                                      RWLOCK_CONTEND_XXX below.
+ *      barrier(lock)                   Process wide barrier (IPI) issued
+ *      drain_done(lock, spins, yields, parked)
+ *                                      Writer saw all readers leave
+ *      write_acquire(lock)             Write lock taken
+ *      write_release(lock)             Write lock about to be released
+ *
+ *      e.g. bpftrace -p PID -e 'usdt:/path/RWLockTest:rwlock:drain_done
+ *                               { @spins = hist(arg1); }'
+ */
+
+#ifndef CLOCKPROBES_H
+#define CLOCKPROBES_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+// Reasons of write_contend
+enum {
+    RWLOCK_CONTEND_WRITER,      // Another writer (or upgrader) holds the lock
+    RWLOCK_CONTEND_READERS,     // Readers still inside
+    RWLOCK_CONTEND_SHARD,       // Per-processor shard busy (CRWLock2)
+};
+
+#if !defined(RWLOCK_NO_PROBES) && defined(__linux__) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__aarch64__))
+
+#define RWLOCK_HAVE_PROBES
+
+// Probe site (nop) plus its note. Note holds the site address, the link
+// time address of _.stapsdt.base (lets tools adjust for prelinking), no
+// semaphore, then provider, name and argument specs ("8@%rdi").
+#define RWLOCK_PROBE_ASM(name, args)                                    \
+    "990:   nop\n"                                                      \
+    "       .pushsection .note.stapsdt,\"?\",\"note\"\n"                \
+    "       .balign 4\n"                                                \
+    "       .4byte 992f-991f, 994f-993f, 3\n"                           \
+    "991:   .asciz \"stapsdt\"\n"                                       \
+    "992:   .balign 4\n"                                                \
+    "993:   .8byte 990b\n"                                              \
+    "       .8byte _.stapsdt.base\n"                                    \
+    "       .8byte 0\n"                                                 \
+    "       .asciz \"rwlock\"\n"                                        \
+    "       .asciz \"" #name "\"\n"                                     \
+    "       .asciz \"" args "\"\n"                                      \
+    "994:   .balign 4\n"                                                \
+    "       .popsection\n"                                              \
+    "       .ifndef _.stapsdt.base\n"                                   \
+    "       .pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    "       .weak _.stapsdt.base\n"                                     \
+    "       .hidden _.stapsdt.base\n"                                   \
+    "_.stapsdt.base:\n"                                                 \
+    "       .space 1\n"                                                 \
+    "       .size _.stapsdt.base, 1\n"                                  \
+    "       .popsection\n"                                              \
+    "       .endif\n"
+
+// Every argument is passed as 8 bytes unsigned, from a register, memory
+// or an immediate, whatever the compiler has at hand
+#define RWLOCK_PROBE_ARG(a)     "nor" ((uint64_t)(uintptr_t)(a))
+
+#define RWLOCK_PROBE1(name, a1)                                         \
+    __asm__ __volatile__ (RWLOCK_PROBE_ASM(name, "8@%0")                \
+        :: RWLOCK_PROBE_ARG(a1))
+
+#define RWLOCK_PROBE2(name, a1, a2)                                     \
+    __asm__ __volatile__ (RWLOCK_PROBE_ASM(name, "8@%0 8@%1")           \
+        :: RWLOCK_PROBE_ARG(a1), RWLOCK_PROBE_ARG(a2))
+
+#define RWLOCK_PROBE4(name, a1, a2, a3, a4)                             \
+    __asm__ __volatile__ (RWLOCK_PROBE_ASM(name, "8@%0 8@%1 8@%2 8@%3") \
+        :: RWLOCK_PROBE_ARG(a1), RWLOCK_PROBE_ARG(a2),                  \
+           RWLOCK_PROBE_ARG(a3), RWLOCK_PROBE_ARG(a4))
+
+#else
+
+#define RWLOCK_PROBE1(name, a1)                 ((void)0)
+#define RWLOCK_PROBE2(name, a1, a2)             ((void)0)
+#define RWLOCK_PROBE4(name, a1, a2, a3, a4)     ((void)0)
+
+#endif
+
+
+#endif /* CLOCKPROBES_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,125 @@
+/**
+ *      File: LockProfiler.h
+ *    Author: CS Lim
+ *   Purpose: Sampling hold time profiler of CRWLock (RWLOCK_PROFILE)
+ *
+ *   Notes:
+ *      - Build the library and its users with RWLOCK_PROFILE defined (CMake
+ *        option RWLOCK_PROFILE), then turn sampling on at run time with
+ *        SetLockProfileRate(). Without it nothing here is compiled and
+ *        RWLOCK_PROFILE_EVENT() expands to nothing.
+ *      - Every EnterXXX()/LeaveXXX() of CRWLock decrements a thread local
+ *        countdown and nothing else. When it runs out the acquisition is
+ *        sampled: caller address, a short stack and the time. Countdown is
+ *        then set to 1, so the release (and anything the thread locks in
+ *        between) takes the slow path too and closes the sample.
+ *      - Samples add up per stack and kind (read or write) in a fixed
+ *        lock-free table. Table full drops the sample and counts it.
+ *      - WriteLockProfileCollapsed() writes the table in the collapsed
+ *        stack format of flamegraph.pl (root frame first, value is total
+ *        sampled hold time in ns). Frames are symbol names where dladdr()
+ *        finds one (export symbols of executables, -rdynamic), module+offset
+ *        otherwise, ready for addr2line.
+ *      - Times are of sampled holds only. Multiply by the rate to estimate
+ *        the totals.
+ */
+
+#ifndef CLOCKPROFILER_H
+#define CLOCKPROFILER_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#if defined(RWLOCK_PROFILE)
+
+//===========================================================================
+// Profiler
+//===========================================================================
+enum LockProfileEvent {
+    LOCK_PROFILE_ENTER_READ,
+    LOCK_PROFILE_LEAVE_READ,
+    LOCK_PROFILE_ENTER_WRITE,
+    LOCK_PROFILE_LEAVE_WRITE,
+};
+
+// Frames kept per sample, leaf (lock caller) first
+const unsigned LOCK_PROFILE_DEPTH = 16;
+
+// Distinct stacks the table holds (power of 2)
+const unsigned LOCK_PROFILE_SITES = 1024;
+
+// Lock events left until the thread's next sample. Defined in RWLock.cpp
+// so the hooks there access it directly.
+extern thread_local int t_lockProfileCountdown;
+
+// Sample one in everyN acquisitions on average, 0 (default) turns
+// sampling off. Threads pick up a change within 64K lock events.
+void SetLockProfileRate(unsigned everyN);
+unsigned GetLockProfileRate();
+
+// Slow path of RWLOCK_PROFILE_EVENT()
+RWLOCK_NOINLINE void LockProfileSample(const void * lock, LockProfileEvent event, void * caller);
+
+// One stack of the table
+struct LockProfileSite {
+    bool        write;
+    unsigned    depth;
+    void *      frames[LOCK_PROFILE_DEPTH];
+    uint64_t    count;
+    uint64_t    totalNs;
+    uint64_t    maxNs;
+};
+
+// Copy up to maxCount sites, longest total hold first. Returns the count.
+unsigned GetLockProfileSites(LockProfileSite * sites, unsigned maxCount);
+
+// Samples lost to a full table or to a release never seen
+uint64_t GetLockProfileDropped();
+
+// Symbol name (or module+offset) of a frame
+void FormatLockProfileFrame(void * address, char * buffer, size_t size);
+
+bool WriteLockProfileCollapsed(const char * path);
+void PrintLockProfileTop(FILE * file, unsigned count);
+
+// Hook of the lock functions. Must expand in the function called by the
+// user so RWLOCK_RETURN_ADDRESS() is the user's call site.
+#define RWLOCK_PROFILE_EVENT(lock, event) \
+    do { \
+        if (--t_lockProfileCountdown <= 0) \
+            LockProfileSample((lock), (event), RWLOCK_RETURN_ADDRESS()); \
+    } while (0)
+
+#else
+
+#define RWLOCK_PROFILE_EVENT(lock, event)   ((void)0)
+
+#endif /* RWLOCK_PROFILE */
+
+
+#endif /* CLOCKPROFILER_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,179 @@
+/**
+ *      File: LockStats.h
+ *    Author: CS Lim
+ *   Purpose: Compile-time lock contention statistics (RWLOCK_STATS)
+ *
+ *   Notes:
+ *      - Build the library and its users with RWLOCK_STATS defined (CMake
+ *        option RWLOCK_STATS) to turn statistics on. Lock classes change
+ *        layout, so all must agree. Without it nothing here is compiled
+ *        and RWLOCK_STAT() expands to nothing.
+ *      - Counters are per thread. A thread only writes its own row, picked
+ *        by the thread index CRWLock assigns, with a plain load and store
+ *        (no locked instruction). Rows are cache line aligned so threads
+ *        never share a line. Rows are allocated 64 threads at a time on
+ *        first use.
+ *      - CRWLock and CRWLock2 record into their own CLockStats, or into a
+ *        shared one set with SetStats(), e.g. one group for all stripes of
+ *        a TRWLockTable.
+ *      - Snapshot() sums the rows. Counters only grow, so rates come from
+ *        the difference of two snapshots.
+ *      - WriteLockStatsPrometheus() writes every named CLockStats in the
+ *        Prometheus text format. Stats with the same name are summed, so
+ *        naming several locks alike makes a group too.
+ */
+
+#ifndef CLOCKSTATS_H
+#define CLOCKSTATS_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#if defined(RWLOCK_STATS)
+
+//===========================================================================
+// Counters
+//===========================================================================
+enum LockStat {
+    LOCK_STAT_READ_FAST,        // Read acquisitions with no writer pending
+    LOCK_STAT_READ_SLOW,        // Read acquisitions that waited for a writer
+    LOCK_STAT_WRITE,            // Write acquisitions
+    LOCK_STAT_WRITE_SHARDS,     // Exclusive shard acquisitions (CRWLock2)
+    LOCK_STAT_DRAIN_SPINS,      // Pause instructions waiting for readers
+    LOCK_STAT_DRAIN_YIELDS,     // SwitchToThread() calls waiting for readers
+    LOCK_STAT_DRAIN_PARKS,      // Reader drains that slept on a futex
+    LOCK_STAT_DRAIN_NS,         // Writer time waiting for readers to leave
+    LOCK_STAT_BARRIERS,         // FlushProcessWriteBuffers() calls
+    LOCK_STAT_BARRIER_NS,       // Time spent in them
+    LOCK_STAT_WRITE_HOLD_NS,    // Time between write acquire and release
+    LOCK_STAT_COUNT
+};
+
+// Prometheus metric name (without the rwlock_ prefix) and help text
+const char * GetLockStatName(LockStat stat);
+const char * GetLockStatHelp(LockStat stat);
+
+// Counter value in nanoseconds?
+bool IsLockStatTime(LockStat stat);
+
+struct LockStatsSnapshot {
+    uint64_t    value[LOCK_STAT_COUNT];
+};
+
+// Monotonic time of the statistics in nanoseconds
+inline uint64_t LockStatNow() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        LockClock::now().time_since_epoch()
+    ).count();
+}
+
+//===========================================================================
+// CLockStats Declaration
+//===========================================================================
+class CLockStats {
+public:
+    // One thread's counters
+    struct Row {
+        std::atomic<uint64_t>   value[LOCK_STAT_COUNT];
+
+        uint8_t                 pad[
+            CACHELINE_SIZE - (sizeof(std::atomic<uint64_t>) * LOCK_STAT_COUNT) % CACHELINE_SIZE
+        ];
+
+        void Add(LockStat stat, uint64_t count);
+    };
+
+private:
+    enum : unsigned { ROWS_PER_CHUNK = 64 };
+
+    struct Chunk {
+        Row     rows[ROWS_PER_CHUNK];
+    };
+
+    std::atomic<Chunk *>    m_chunks[MAX_RWLOCK_READER_COUNT / ROWS_PER_CHUNK];
+    const char *            m_name;
+
+    // Registry of all CLockStats for the exporter
+    CLockStats *            m_prev;
+    CLockStats *            m_next;
+
+    Row & AllocRow(unsigned index);
+
+    friend bool WriteLockStatsPrometheus(const char * path);
+
+    // Non-copyable
+    CLockStats(const CLockStats &);
+    CLockStats & operator=(const CLockStats &);
+
+public:
+    // Name must stay valid while the stats live. NULL: not exported.
+    CLockStats(const char * name = NULL);
+    ~CLockStats();
+
+    const char * GetName() const;
+    void SetName(const char * name);
+
+    // Row of the thread with the given index (GetRWLockThreadIndex())
+    Row & Local(unsigned index);
+
+    // Sum of all threads
+    void Snapshot(LockStatsSnapshot * snapshot) const;
+
+    // Sum of all CLockStats with this name. False if there is none.
+    static bool Snapshot(const char * name, LockStatsSnapshot * snapshot);
+};
+
+// Write all named stats in the Prometheus text format, atomically
+// replacing path (written to path.tmp and renamed). False on I/O error.
+bool WriteLockStatsPrometheus(const char * path);
+
+//===========================================================================
+// CLockStats inline implementation
+//===========================================================================
+inline void CLockStats::Row::Add(LockStat stat, uint64_t count) {
+    // Only the owning thread writes, Snapshot() may read concurrently
+    value[stat].store(value[stat].load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
+
+inline CLockStats::Row & CLockStats::Local(unsigned index) {
+    Chunk * chunk = m_chunks[index / ROWS_PER_CHUNK].load(std::memory_order_acquire);
+    if (chunk == NULL)
+        return AllocRow(index);
+    return chunk->rows[index % ROWS_PER_CHUNK];
+}
+
+// Count into a lock's stats, nothing without RWLOCK_STATS
+#define RWLOCK_STAT(stats, index, stat, count)  ((stats)->Local(index).Add((stat), (count)))
+
+#else
+
+#define RWLOCK_STAT(stats, index, stat, count)  ((void)0)
+
+#endif /* RWLOCK_STATS */
+
+#endif /* CLOCKSTATS_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,236 @@
+/**
+ *      File: PhaseFairRWLock.h
+ *    Author: CS Lim
+ *   Purpose: Header-only phase-fair reader writer lock (ticket based PF-T of
+ *            Brandenburg and Anderson)
+ *
+ *   Notes:
+ *      - Read and write phases alternate. A writer arriving while readers
+ *        hold the lock stops new readers, so it waits for at most one read
+ *        phase. Readers blocked by a writer all enter together when it
+ *        leaves, before the next writer, so they wait for at most one write
+ *        phase. Writers are served in ticket (FIFO) order.
+ *      - m_rin counts entered readers in its upper 24 bits. Its low bits
+ *        tell arriving readers whether a writer is present, and which one
+ *        (phase id = writer's ticket & 1), so a reader released by writer
+ *        N doesn't block again on writer N+1. m_rout counts readers gone.
+ *      - Reader takes one atomic add to enter and one to leave, both on
+ *        lock-wide counters. Scales less than CRWLock with many readers,
+ *        in exchange for bounded waiting on both sides.
+ *      - Blocking = false spins (pause, then yields, see RWLockSpinWait).
+ *        Blocking = true spins as long, then sleeps on a futex. Waiters
+ *        announce themselves in the low bits (or a counter), so leaving
+ *        the lock costs no syscall unless someone sleeps.
+ *      - No reentrance. R -> R blocks behind a waiting writer and deadlocks.
+ */
+
+#ifndef CPHASEFAIRRWLOCK_H
+#define CPHASEFAIRRWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+//===========================================================================
+// TPhaseFairRWLock Declaration
+//===========================================================================
+template <bool Blocking>
+class TPhaseFairRWLock {
+private:
+    enum : uint32_t {
+        PHASE_ID        = 0x1,      // m_rin: ticket & 1 of the present writer
+        PRESENT         = 0x2,      // m_rin: writer present
+        WRITER_BITS     = PHASE_ID | PRESENT,
+        READERS_PARKED  = 0x4,      // m_rin: readers sleep on m_rin
+        WRITER_PARKED   = 0x4,      // m_rout: writer sleeps on m_rout
+        FLAG_BITS       = 0xff,
+        READER_INC      = 0x100,
+    };
+
+    // Each written by different parties, so each on its own cache line:
+    // arriving readers, leaving readers, and writers
+    std::atomic<uint32_t>   m_rin;
+    uint8_t                 m_pad1[CACHELINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+    std::atomic<uint32_t>   m_rout;
+    uint8_t                 m_pad2[CACHELINE_SIZE - sizeof(std::atomic<uint32_t>)];
+
+    // Writer tickets: next to hand out, now served
+    std::atomic<uint32_t>   m_win;
+    std::atomic<uint32_t>   m_wout;
+    std::atomic<uint32_t>   m_writersParked;
+
+    RWLOCK_NOINLINE void WaitForWriter(uint32_t writer);
+    RWLOCK_NOINLINE void WaitForTicket(uint32_t ticket);
+    RWLOCK_NOINLINE void WaitForReaders(uint32_t entered);
+
+    // Non-copyable
+    TPhaseFairRWLock(const TPhaseFairRWLock &);
+    TPhaseFairRWLock & operator=(const TPhaseFairRWLock &);
+
+public:
+    TPhaseFairRWLock();
+    void EnterRead();
+    void EnterWrite();
+    void LeaveRead();
+    void LeaveWrite();
+};
+
+// Spin (and yield) while waiting
+typedef TPhaseFairRWLock<false> CPhaseFairSpinRWLock;
+
+// Spin, then sleep on a futex
+typedef TPhaseFairRWLock<true>  CPhaseFairRWLock;
+
+//===========================================================================
+// TPhaseFairRWLock inline implementation
+//===========================================================================
+template <bool Blocking>
+TPhaseFairRWLock<Blocking>::TPhaseFairRWLock() {
+    m_rin.store(0, std::memory_order_relaxed);
+    m_rout.store(0, std::memory_order_relaxed);
+    m_win.store(0, std::memory_order_relaxed);
+    m_wout.store(0, std::memory_order_relaxed);
+    m_writersParked.store(0, std::memory_order_relaxed);
+}
+
+template <bool Blocking>
+inline void TPhaseFairRWLock<Blocking>::EnterRead() {
+    uint32_t writer = m_rin.fetch_add(READER_INC, std::memory_order_acquire) & WRITER_BITS;
+    if (writer != 0)
+        WaitForWriter(writer);
+}
+
+template <bool Blocking>
+inline void TPhaseFairRWLock<Blocking>::LeaveRead() {
+    uint32_t prev = m_rout.fetch_add(READER_INC, std::memory_order_release);
+    if (Blocking && (prev & WRITER_PARKED))
+        FutexWakeAll(&m_rout);
+}
+
+template <bool Blocking>
+inline void TPhaseFairRWLock<Blocking>::EnterWrite() {
+    // Wait for our turn among writers
+    uint32_t ticket = m_win.fetch_add(1, std::memory_order_relaxed);
+    if (m_wout.load(std::memory_order_acquire) != ticket)
+        WaitForTicket(ticket);
+
+    // Stop new readers, then wait for the ones that came before us
+    uint32_t entered = m_rin.fetch_add(PRESENT | (ticket & PHASE_ID), std::memory_order_acq_rel) & ~FLAG_BITS;
+    if ((m_rout.load(std::memory_order_acquire) & ~FLAG_BITS) != entered)
+        WaitForReaders(entered);
+}
+
+template <bool Blocking>
+inline void TPhaseFairRWLock<Blocking>::LeaveWrite() {
+    // Readers blocked by us go first
+    uint32_t prev = m_rin.fetch_and(~(uint32_t)FLAG_BITS, std::memory_order_release);
+    if (Blocking && (prev & READERS_PARKED))
+        FutexWakeAll(&m_rin);
+
+    // Then the next writer. seq_cst pairs with WaitForTicket() so that
+    // either it sees the new ticket or we see it parked.
+    m_wout.store(m_wout.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    if (Blocking && m_writersParked.load(std::memory_order_seq_cst))
+        FutexWakeAll(&m_wout);
+}
+
+template <bool Blocking>
+void TPhaseFairRWLock<Blocking>::WaitForWriter(uint32_t writer) {
+    // Already counted in m_rin, so the writer of the next phase (other
+    // phase id) waits for us
+    for (unsigned i = 0; ; i++) {
+        uint32_t rin = m_rin.load(std::memory_order_acquire);
+        if ((rin & WRITER_BITS) != writer)
+            return;
+
+        if (!Blocking || i < RWLOCK_SPIN_WAIT_LIMIT) {
+            RWLockSpinWait::Wait(i);
+            continue;
+        }
+
+        // LeaveWrite() clears READERS_PARKED and wakes us
+        if (!(rin & READERS_PARKED)) {
+            rin = m_rin.fetch_or(READERS_PARKED, std::memory_order_acquire);
+            if ((rin & WRITER_BITS) != writer)
+                return;
+            rin |= READERS_PARKED;
+        }
+        FutexWait(&m_rin, rin);
+    }
+}
+
+template <bool Blocking>
+void TPhaseFairRWLock<Blocking>::WaitForTicket(uint32_t ticket) {
+    for (unsigned i = 0; ; i++) {
+        uint32_t served = m_wout.load(std::memory_order_acquire);
+        if (served == ticket)
+            return;
+
+        if (!Blocking || i < RWLOCK_SPIN_WAIT_LIMIT) {
+            RWLockSpinWait::Wait(i);
+            continue;
+        }
+
+        // Every parked writer wakes up on each LeaveWrite(), only the one
+        // holding the next ticket goes on
+        m_writersParked.fetch_add(1, std::memory_order_seq_cst);
+        if (m_wout.load(std::memory_order_seq_cst) == served)
+            FutexWait(&m_wout, served);
+        m_writersParked.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+template <bool Blocking>
+void TPhaseFairRWLock<Blocking>::WaitForReaders(uint32_t entered) {
+    for (unsigned i = 0; ; i++) {
+        uint32_t rout = m_rout.load(std::memory_order_acquire);
+        if ((rout & ~FLAG_BITS) == entered)
+            break;
+
+        if (!Blocking || i < RWLOCK_SPIN_WAIT_LIMIT) {
+            RWLockSpinWait::Wait(i);
+            continue;
+        }
+
+        // Leaving readers wake us while WRITER_PARKED is set. Only the
+        // writer holding the ticket sets it.
+        if (!(rout & WRITER_PARKED)) {
+            rout = m_rout.fetch_or(WRITER_PARKED, std::memory_order_acquire);
+            if ((rout & ~FLAG_BITS) == entered)
+                break;
+            rout |= WRITER_PARKED;
+        }
+        FutexWait(&m_rout, rout);
+    }
+
+    if (Blocking && (m_rout.load(std::memory_order_relaxed) & WRITER_PARKED))
+        m_rout.fetch_and(~(uint32_t)WRITER_PARKED, std::memory_order_relaxed);
+}
+
+
+#endif /* CPHASEFAIRRWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -0,0 +1,139 @@
+/**
+ *      File: RCU.h
+ *    Author: CS Lim
+ *   Purpose: User-space RCU domain on top of the asymmetric barrier
+ *            (FlushProcessWriteBuffers) used by CRWLock
+ *
+ *   Notes:
+ *      - ReadLock()/ReadUnlock() mark a read-side critical section. They
+ *        never wait and never write shared memory other than the calling
+ *        thread's own slot. Sections nest.
+ *      - Publish new data with std::atomic<T *>::store(memory_order_release)
+ *        and read it with load(memory_order_acquire) inside the section.
+ *      - Synchronize() returns once every read section that started before
+ *        it has ended. Don't call it inside a read section (deadlock).
+ *      - Retire() hands an unlinked object to the background reclaimer,
+ *        which frees retired objects in batches after a grace period.
+ *        Barrier() waits until everything retired so far has been freed.
+ */
+
+#ifndef CRCUDOMAIN_H
+#define CRCUDOMAIN_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+// Retired objects freed per grace period at most
+const unsigned RCU_RETIRE_BATCH = 256;
+
+// Reclaimer runs at least this often while objects are pending
+const unsigned RCU_RECLAIM_INTERVAL_MS = 10;
+
+// Full batches pending before Retire() waits for the reclaimer
+const unsigned RCU_MAX_PENDING_BATCHES = 64;
+
+//===========================================================================
+// CRCUDomain Declaration
+//===========================================================================
+class CRCUDomain {
+private:
+    struct ReaderSlot;
+    struct RetireBatch;
+
+    // One slot per reader thread index (see GetRWLockThreadIndex()).
+    // Grace period the read section started in, 0 outside read sections.
+    ReaderSlot *            m_readers;
+
+    // Current grace period, starts at 1
+    std::atomic<uint64_t>   m_period;
+
+    // Retired objects. m_retireHead is being filled, full batches are
+    // queued behind it.
+    CCritSect               m_retireLock;
+    RetireBatch *           m_retireHead;
+    unsigned                m_pendingBatches;
+    uint64_t                m_retiredCount;
+
+    // Reclaimer thread sleeps on m_reclaimWake, Barrier() on m_reclaimDone
+    std::thread             m_reclaimer;
+    std::atomic<bool>       m_stop;
+    std::atomic<uint32_t>   m_reclaimWake;
+    std::atomic<uint32_t>   m_reclaimDone;
+    std::atomic<uint64_t>   m_reclaimedCount;
+
+    // Statistics
+    std::atomic<uint64_t>   m_gracePeriods;
+
+    void WaitForReaders(uint64_t period);
+    RetireBatch * TakeRetired();
+    void Reclaim(RetireBatch * batch);
+    void ReclaimProc();
+
+    // Non-copyable
+    CRCUDomain(const CRCUDomain &);
+    CRCUDomain & operator=(const CRCUDomain &);
+
+public:
+    CRCUDomain();
+    ~CRCUDomain();
+
+    void ReadLock();
+    void ReadUnlock();
+    bool InReadSection() const;
+
+    // Wait for a grace period
+    void Synchronize();
+
+    // Call deleter(ptr) after a grace period, on the reclaimer thread.
+    // ptr must already be unreachable for new readers.
+    void Retire(void * ptr, void (* deleter)(void *));
+    template <class T>
+    void Retire(T * ptr);
+
+    // Wait until every object retired before the call has been freed
+    void Barrier();
+
+    uint64_t GetGracePeriods() const;
+    uint64_t GetReclaimedCount() const;
+};
+
+//===========================================================================
+// CRCUDomain inline implementation
+//===========================================================================
+template <class T>
+void CRCUDomain::Retire(T * ptr) {
+    struct Deleter {
+        static void Invoke(void * object) {
+            delete (T *)object;
+        }
+    };
+    Retire(ptr, &Deleter::Invoke);
+}
+
+
+#endif /* CRCUDOMAIN_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
@@ -1,7 +1,7 @@
 /**
  *      File: RWLock.h
  *    Author: CS Lim
- *   Purpose: Implement asymmetric reader writer lock in Windows
+ *   Purpose: Implement asymmetric reader writer lock in Windows and Linux
  */
 
 #ifndef CRWLOCK_H
@@ -11,41 +11,195 @@
 #pragma once
 #endif
 
+#include <stdint.h>
 #include <atomic>
 
 // @@@ TODO:
 // @@@  C++11 (RAII, std::atomic, and etc.)
-// @@@  Port to other compilers like clang
-// @@@  Improve m_readers array and m_ownerThreadId.
-// @@@      Limitation of number of reader threads (MAX_RWLOCK_READER_COUNT)
-// @@@      Bitmap can be used
 // @@@  Perf comparison graphs
 
-// Maximum supported reader threads
-const unsigned MAX_RWLOCK_READER_COUNT = 64;
+// Reader slots embedded in every CRWLock. Slots beyond are allocated
+// per lock on first use.
+const unsigned RWLOCK_INLINE_READER_COUNT = 64;
+
+// Maximum supported reader threads alive at the same time
+const unsigned MAX_RWLOCK_READER_COUNT = 4096;
+
+#if defined(RWLOCK_STATS)
+class CLockStats;
+#endif
+
+//===========================================================================
+// Writer wait policy while draining readers in CRWLock::EnterWrite()
+//  Spin with exponential backoff (pause), then yield, then sleep on a
+//  futex until the last reader leaves.
+//===========================================================================
+struct RWLockWaitPolicy {
+    unsigned    spinLimit;      // Pause instructions before yielding
+    unsigned    yieldLimit;     // SwitchToThread() calls before parking
+    bool        adaptive;       // Tune spinLimit from observed drain times
+    bool        park;           // Sleep once yieldLimit is exceeded
+};
+
+// Spin -> yield -> park, spin limit self-tuned (default)
+extern const RWLockWaitPolicy RWLOCK_WAIT_ADAPTIVE;
+
+// SwitchToThread() until readers drain (original behavior)
+extern const RWLockWaitPolicy RWLOCK_WAIT_YIELD;
 
 //===========================================================================
 // CRWLock Declaration
 //===========================================================================
 class CRWLock {
 private:
+    struct DrainState;
+    struct CombineRequest;
+
     CCritSect       m_critSect;
-    unsigned        m_ownerThreadId;
+
+    // Reader slot (thread index) of the writer, 0 if none
+    std::atomic<unsigned>   m_ownerThreadId;
+
+    // Nested EnterWrite() calls of the writer (W -> W)
+    unsigned                m_writeRecursion;
 
     // Private flag for every reader
-    volatile uint8_t    m_readers[MAX_RWLOCK_READER_COUNT];
-    std::atomic<bool>   m_writerPending;
+    std::atomic<uint8_t>    m_readers[RWLOCK_INLINE_READER_COUNT];
+    std::atomic<bool>       m_writerPending;
+
+    // Readers blocked by a writer sleep on m_writeGeneration, which
+    // LeaveWrite() bumps and broadcasts when m_readersParked != 0. The
+    // next writer waits for m_readersParked to drop to 0 before it drains.
+    std::atomic<uint32_t>   m_writeGeneration;
+    std::atomic<uint32_t>   m_readersParked;
+
+    // Writer sleeps on m_writerWake. Leaving readers wake it up only
+    // when m_writerParked is set.
+    std::atomic<bool>       m_writerParked;
+    std::atomic<uint32_t>   m_writerWake;
+
+    // Flags for reader slots [RWLOCK_INLINE_READER_COUNT .. MAX_RWLOCK_READER_COUNT)
+    std::atomic<std::atomic<uint8_t> *> m_overflowReaders;
+
+    // Seqlock version for optimistic readers, odd while a writer runs
+    std::atomic<uint32_t>   m_sequence;
+
+    // Pending ExecuteWrite() requests and the combiner running them
+    std::atomic<CombineRequest *>   m_combineHead;
+    std::atomic<bool>               m_combining;
+
+    // Owned by the writer (changed inside m_critSect only)
+    RWLockWaitPolicy        m_waitPolicy;
+    unsigned                m_spinLimit;
+
+#if defined(RWLOCK_STATS)
+    // Contention statistics (see LockStats.h), m_ownStats unless shared
+    CLockStats *            m_ownStats;
+    CLockStats *            m_stats;
+    uint64_t                m_writeStart;   // Owned by the writer
+#endif
+
+    std::atomic<uint8_t> & ReaderFlag(unsigned index);
+    std::atomic<uint8_t> & OverflowReaderFlag(unsigned index);
+    void WakeWriter();
+    bool WaitForReaders(const std::atomic<uint8_t> * flags, unsigned count, DrainState & state);
+    bool WaitForReader(const std::atomic<uint8_t> & flag, DrainState & state);
+    void ParkWriter(const std::atomic<uint8_t> & flag, const DrainState & state);
+    bool WaitForWriter(std::atomic<uint8_t> & flag, const LockClock::time_point * deadline);
+    bool EnterReadInternal(const LockClock::time_point * deadline);
+    bool EnterWriteInternal(const LockClock::time_point * deadline);
+    bool DrainReaders(const LockClock::time_point * deadline);
+    void ReleaseWrite();
+    void Combine();
+    void FlushBarrier();
 
 public:
-    CRWLock();
+    CRWLock(const RWLockWaitPolicy & waitPolicy = RWLOCK_WAIT_ADAPTIVE);
+    ~CRWLock();
     void EnterRead();
     void EnterWrite();
     void LeaveRead();
     void LeaveWrite();
+
+    // Return false without the lock if it can't be taken right away or
+    // before the deadline
+    bool TryEnterRead();
+    bool TryEnterWrite();
+    bool EnterReadUntil(const LockClock::time_point & deadline);
+    bool EnterWriteUntil(const LockClock::time_point & deadline);
+
+    // Optimistic read: read shared data between ReadBegin() and
+    // ReadValidate(), and retry while ReadValidate() returns false. Data
+    // may be torn until validated, so don't follow pointers read from it.
+    unsigned ReadBegin();
+    bool ReadValidate(unsigned version);
+
+    // Run fn(context) under the write lock. Writers queued at the same
+    // time are run by a single thread under one EnterWrite(). Returns
+    // after fn has run. fn runs as writer, so it may call EnterRead() but
+    // must not wait for other ExecuteWrite() calls.
+    void ExecuteWrite(void (* fn)(void *), void * context);
+    template <class Fn>
+    void ExecuteWrite(const Fn & fn);
+
+    // Upgradable read: shares the lock with plain readers but excludes
+    // writers and other upgraders, so it can become the writer without
+    // releasing the lock. Leave with LeaveWrite() after UpgradeToWrite().
+    void EnterUpgradable();
+    void LeaveUpgradable();
+    void UpgradeToWrite();
+
+    // Write lock becomes read lock without letting another writer in.
+    // Leave with LeaveRead().
+    void DowngradeWrite();
+
+#if defined(RWLOCK_STATS)
+    // Statistics this lock counts into. SetStats() shares one CLockStats
+    // between locks, call it before the lock is used.
+    CLockStats & GetStats();
+    void SetStats(CLockStats & stats);
+#endif
 };
 
 void InitRWLock();
 
+// Reader slot (thread index) of the calling thread, assigned on first use,
+// and one past the highest slot in use. Shared with CRCUDomain,
+// CReaderIndicator and TAsymRWLock.
+extern thread_local unsigned t_rwlockThreadIndex;
+unsigned AllocRWLockThreadIndex();
+inline unsigned GetRWLockThreadIndex();
+unsigned GetRWLockThreadHighWater();
+
+// Index of the first non-zero reader flag in [0, count), count if none.
+// Vectorized scan used by CRWLock writers.
+unsigned FindBusyRWLockReader(const std::atomic<uint8_t> * flags, unsigned count);
+
+// One scan implementation by name ("Scalar", "SSE2" or "AVX2"), NULL if
+// not built in or not supported by this CPU. For benchmarks.
+typedef unsigned (*FindBusyRWLockReaderFn)(const std::atomic<uint8_t> * flags, unsigned count);
+FindBusyRWLockReaderFn GetFindBusyRWLockReader(const char * name);
+
+//===========================================================================
+// CRWLock inline implementation
+//===========================================================================
+inline unsigned GetRWLockThreadIndex() {
+    unsigned index = t_rwlockThreadIndex;
+    if (index == 0)
+        index = AllocRWLockThreadIndex();
+    return index;
+}
+
+template <class Fn>
+void CRWLock::ExecuteWrite(const Fn & fn) {
+    struct Thunk {
+        static void Invoke(void * context) {
+            (*(const Fn *)context)();
+        }
+    };
+    ExecuteWrite(&Thunk::Invoke, (void *)&fn);
+}
+
 #endif /* CRWLOCK_H */
 
 //===========================================================================
@@ -16,7 +16,29 @@
 //===========================================================================
 class CRWLock2 {
 private:
+#if defined(_WIN32)
     SRWLOCK    *    m_lock;
+#else
+    // Each processor's lock word on its own cache line, so that readers
+    // only touch the cache line of the CPU they are running on
+    struct ProcLock {
+        CFutexRWLock    lock;
+        uint8_t         pad[CACHELINE_SIZE - sizeof(CFutexRWLock)];
+    };
+    ProcLock   *    m_lock;
+#endif
+
+#if defined(RWLOCK_STATS)
+    // Contention statistics (see LockStats.h), m_ownStats unless shared
+    CLockStats *    m_ownStats;
+    CLockStats *    m_stats;
+    uint64_t        m_writeStart;   // Owned by the writer
+#endif
+
+    // Statistics of write acquisitions, empty without RWLOCK_STATS
+    uint64_t WriteStatStart ();
+    void WriteStatAcquired (uint64_t start);
+    void WriteStatRelease ();
 
 public:
     CRWLock2 ();
@@ -25,6 +47,20 @@ public:
     void EnterWrite ();
     void LeaveRead ();
     void LeaveWrite ();
+
+    // Return false without the lock if it can't be taken right away or
+    // before the deadline. A writer that gives up holds none of the shards.
+    bool TryEnterRead ();
+    bool TryEnterWrite ();
+    bool EnterReadUntil (const LockClock::time_point & deadline);
+    bool EnterWriteUntil (const LockClock::time_point & deadline);
+
+#if defined(RWLOCK_STATS)
+    // Statistics this lock counts into. SetStats() shares one CLockStats
+    // between locks, call it before the lock is used.
+    CLockStats & GetStats ();
+    void SetStats (CLockStats & stats);
+#endif
 };
 
 
@@ -0,0 +1,169 @@
+/**
+ *      File: RWLockTable.h
+ *    Author: CS Lim
+ *   Purpose: Striped table of reader writer locks for many small objects
+ *
+ *   Notes:
+ *      - Objects (addresses or integer keys) hash onto a fixed pool of
+ *        stripes, so an object costs nothing and the table costs one
+ *        lock per stripe.
+ *      - Stripe is any lock with EnterRead/LeaveRead/EnterWrite/LeaveWrite,
+ *        e.g. CRWLock (asymmetric) or CRWLock2 (per-processor).
+ *      - Different objects may share a stripe. To hold several objects at
+ *        once take their stripes in increasing StripeOf() order, and each
+ *        stripe only once. CRWLock2 stripes allow up to
+ *        MAX_HELD_READ_LOCKS (16) read stripes held at once per thread.
+ */
+
+#ifndef CRWLOCKTABLE_H
+#define CRWLOCKTABLE_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+//===========================================================================
+// TRWLockTable Declaration
+//===========================================================================
+template <class Lock>
+class TRWLockTable {
+private:
+    Lock *      m_stripes;
+    unsigned    m_mask;
+    unsigned    m_shift;
+
+    // Non-copyable
+    TRWLockTable(const TRWLockTable &);
+    TRWLockTable & operator=(const TRWLockTable &);
+
+public:
+    // Stripe count is rounded up to a power of 2
+    TRWLockTable(unsigned stripeCount);
+    ~TRWLockTable();
+
+    unsigned GetStripeCount() const;
+    unsigned StripeOf(uint64_t key) const;
+    unsigned StripeOf(const void * object) const;
+    Lock & GetStripe(unsigned stripe);
+
+    void EnterRead(uint64_t key);
+    void LeaveRead(uint64_t key);
+    void EnterWrite(uint64_t key);
+    void LeaveWrite(uint64_t key);
+
+    void EnterRead(const void * object);
+    void LeaveRead(const void * object);
+    void EnterWrite(const void * object);
+    void LeaveWrite(const void * object);
+};
+
+//===========================================================================
+// TRWLockTable inline implementation
+//===========================================================================
+template <class Lock>
+TRWLockTable<Lock>::TRWLockTable(unsigned stripeCount) {
+    unsigned bits = 0;
+    while ((1u << bits) < stripeCount && bits < 31)
+        bits++;
+
+    m_stripes = new Lock[1u << bits];
+    m_mask = (1u << bits) - 1;
+    m_shift = 64 - bits;
+}
+
+template <class Lock>
+TRWLockTable<Lock>::~TRWLockTable() {
+    delete [] m_stripes;
+}
+
+template <class Lock>
+inline unsigned TRWLockTable<Lock>::GetStripeCount() const {
+    return m_mask + 1;
+}
+
+template <class Lock>
+inline unsigned TRWLockTable<Lock>::StripeOf(uint64_t key) const {
+    // Fibonacci hashing: top bits of key * 2^64 / golden ratio. Spreads
+    // sequential keys and aligned addresses (zero low bits) evenly.
+    if (m_mask == 0)
+        return 0;
+    return (unsigned)((key * 0x9E3779B97F4A7C15ull) >> m_shift);
+}
+
+template <class Lock>
+inline unsigned TRWLockTable<Lock>::StripeOf(const void * object) const {
+    return StripeOf((uint64_t)(uintptr_t)object);
+}
+
+template <class Lock>
+inline Lock & TRWLockTable<Lock>::GetStripe(unsigned stripe) {
+    _ASSERT(stripe <= m_mask);
+    return m_stripes[stripe];
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::EnterRead(uint64_t key) {
+    m_stripes[StripeOf(key)].EnterRead();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::LeaveRead(uint64_t key) {
+    m_stripes[StripeOf(key)].LeaveRead();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::EnterWrite(uint64_t key) {
+    m_stripes[StripeOf(key)].EnterWrite();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::LeaveWrite(uint64_t key) {
+    m_stripes[StripeOf(key)].LeaveWrite();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::EnterRead(const void * object) {
+    m_stripes[StripeOf(object)].EnterRead();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::LeaveRead(const void * object) {
+    m_stripes[StripeOf(object)].LeaveRead();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::EnterWrite(const void * object) {
+    m_stripes[StripeOf(object)].EnterWrite();
+}
+
+template <class Lock>
+inline void TRWLockTable<Lock>::LeaveWrite(const void * object) {
+    m_stripes[StripeOf(object)].LeaveWrite();
+}
+
+
+#endif /* CRWLOCKTABLE_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file
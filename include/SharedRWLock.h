@@ -0,0 +1,121 @@
+/**
+ *      File: SharedRWLock.h
+ *    Author: CS Lim
+ *   Purpose: Asymmetric reader writer lock shared by processes mapping the
+ *            same memory (Linux)
+ */
+
+#ifndef CSHAREDRWLOCK_H
+#define CSHAREDRWLOCK_H
+
+#if defined (_MSC_VER) && (_MSC_VER >= 1020)
+#pragma once
+#endif
+
+#if !defined(_WIN32)
+
+// Reader slots of a CSharedRWLock, shared by the threads of all processes
+// using it
+const unsigned MAX_SHARED_READER_COUNT = 256;
+
+//===========================================================================
+// CSharedRWLock Declaration
+//  Same reader protocol as CRWLock, with all of its state inside the
+//  object so it works from a MAP_SHARED mapping (at any address):
+//    - Reader slots are claimed per lock by (pid, tid) instead of the
+//      process local thread index.
+//    - Writers exclude each other with a robust process-shared mutex.
+//    - The heavy barrier is membarrier(MEMBARRIER_CMD_GLOBAL_EXPEDITED),
+//      which reaches every registered process.
+//
+//  Construct it once in the shared memory (placement new) before other
+//  processes use it, destroy it after the last one is done. No reentrance
+//  or upgrades. Don't fork while holding it.
+//===========================================================================
+class CSharedRWLock {
+private:
+    // Robust process-shared mutex of the writers. Passed on with
+    // EOWNERDEAD when a writer dies holding it.
+    pthread_mutex_t         m_writerMutex;
+
+    // (pid << 32 | tid) of the writer, 0 if none
+    std::atomic<uint64_t>   m_writerOwner;
+    std::atomic<uint8_t>    m_writerPending;
+
+    // Same handshakes as CRWLock, on process-shared futexes
+    std::atomic<uint32_t>   m_writeGeneration;
+    std::atomic<uint32_t>   m_readersParked;
+    std::atomic<uint8_t>    m_writerParked;
+    std::atomic<uint32_t>   m_writerWake;
+
+    // Owners that died holding the lock and were recovered
+    std::atomic<uint32_t>   m_deadReaders;
+    std::atomic<uint32_t>   m_deadWriters;
+
+    // One past the highest slot ever claimed. Writers scan below it.
+    std::atomic<uint32_t>   m_slotHighWater;
+
+    // (pid << 32 | tid) of each slot's thread, 0 if free
+    std::atomic<uint64_t>   m_slotOwners[MAX_SHARED_READER_COUNT];
+
+    // Private flag for every reader slot
+    std::atomic<uint8_t>    m_readers[MAX_SHARED_READER_COUNT];
+
+    unsigned LocalSlot();
+    unsigned ClaimSlot();
+    bool ReclaimSlot(unsigned index, uint64_t owner);
+    unsigned ReclaimDeadSlots();
+    void WakeWriter();
+    void WaitForReader(unsigned index);
+    void WaitForWriter(std::atomic<uint8_t> & flag);
+    void RecoverWriter();
+    void ReleaseWrite();
+
+public:
+    CSharedRWLock();
+    ~CSharedRWLock();
+    void EnterRead();
+    void EnterWrite();
+    void LeaveRead();
+    void LeaveWrite();
+
+    // Give back the calling thread's reader slot. Call before the thread
+    // exits or the process unmaps the lock, if others keep using it.
+    // Slots of exited threads are otherwise reclaimed when slots run out.
+    void ReleaseSlot();
+
+    // Read and write holders that died and were recovered. Data written
+    // by a dead writer may be half done, a writer can check this to see
+    // if it must repair it.
+    unsigned GetDeadReaders() const;
+    unsigned GetDeadWriters() const;
+};
+
+#endif /* !_WIN32 */
+
+
+#endif /* CSHAREDRWLOCK_H */
+
+//===========================================================================
+// MIT License
+//
+// Copyright (c) 2010 by Chae Seong Lim
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//===========================================================================
\ No newline at end of file